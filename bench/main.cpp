@@ -0,0 +1,455 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include <QtCore>
+#include <QtNetwork>
+#include "proxyserver.h"
+
+// proxy-bench: drives N concurrent virtual users through the proxy against a
+// local origin and reports connects/s, MB/s and time-to-first-byte percentiles.
+
+static constexpr qint64 kChunkSize = 64 * 1024;
+
+///
+/// \brief The OriginServer class
+/// Minimal HTTP origin: "GET /bytes/<n>" is answered with n bytes, then the connection closes.
+///
+class OriginServer final : public QTcpServer {
+    Q_OBJECT
+
+  public:
+    explicit OriginServer(QObject* parent = nullptr);
+
+  protected:
+    void incomingConnection(qintptr handle) override;
+
+  private:
+    void serve(QTcpSocket* socket, qint64 size);
+    void stream(QTcpSocket* socket);
+
+    QByteArray _chunk;
+};
+
+///
+/// \brief The BenchStats struct
+///
+struct BenchStats {
+    quint64 completed = 0;
+    quint64 failed    = 0;
+    quint64 bytes     = 0;
+    QVector<qint64> connectLatency;  // ns, proxy connect until the tunnel/request can be sent
+    QVector<qint64> ttfb;            // ns, request sent until the first response byte
+};
+
+///
+/// \brief The BenchClient class
+/// One virtual user: connect through the proxy, fetch, close, repeat until the deadline.
+///
+class BenchClient final : public QObject {
+    Q_OBJECT
+
+  public:
+    enum class Mode {
+        Connect,
+        Get
+    };
+
+    BenchClient(const QHostAddress& proxy, quint16 proxyPort, const QHostAddress& origin, quint16 originPort,
+                Mode mode, qint64 size, const QDeadlineTimer& deadline, BenchStats& stats, QObject* parent = nullptr);
+
+    void start();
+
+  Q_SIGNALS:
+    void finished();
+
+  private:
+    enum class State {
+        Connecting,
+        Tunneling,
+        Requesting,
+        Receiving
+    };
+
+    void readyRead();
+    void sendRequest();
+    void complete(bool success);
+
+    const QHostAddress _proxy;
+    const quint16 _proxyPort = 0;
+    const QHostAddress _origin;
+    const quint16 _originPort = 0;
+    const Mode _mode;
+    const qint64 _size = 0;
+    const QDeadlineTimer _deadline;
+    BenchStats& _stats;
+
+    QTcpSocket* _socket = nullptr;
+    State _state        = State::Connecting;
+    QByteArray _head;
+    QElapsedTimer _clock;
+    qint64 _connectStarted = 0;
+    qint64 _requestSent    = 0;
+    qint64 _expected       = -1;
+    qint64 _received       = 0;
+};
+
+static qint64 percentile(QVector<qint64> values, double p) {
+    if (values.isEmpty()) {
+        return 0;
+    }
+
+    std::sort(values.begin(), values.end());
+    const auto index = qMin(values.size() - 1, static_cast<int>(p * values.size()));
+    return values.at(index);
+}
+
+static bool parseEndpoint(const QString& value, QHostAddress& address, quint16& port) {
+    const auto colon = value.lastIndexOf(QLatin1Char(':'));
+    auto ok          = false;
+
+    if (colon <= 0) {
+        return false;
+    }
+
+    port = value.mid(colon + 1).toUShort(&ok);
+    return ok && address.setAddress(value.left(colon).remove(QLatin1Char('[')).remove(QLatin1Char(']')));
+}
+
+int main(int argc, char* argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("DllProxyServer"));
+    QCoreApplication::setApplicationVersion(QStringLiteral("1.0.0"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Load generator and benchmark for the proxy server"));
+    parser.addHelpOption();
+    parser.addOptions({
+        {QStringLiteral("proxy"), QStringLiteral("Benchmark a running proxy instead of an in-process one."), QStringLiteral("host:port")},
+        {QStringLiteral("settings"), QStringLiteral("INI file to configure the in-process proxy from."), QStringLiteral("file")},
+        {QStringLiteral("workers"), QStringLiteral("Worker threads of the in-process proxy (0: one per core)."), QStringLiteral("n"), QStringLiteral("0")},
+        {QStringLiteral("connections"), QStringLiteral("Concurrent virtual users."), QStringLiteral("n"), QStringLiteral("100")},
+        {QStringLiteral("duration"), QStringLiteral("Run time in seconds."), QStringLiteral("s"), QStringLiteral("10")},
+        {QStringLiteral("size"), QStringLiteral("Response body size per request in bytes."), QStringLiteral("bytes"), QStringLiteral("65536")},
+        {QStringLiteral("mode"), QStringLiteral("connect, get or mixed."), QStringLiteral("mode"), QStringLiteral("mixed")},
+    });
+    parser.process(app);
+
+    // origin on its own thread so it does not compete with the clients
+    QThread originThread;
+    auto origin = new OriginServer;
+    origin->moveToThread(&originThread);
+    QObject::connect(&originThread, &QThread::finished, origin, &QObject::deleteLater);
+    originThread.start();
+
+    auto originListening = false;
+    QMetaObject::invokeMethod(origin, [&]() {
+        originListening = origin->listen(QHostAddress::LocalHost, 0);
+    }, Qt::BlockingQueuedConnection);
+
+    if (!originListening) {
+        qCritical() << QStringLiteral("Origin failed to listen:") << origin->errorString();
+        return EXIT_FAILURE;
+    }
+
+    QHostAddress proxyAddress(QHostAddress::LocalHost);
+    quint16 proxyPort = 0;
+    QScopedPointer<DnsCache> dnsCache;
+    QScopedPointer<WorkerPool> pool;
+    QScopedPointer<ProxyServer> proxy;
+
+    if (parser.isSet(QStringLiteral("proxy"))) {
+        if (!parseEndpoint(parser.value(QStringLiteral("proxy")), proxyAddress, proxyPort)) {
+            qCritical() << QStringLiteral("Invalid --proxy, expected host:port");
+            return EXIT_FAILURE;
+        }
+    } else {
+        ProxyConfig config;
+
+        if (parser.isSet(QStringLiteral("settings"))) {
+            Settings settings(parser.value(QStringLiteral("settings")));
+            config = ProxyConfig::load(settings);
+        }
+
+        config.workers = parser.value(QStringLiteral("workers")).toInt();
+        dnsCache.reset(config.dnsCache ? new DnsCache(config.dnsCacheLimits) : nullptr);
+        pool.reset(new WorkerPool(config));
+        proxy.reset(new ProxyServer(pool->workers()));
+
+        if (!proxy->listen(QHostAddress::LocalHost, 0)) {
+            qCritical() << QStringLiteral("Proxy failed to listen:") << proxy->errorString();
+            return EXIT_FAILURE;
+        }
+
+        proxyPort = proxy->serverPort();
+    }
+
+    const auto connections = qMax(1, parser.value(QStringLiteral("connections")).toInt());
+    const auto duration    = qMax(1, parser.value(QStringLiteral("duration")).toInt());
+    const auto size        = qMax<qint64>(0, parser.value(QStringLiteral("size")).toLongLong());
+    const auto mode        = parser.value(QStringLiteral("mode"));
+    const QDeadlineTimer deadline(duration * 1000);
+
+    BenchStats stats;
+    auto running = connections;
+    QElapsedTimer elapsed;
+    elapsed.start();
+
+    for (auto i = 0; i < connections; ++i) {
+        auto clientMode = BenchClient::Mode::Connect;
+
+        if ((mode == QLatin1String("get")) || ((mode == QLatin1String("mixed")) && (i % 2))) {
+            clientMode = BenchClient::Mode::Get;
+        }
+
+        auto client = new BenchClient(proxyAddress, proxyPort, QHostAddress::LocalHost, origin->serverPort(),
+                                      clientMode, size, deadline, stats, &app);
+        QObject::connect(client, &BenchClient::finished, &app, [&]() {
+            if (--running == 0) {
+                QCoreApplication::quit();
+            }
+        });
+        client->start();
+    }
+
+    QCoreApplication::exec();
+
+    const auto seconds = elapsed.nsecsElapsed() / 1e9;
+    QTextStream out(stdout);
+    out << "proxy             " << proxyAddress.toString() << ':' << proxyPort
+        << (proxy ? " (in-process)" : "") << '\n'
+        << "connections       " << connections << " x " << mode << ", " << size << " bytes per request\n"
+        << "completed/failed  " << stats.completed << " / " << stats.failed << '\n'
+        << "connects/s        " << QString::number(stats.completed / seconds, 'f', 1) << '\n'
+        << "MB/s              " << QString::number(stats.bytes / seconds / (1024.0 * 1024.0), 'f', 2) << '\n';
+
+    for (const auto& metric : {qMakePair(QStringLiteral("connect"), &stats.connectLatency), qMakePair(QStringLiteral("ttfb"), &stats.ttfb)}) {
+        out << QStringLiteral("%1 p50/p99/p999").arg(metric.first).leftJustified(18)
+            << QString::number(percentile(*metric.second, 0.50) / 1e6, 'f', 3) << " / "
+            << QString::number(percentile(*metric.second, 0.99) / 1e6, 'f', 3) << " / "
+            << QString::number(percentile(*metric.second, 0.999) / 1e6, 'f', 3) << " ms\n";
+    }
+
+    out.flush();
+    proxy.reset();
+    pool.reset();
+    originThread.quit();
+    originThread.wait();
+    return (stats.completed > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#include "main.moc"
+
+OriginServer::OriginServer(QObject* parent) : QTcpServer(parent), _chunk(static_cast<int>(kChunkSize), 'x') {}
+
+void OriginServer::incomingConnection(qintptr handle) {
+    auto socket = new QTcpSocket(this);
+
+    if (!socket->setSocketDescriptor(handle)) {
+        delete socket;
+        return;
+    }
+
+    QObject::connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+    QObject::connect(socket, &QTcpSocket::readyRead, this, [this, socket]() {
+        auto head = socket->property("head").toByteArray() + socket->readAll();
+        const auto end = head.indexOf("\r\n\r\n");
+
+        if (end < 0) {
+            socket->setProperty("head", head);
+            return;
+        }
+
+        QObject::disconnect(socket, &QTcpSocket::readyRead, this, nullptr);
+        const auto line  = head.left(head.indexOf("\r\n")).split(' ');
+        const auto path  = (line.size() > 1) ? line.at(1) : QByteArray();
+        const auto slash = path.lastIndexOf('/');
+        auto ok          = false;
+        const auto size  = path.mid(slash + 1).toLongLong(&ok);
+
+        if (!path.startsWith("/bytes/") || !ok) {
+            socket->write("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            socket->disconnectFromHost();
+            return;
+        }
+
+        serve(socket, size);
+    });
+}
+
+void OriginServer::serve(QTcpSocket* socket, qint64 size) {
+    socket->write(QByteArrayLiteral("HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: ")
+                  + QByteArray::number(size) + QByteArrayLiteral("\r\nConnection: close\r\n\r\n"));
+    socket->setProperty("remaining", size);
+    QObject::connect(socket, &QTcpSocket::bytesWritten, this, [this, socket]() {
+        stream(socket);
+    });
+    stream(socket);
+}
+
+void OriginServer::stream(QTcpSocket* socket) {
+    auto remaining = socket->property("remaining").toLongLong();
+
+    // keep a few chunks queued, never the whole body
+    while ((remaining > 0) && (socket->bytesToWrite() < 4 * kChunkSize)) {
+        const auto chunk = qMin(remaining, kChunkSize);
+        socket->write(_chunk.constData(), chunk);
+        remaining -= chunk;
+    }
+
+    socket->setProperty("remaining", remaining);
+
+    if (remaining == 0) {
+        QObject::disconnect(socket, &QTcpSocket::bytesWritten, this, nullptr);
+        socket->disconnectFromHost();
+    }
+}
+
+BenchClient::BenchClient(const QHostAddress& proxy, quint16 proxyPort, const QHostAddress& origin, quint16 originPort,
+                         Mode mode, qint64 size, const QDeadlineTimer& deadline, BenchStats& stats, QObject* parent) : QObject(parent),
+    _proxy{proxy}, _proxyPort{proxyPort}, _origin{origin}, _originPort{originPort}, _mode{mode}, _size{size},
+    _deadline{deadline}, _stats{stats} {
+    _clock.start();
+}
+
+void BenchClient::start() {
+    if (_deadline.hasExpired()) {
+        Q_EMIT finished();
+        return;
+    }
+
+    _socket = new QTcpSocket(this);
+    _state  = State::Connecting;
+    _head.clear();
+    _expected = -1;
+    _received = 0;
+
+    QObject::connect(_socket, &QTcpSocket::readyRead, this, &BenchClient::readyRead);
+    QObject::connect(_socket, &QTcpSocket::connected, this, [this]() {
+        if (_mode == Mode::Connect) {
+            _state = State::Tunneling;
+            _socket->write(QStringLiteral("CONNECT %1:%2 HTTP/1.1\r\nHost: %1:%2\r\n\r\n")
+                           .arg(_origin.toString()).arg(_originPort).toLatin1());
+        } else {
+            _stats.connectLatency.append(_clock.nsecsElapsed() - _connectStarted);
+            sendRequest();
+        }
+    });
+    QObject::connect(_socket, &QTcpSocket::disconnected, this, [this]() {
+        complete(_expected >= 0 && _received >= _expected);
+    });
+    QObject::connect(_socket, qOverload<QAbstractSocket::SocketError>(&QTcpSocket::error), this, [this](QAbstractSocket::SocketError) {
+        if (_socket->state() != QAbstractSocket::ConnectedState) {
+            complete(_expected >= 0 && _received >= _expected);
+        }
+    });
+
+    _connectStarted = _clock.nsecsElapsed();
+    _socket->connectToHost(_proxy, _proxyPort);
+}
+
+void BenchClient::sendRequest() {
+    const auto path = QStringLiteral("/bytes/%1").arg(_size);
+
+    if (_mode == Mode::Connect) {
+        _socket->write(QStringLiteral("GET %1 HTTP/1.1\r\nHost: %2:%3\r\n\r\n")
+                       .arg(path, _origin.toString()).arg(_originPort).toLatin1());
+    } else {
+        _socket->write(QStringLiteral("GET http://%2:%3%1 HTTP/1.1\r\nHost: %2:%3\r\n\r\n")
+                       .arg(path, _origin.toString()).arg(_originPort).toLatin1());
+    }
+
+    _state       = State::Requesting;
+    _requestSent = _clock.nsecsElapsed();
+}
+
+void BenchClient::readyRead() {
+    auto data = _socket->readAll();
+
+    if (_state == State::Tunneling) {
+        _head.append(data);
+        const auto end = _head.indexOf("\r\n\r\n");
+
+        if (end < 0) {
+            return;
+        }
+
+        if (!_head.startsWith("HTTP/1.1 200") && !_head.startsWith("HTTP/1.0 200")) {
+            complete(false);
+            return;
+        }
+
+        _stats.connectLatency.append(_clock.nsecsElapsed() - _connectStarted);
+        data = _head.mid(end + 4);
+        _head.clear();
+        sendRequest();
+    }
+
+    if (data.isEmpty()) {
+        return;
+    }
+
+    if (_state == State::Requesting) {
+        _stats.ttfb.append(_clock.nsecsElapsed() - _requestSent);
+        _state = State::Receiving;
+    }
+
+    if (_expected < 0) {
+        _head.append(data);
+        const auto end = _head.indexOf("\r\n\r\n");
+
+        if (end < 0) {
+            return;
+        }
+
+        const auto lengthAt = _head.toLower().indexOf("content-length:");
+
+        if ((lengthAt < 0) || (lengthAt > end)) {
+            complete(false);
+            return;
+        }
+
+        _expected = _head.mid(lengthAt + 15, _head.indexOf("\r\n", lengthAt) - lengthAt - 15).trimmed().toLongLong();
+        data      = _head.mid(end + 4);
+        _head.clear();
+    }
+
+    _received    += data.size();
+    _stats.bytes += static_cast<quint64>(data.size());
+
+    if (_received >= _expected) {
+        complete(true);
+    }
+}
+
+void BenchClient::complete(bool success) {
+    if (!_socket) {
+        return;
+    }
+
+    if (success) {
+        ++_stats.completed;
+    } else {
+        ++_stats.failed;
+    }
+
+    _socket->blockSignals(true);
+    _socket->abort();
+    _socket->deleteLater();
+    _socket = nullptr;
+
+    // the next round starts from the event loop, not from inside the socket's signal
+    QTimer::singleShot(0, this, &BenchClient::start);
+}
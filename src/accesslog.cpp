@@ -0,0 +1,256 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "accesslog.h"
+#include "metrics.h"
+
+static constexpr char kMagic[]   = "PXYLOG01";
+static constexpr auto kIdleSleep = 10;  // ms between polls of an empty ring
+static constexpr auto kBatchSize = 64 * 1024;
+
+AccessLog* AccessLog::_instance = nullptr;
+
+///
+/// \brief The AccessLogWriter class
+/// Drains the ring into the log file until the log is destroyed.
+///
+class AccessLogWriter final : public QThread {
+  public:
+    explicit AccessLogWriter(AccessLog& log) : _log{log} {
+        setObjectName(QStringLiteral("AccessLog"));
+    }
+
+    void stop() {
+        _stopping.store(true);
+    }
+
+  protected:
+    void run() override {
+        QFile file(_log._options.path);
+
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+            qWarning() << QStringLiteral("Failed to open the access log:") << file.errorString();
+        }
+
+        const auto binary = (_log._options.format == AccessLog::Format::Binary);
+
+        if (binary && file.isOpen() && (file.size() == 0)) {
+            file.write(kMagic, sizeof(kMagic) - 1);
+        }
+
+        QByteArray batch;
+        AccessLog::Record record;
+
+        for (;;) {
+            // read the flag first so the final pass sees everything pushed before stop()
+            const auto stopping = _stopping.load();
+
+            while ((batch.size() < kBatchSize) && _log.pop(record)) {
+                binary ? appendBinary(batch, record) : appendJson(batch, record);
+                _log._written.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            if (!batch.isEmpty()) {
+                file.write(batch);
+                file.flush();
+                batch.clear();
+                continue;
+            }
+
+            if (stopping) {
+                break;
+            }
+
+            QThread::msleep(kIdleSleep);
+        }
+    }
+
+  private:
+    static void appendJson(QByteArray& out, const AccessLog::Record& record) {
+        const QHostAddress client(record.client);
+        auto mapped     = false;
+        const auto ipv4 = client.toIPv4Address(&mapped);
+        const auto peer = (mapped ? QHostAddress(ipv4) : client).toString();
+
+        out += "{\"ts\":" + QByteArray::number(record.timestamp);
+        out += ",\"client\":\"" + peer.toLatin1() + ':' + QByteArray::number(record.clientPort);
+        out += "\",\"method\":\"" + escape(record.method);
+        out += "\",\"host\":\"" + escape(record.host);
+        out += "\",\"port\":" + QByteArray::number(record.port);
+        out += ",\"status\":" + QByteArray::number(record.status);
+        out += ",\"bytes_up\":" + QByteArray::number(record.bytesUp);
+        out += ",\"bytes_down\":" + QByteArray::number(record.bytesDown);
+        out += ",\"duration_us\":" + QByteArray::number(record.duration);
+        out += ",\"result\":\"" + QByteArray(Metrics::terminationName(static_cast<Metrics::Termination>(record.result)));
+        out += "\"}\n";
+    }
+
+    static void appendBinary(QByteArray& out, const AccessLog::Record& record) {
+        const auto method = qstrnlen(record.method, sizeof(record.method));
+        const auto host   = qstrnlen(record.host, sizeof(record.host));
+        char fixed[8 * 4 + 16 + 2 * 3 + 3];
+        auto cursor = fixed;
+
+        qToLittleEndian(static_cast<quint64>(record.timestamp), cursor);
+        qToLittleEndian(static_cast<quint64>(record.duration), cursor + 8);
+        qToLittleEndian(record.bytesUp, cursor + 16);
+        qToLittleEndian(record.bytesDown, cursor + 24);
+        cursor += 32;
+        memcpy(cursor, record.client.c, 16);
+        cursor += 16;
+        qToLittleEndian(record.clientPort, cursor);
+        qToLittleEndian(record.port, cursor + 2);
+        qToLittleEndian(record.status, cursor + 4);
+        cursor += 6;
+
+        cursor[0] = static_cast<char>(record.result);
+        cursor[1] = static_cast<char>(method);
+        cursor[2] = static_cast<char>(host);
+
+        out.append(fixed, sizeof(fixed));
+        out.append(record.method, static_cast<int>(method));
+        out.append(record.host, static_cast<int>(host));
+    }
+
+    static QByteArray escape(const char* value) {
+        QByteArray escaped;
+
+        for (auto c = value; *c; ++c) {
+            if ((*c == '"') || (*c == '\\')) {
+                escaped += '\\';
+                escaped += *c;
+            } else if (static_cast<uchar>(*c) < 0x20) {
+                escaped += QByteArrayLiteral("\\u00") + QByteArray::number(static_cast<uchar>(*c), 16).rightJustified(2, '0');
+            } else {
+                escaped += *c;
+            }
+        }
+
+        return escaped;
+    }
+
+    AccessLog& _log;
+    std::atomic<bool> _stopping{false};
+};
+
+void AccessLog::Record::setClient(const QHostAddress& address, quint16 port) {
+    auto ipv4     = false;
+    const auto v4 = address.toIPv4Address(&ipv4);
+    client        = address.toIPv6Address();
+
+    if (ipv4) {
+        // stored IPv4-mapped so both families fit the same 16 bytes
+        client     = {};
+        client[10] = 0xff;
+        client[11] = 0xff;
+        qToBigEndian(v4, &client[12]);
+    }
+
+    clientPort = port;
+}
+
+void AccessLog::Record::setMethod(const std::string& value) {
+    qstrncpy(method, value.c_str(), sizeof(method));
+}
+
+void AccessLog::Record::setHost(const QString& value) {
+    qstrncpy(host, value.toUtf8().constData(), sizeof(host));
+}
+
+static quint64 ringSize(int capacity) {
+    quint64 size = 2;
+
+    while (size < static_cast<quint64>(qMax(2, capacity))) {
+        size <<= 1;
+    }
+
+    return size;
+}
+
+AccessLog::AccessLog(const Options& options) : _options{options}, _mask{ringSize(options.capacity) - 1},
+    _cells{new Cell[_mask + 1]} {
+    for (quint64 i = 0; i <= _mask; ++i) {
+        _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    _writer = new AccessLogWriter(*this);
+    _writer->start(QThread::LowPriority);
+    _instance = this;
+}
+
+AccessLog::~AccessLog() {
+    if (_instance == this) {
+        _instance = nullptr;
+    }
+
+    _writer->stop();
+    _writer->wait();
+    delete _writer;
+}
+
+AccessLog* AccessLog::instance() {
+    return _instance;
+}
+
+bool AccessLog::sample() const {
+    static thread_local quint32 counter = 0;
+    return (_options.sampleRate <= 1) || ((counter++ % static_cast<quint32>(_options.sampleRate)) == 0);
+}
+
+bool AccessLog::push(const Record& record) {
+    auto position = _tail.load(std::memory_order_relaxed);
+
+    for (;;) {
+        auto& cell      = _cells[position & _mask];
+        const auto next = cell.sequence.load(std::memory_order_acquire);
+        const auto lag  = static_cast<qint64>(next - position);
+
+        if (lag == 0) {
+            if (_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                cell.record = record;
+                cell.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (lag < 0) {
+            // the writer has not freed this slot yet: the ring is full
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            position = _tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool AccessLog::pop(Record& record) {
+    auto& cell = _cells[_head & _mask];
+
+    if (static_cast<qint64>(cell.sequence.load(std::memory_order_acquire) - (_head + 1)) < 0) {
+        return false;
+    }
+
+    record = cell.record;
+    cell.sequence.store(_head + _mask + 1, std::memory_order_release);
+    ++_head;
+    return true;
+}
+
+quint64 AccessLog::written() const {
+    return _written.load(std::memory_order_relaxed);
+}
+
+quint64 AccessLog::dropped() const {
+    return _dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,109 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <QtNetwork>
+#include <atomic>
+
+class AccessLogWriter;
+
+///
+/// \brief The AccessLog class
+/// Per-request log sink. Producers copy a fixed-size record into a bounded
+/// multi-producer ring and return; a background thread drains it to the file
+/// as JSON lines or compact binary records. A full ring drops the record and
+/// bumps dropped() instead of waiting, sampling keeps one record in N.
+///
+/// The binary file starts with the 8 byte magic "PXYLOG01", followed by:
+/// u64 timestamp (ms since epoch), u64 duration (us), u64 bytes up, u64 bytes down,
+/// 16 byte client address (IPv4-mapped for IPv4), u16 client port, u16 target port,
+/// u16 status, u8 result, u8 method length, u8 host length, method, host.
+/// All integers are little endian.
+///
+class AccessLog final {
+  public:
+    enum class Format {
+        Json,
+        Binary
+    };
+
+    struct Options {
+        QString path;                  // empty: no access log
+        Format format  = Format::Json;
+        int sampleRate = 1;            // keep one record in N
+        int capacity   = 8192;         // ring slots, rounded up to a power of two
+    };
+
+    struct Record {
+        qint64 timestamp   = 0;  // ms since epoch
+        qint64 duration    = 0;  // us
+        quint64 bytesUp    = 0;
+        quint64 bytesDown  = 0;
+        Q_IPV6ADDR client  = {};
+        quint16 clientPort = 0;
+        quint16 port       = 0;
+        quint16 status     = 0;  // what the client got, 0 when nothing was sent
+        quint8 result      = 0;  // Metrics::Termination
+        char method[8]     = {};
+        char host[96]      = {};
+
+        void setClient(const QHostAddress& address, quint16 port);
+        void setMethod(const std::string& method);
+        void setHost(const QString& host);
+    };
+
+    explicit AccessLog(const Options& options);
+    ~AccessLog();
+
+    static AccessLog* instance();
+
+    ///
+    /// Tells whether the next record from the calling thread passes sampling.
+    /// Callers check this before filling a record.
+    ///
+    bool sample() const;
+
+    ///
+    /// Queues \a record without blocking, returns false when the ring was full.
+    ///
+    bool push(const Record& record);
+
+    quint64 written() const;
+    quint64 dropped() const;
+
+  private:
+    friend class AccessLogWriter;
+
+    struct Cell {
+        std::atomic<quint64> sequence{0};
+        Record record;
+    };
+
+    bool pop(Record& record);
+
+    const Options _options;
+    const quint64 _mask;
+    QScopedArrayPointer<Cell> _cells;
+    std::atomic<quint64> _tail{0};  // next slot producers claim
+    quint64 _head = 0;              // next slot the writer reads
+    std::atomic<quint64> _written{0};
+    std::atomic<quint64> _dropped{0};
+    AccessLogWriter* _writer = nullptr;
+
+    static AccessLog* _instance;
+};
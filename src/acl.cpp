@@ -0,0 +1,460 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "acl.h"
+
+static constexpr auto kMinEdges = 64;
+
+static Q_IPV6ADDR toKey(const QHostAddress& address, int& length) {
+    Q_IPV6ADDR key = {};
+
+    if (address.protocol() == QAbstractSocket::IPv4Protocol) {
+        const auto ip4 = address.toIPv4Address();
+        key.c[10]      = 0xff;
+        key.c[11]      = 0xff;
+        key.c[12]      = static_cast<quint8>(ip4 >> 24);
+        key.c[13]      = static_cast<quint8>(ip4 >> 16);
+        key.c[14]      = static_cast<quint8>(ip4 >> 8);
+        key.c[15]      = static_cast<quint8>(ip4);
+        length        += 96;
+    } else {
+        key = address.toIPv6Address();
+    }
+
+    return key;
+}
+
+static int bitAt(const Q_IPV6ADDR& key, int index) {
+    return (key.c[index / 8] >> (7 - (index % 8))) & 1;
+}
+
+static int commonPrefix(const Q_IPV6ADDR& a, const Q_IPV6ADDR& b, int limit) {
+    auto length = 0;
+
+    while (length < limit) {
+        const auto diff = static_cast<quint8>(a.c[length / 8] ^ b.c[length / 8]);
+
+        if (diff == 0) {
+            length += 8;
+            continue;
+        }
+
+        while (!(diff & (0x80 >> (length % 8)))) {
+            ++length;
+        }
+
+        break;
+    }
+
+    return qMin(length, limit);
+}
+
+static ushort fold(QChar c) {
+    const auto unit = c.unicode();
+    return ((unit >= 'A') && (unit <= 'Z')) ? static_cast<ushort>(unit + ('a' - 'A')) : unit;
+}
+
+static quint32 labelHash(const QChar* label, int length) {
+    quint32 hash = 2166136261u;  // FNV-1a
+
+    for (auto i = 0; i < length; ++i) {
+        hash = (hash ^ fold(label[i])) * 16777619u;
+    }
+
+    return hash;
+}
+
+static quint32 slotOf(quint32 parent, quint32 hash, int mask) {
+    return (hash ^ (parent * 0x9e3779b1u)) & static_cast<quint32>(mask);
+}
+
+Acl::Acl(Action defaultAction) : _default{defaultAction} {
+    _nodes.append(Action::None);
+    _nodeProfiles.append(-1);
+    _edges.resize(kMinEdges);
+    _prefixes.append({});
+}
+
+QSharedPointer<const Acl> Acl::load(const QString& path, Action defaultAction) {
+    QFile file(path);
+
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qWarning() << QStringLiteral("Cannot read ACL") << path << file.errorString();
+        return {};
+    }
+
+    auto acl    = QSharedPointer<Acl>::create(defaultAction);
+    auto number = 0;
+
+    while (!file.atEnd()) {
+        ++number;
+        const auto line = QString::fromUtf8(file.readLine()).section(QLatin1Char('#'), 0, 0).simplified();
+
+        if (line.isEmpty()) {
+            continue;
+        }
+
+        const auto fields = line.split(QLatin1Char(' '));
+
+        const auto verb   = fields.first().toLower();
+        const auto action = (verb == QLatin1String("allow")) ? Action::Allow
+                            : (verb == QLatin1String("deny")) ? Action::Deny : Action::None;
+
+        const auto profile = (fields.size() == 3) ? acl->profileIndex(fields.at(2)) : -1;
+
+        if ((fields.size() < 2) || (fields.size() > 3) || (action == Action::None) || !acl->addRule(action, fields.at(1), profile)) {
+            qWarning() << QStringLiteral("Ignoring ACL rule at %1:%2").arg(path).arg(number);
+        }
+    }
+
+    qInfo() << QStringLiteral("ACL %1: %2 domain and %3 network rule(s)").arg(path).arg(acl->domainRules()).arg(acl->networkRules());
+    return acl;
+}
+
+bool Acl::addRule(Action action, const QString& pattern, int profile) {
+    if (pattern == QLatin1String("*")) {
+        _default        = action;
+        _defaultProfile = static_cast<qint16>(profile);
+        return true;
+    }
+
+    if (pattern.contains(QLatin1Char('/'))) {
+        const auto subnet = QHostAddress::parseSubnet(pattern);
+        return (subnet.second >= 0) && addNetwork(action, subnet.first, subnet.second, profile);
+    }
+
+    QHostAddress address;
+
+    if (address.setAddress(pattern)) {
+        return addNetwork(action, address, (address.protocol() == QAbstractSocket::IPv4Protocol) ? 32 : 128, profile);
+    }
+
+    return addDomain(action, pattern, profile);
+}
+
+Acl::Action Acl::check(const QString& host, int* profile) const {
+    const auto data = host.constData();
+    auto end        = host.size();
+
+    if ((end > 0) && ((data[0].isDigit()) || host.contains(QLatin1Char(':')))) {
+        QHostAddress address;
+
+        if (address.setAddress(host)) {
+            const auto action = match(address, profile);
+
+            if (action == Action::None) {
+                if (profile) {
+                    *profile = _defaultProfile;
+                }
+
+                return _default;
+            }
+
+            return action;
+        }
+    }
+
+    if ((end > 0) && (data[end - 1] == QLatin1Char('.'))) {
+        --end;  // fully qualified
+    }
+
+    quint32 node     = 0;
+    auto best        = _nodes.at(0);
+    auto bestProfile = _nodeProfiles.at(0);
+
+    while (end > 0) {
+        auto start = end;
+
+        while ((start > 0) && (data[start - 1] != QLatin1Char('.'))) {
+            --start;
+        }
+
+        const auto edge = findEdge(node, labelHash(data + start, end - start), data + start, end - start);
+
+        if (edge < 0) {
+            break;
+        }
+
+        node = _edges.at(edge).child;
+
+        if (_nodes.at(static_cast<int>(node)) != Action::None) {
+            best        = _nodes.at(static_cast<int>(node));
+            bestProfile = _nodeProfiles.at(static_cast<int>(node));
+        }
+
+        end = start - 1;
+    }
+
+    if (profile) {
+        *profile = (best == Action::None) ? _defaultProfile : bestProfile;
+    }
+
+    return (best == Action::None) ? _default : best;
+}
+
+Acl::Action Acl::match(const QHostAddress& address, int* profile) const {
+    auto length      = 0;
+    const auto key   = toKey(address, length);
+    auto node        = 0;
+    auto best        = _prefixes.at(0).action;
+    auto bestProfile = _prefixes.at(0).profile;
+
+    while (_prefixes.at(node).length < 128) {
+        const auto child = _prefixes.at(node).child[bitAt(key, _prefixes.at(node).length)];
+
+        if ((child < 0) || (commonPrefix(key, _prefixes.at(child).key, _prefixes.at(child).length) < _prefixes.at(child).length)) {
+            break;
+        }
+
+        node = child;
+
+        if (_prefixes.at(node).action != Action::None) {
+            best        = _prefixes.at(node).action;
+            bestProfile = _prefixes.at(node).profile;
+        }
+    }
+
+    if (profile) {
+        *profile = bestProfile;
+    }
+
+    return best;
+}
+
+QList<QHostAddress> Acl::permitted(const QList<QHostAddress>& addresses) const {
+    if (_networks == 0) {
+        return addresses;
+    }
+
+    QList<QHostAddress> result;
+
+    for (const auto& address : addresses) {
+        if (match(address) != Action::Deny) {
+            result.append(address);
+        }
+    }
+
+    return result;
+}
+
+int Acl::domainRules() const {
+    return _domains;
+}
+
+int Acl::networkRules() const {
+    return _networks;
+}
+
+const QStringList& Acl::profiles() const {
+    return _profiles;
+}
+
+int Acl::profileIndex(const QString& name) {
+    auto index = _profiles.indexOf(name);
+
+    if (index < 0) {
+        index = _profiles.size();
+        _profiles.append(name);
+    }
+
+    return index;
+}
+
+bool Acl::addDomain(Action action, const QString& domain, int profile) {
+    auto name = domain.toLower();
+
+    if (name.startsWith(QLatin1String("*."))) {
+        name.remove(0, 2);
+    } else if (name.startsWith(QLatin1Char('.'))) {
+        name.remove(0, 1);
+    }
+
+    if (name.endsWith(QLatin1Char('.'))) {
+        name.chop(1);
+    }
+
+    if (name.isEmpty() || name.contains(QLatin1String(".."))) {
+        return false;
+    }
+
+    const auto labels = name.split(QLatin1Char('.'));
+    quint32 node      = 0;
+
+    for (auto it = labels.crbegin(); it != labels.crend(); ++it) {
+        const auto hash = labelHash(it->constData(), it->size());
+        const auto edge = findEdge(node, hash, it->constData(), it->size());
+
+        if (edge >= 0) {
+            node = _edges.at(edge).child;
+            continue;
+        }
+
+        Edge added;
+        added.parent = node;
+        added.child  = static_cast<quint32>(_nodes.size());
+        added.hash   = hash;
+        added.offset = static_cast<quint32>(_labels.size());
+        added.length = static_cast<quint32>(it->size());
+        _labels.append(*it);
+        _nodes.append(Action::None);
+        _nodeProfiles.append(-1);
+        insertEdge(added);
+        node = added.child;
+    }
+
+    if (_nodes.at(static_cast<int>(node)) == Action::None) {
+        ++_domains;
+    }
+
+    _nodes[static_cast<int>(node)]        = action;
+    _nodeProfiles[static_cast<int>(node)] = static_cast<qint16>(profile);
+    return true;
+}
+
+bool Acl::addNetwork(Action action, const QHostAddress& address, int length, int profile) {
+    auto key = toKey(address, length);
+
+    if ((length < 0) || (length > 128)) {
+        return false;
+    }
+
+    for (auto i = length; i < 128; ++i) {
+        key.c[i / 8] &= static_cast<quint8>(~(0x80 >> (i % 8)));
+    }
+
+    auto node = 0;
+
+    for (;;) {
+        if (_prefixes.at(node).length == length) {
+            _networks += (_prefixes.at(node).action == Action::None) ? 1 : 0;
+            _prefixes[node].action  = action;
+            _prefixes[node].profile = static_cast<qint16>(profile);
+            return true;
+        }
+
+        const auto bit   = bitAt(key, _prefixes.at(node).length);
+        const auto child = _prefixes.at(node).child[bit];
+
+        if (child < 0) {
+            Prefix leaf;
+            leaf.key     = key;
+            leaf.length  = length;
+            leaf.action  = action;
+            leaf.profile = static_cast<qint16>(profile);
+            _prefixes[node].child[bit] = _prefixes.size();
+            _prefixes.append(leaf);
+            ++_networks;
+            return true;
+        }
+
+        const auto childLength = _prefixes.at(child).length;
+        const auto common      = commonPrefix(key, _prefixes.at(child).key, qMin(length, childLength));
+
+        if (common == childLength) {
+            node = child;
+            continue;
+        }
+
+        // split the edge at the first differing bit
+        Prefix middle;
+        middle.key    = key;
+        middle.length = common;
+
+        for (auto i = common; i < 128; ++i) {
+            middle.key.c[i / 8] &= static_cast<quint8>(~(0x80 >> (i % 8)));
+        }
+
+        middle.child[bitAt(_prefixes.at(child).key, common)] = child;
+        const auto split = _prefixes.size();
+
+        if (common == length) {
+            middle.action  = action;
+            middle.profile = static_cast<qint16>(profile);
+        } else {
+            Prefix leaf;
+            leaf.key     = key;
+            leaf.length  = length;
+            leaf.action  = action;
+            leaf.profile = static_cast<qint16>(profile);
+            middle.child[bitAt(key, common)] = split + 1;
+            _prefixes.append(middle);
+            _prefixes.append(leaf);
+            _prefixes[node].child[bit] = split;
+            ++_networks;
+            return true;
+        }
+
+        _prefixes.append(middle);
+        _prefixes[node].child[bit] = split;
+        ++_networks;
+        return true;
+    }
+}
+
+qint32 Acl::findEdge(quint32 parent, quint32 hash, const QChar* label, int length) const {
+    const auto mask = _edges.size() - 1;
+
+    for (auto slot = slotOf(parent, hash, mask); ; slot = (slot + 1) & static_cast<quint32>(mask)) {
+        const auto& edge = _edges.at(static_cast<int>(slot));
+
+        if (edge.child == 0) {
+            return -1;
+        }
+
+        if ((edge.parent != parent) || (edge.hash != hash) || (edge.length != static_cast<quint32>(length))) {
+            continue;
+        }
+
+        auto equal = true;
+
+        for (auto i = 0; equal && (i < length); ++i) {
+            equal = (_labels.at(static_cast<int>(edge.offset) + i).unicode() == fold(label[i]));
+        }
+
+        if (equal) {
+            return static_cast<qint32>(slot);
+        }
+    }
+}
+
+void Acl::insertEdge(const Edge& edge) {
+    // keep the table at most half full so probes stay short
+    if ((_edgeCount + 1) * 2 > _edges.size()) {
+        const auto previous = _edges;
+        _edges.fill(Edge{}, previous.size() * 2);
+
+        for (const auto& entry : previous) {
+            if (entry.child != 0) {
+                auto slot = slotOf(entry.parent, entry.hash, _edges.size() - 1);
+
+                while (_edges.at(static_cast<int>(slot)).child != 0) {
+                    slot = (slot + 1) & static_cast<quint32>(_edges.size() - 1);
+                }
+
+                _edges[static_cast<int>(slot)] = entry;
+            }
+        }
+    }
+
+    auto slot = slotOf(edge.parent, edge.hash, _edges.size() - 1);
+
+    while (_edges.at(static_cast<int>(slot)).child != 0) {
+        slot = (slot + 1) & static_cast<quint32>(_edges.size() - 1);
+    }
+
+    _edges[static_cast<int>(slot)] = edge;
+    ++_edgeCount;
+}
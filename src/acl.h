@@ -0,0 +1,113 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <QtNetwork>
+
+///
+/// \brief The Acl class
+/// Allow/deny rules for request targets, compiled once per configuration load.
+/// Domain rules match the name and every name below it and live in a trie over
+/// reversed labels, flattened into one open-addressing edge table. CIDR rules
+/// live in a path-compressed binary radix tree over IPv6 (IPv4 as mapped
+/// addresses). The most specific rule wins. Lookups walk the host once and
+/// allocate nothing.
+///
+/// The rules file has one rule per line, `allow` or `deny` followed by a domain,
+/// an address or a CIDR and optionally the name of a socket tuning profile for
+/// targets the rule matches; `#` starts a comment. `*` sets the default action.
+///
+class Acl final {
+  public:
+    enum class Action : qint8 {
+        None = -1,
+        Allow,
+        Deny
+    };
+
+    explicit Acl(Action defaultAction = Action::Allow);
+
+    ///
+    /// Compiles the rules file at \a path, null when it cannot be read.
+    ///
+    static QSharedPointer<const Acl> load(const QString& path, Action defaultAction);
+
+    ///
+    /// Adds a rule for \a pattern, \a profile indexes profiles() or is -1 for none.
+    ///
+    bool addRule(Action action, const QString& pattern, int profile = -1);
+
+    ///
+    /// Decides for a request target: domain rules for names, CIDR rules for address literals.
+    /// \a profile, when given, receives the deciding rule's profile index or -1.
+    ///
+    Action check(const QString& host, int* profile = nullptr) const;
+
+    ///
+    /// The action of the most specific CIDR rule covering \a address, None when no rule does.
+    ///
+    Action match(const QHostAddress& address, int* profile = nullptr) const;
+
+    ///
+    /// \a addresses without the ones a CIDR rule denies.
+    ///
+    QList<QHostAddress> permitted(const QList<QHostAddress>& addresses) const;
+
+    int domainRules() const;
+    int networkRules() const;
+
+    ///
+    /// Socket tuning profile names referenced by the rules, in index order.
+    ///
+    const QStringList& profiles() const;
+    int profileIndex(const QString& name);
+
+  private:
+    struct Edge {
+        quint32 parent = 0;
+        quint32 child  = 0;  // 0: empty slot, the root is never a child
+        quint32 hash   = 0;
+        quint32 offset = 0;  // label in _labels
+        quint32 length = 0;
+    };
+
+    struct Prefix {
+        Q_IPV6ADDR key  = {};
+        int length      = 0;
+        qint32 child[2] = {-1, -1};
+        Action action   = Action::None;
+        qint16 profile  = -1;
+    };
+
+    bool addDomain(Action action, const QString& domain, int profile);
+    bool addNetwork(Action action, const QHostAddress& address, int length, int profile);
+    qint32 findEdge(quint32 parent, quint32 hash, const QChar* label, int length) const;
+    void insertEdge(const Edge& edge);
+
+    Action _default;
+    qint16 _defaultProfile = -1;
+    QVector<Action> _nodes;          // per trie node, node 0 is the root
+    QVector<qint16> _nodeProfiles;   // alongside _nodes
+    QVector<Edge> _edges;    // capacity is a power of two
+    QString _labels;
+    int _edgeCount = 0;
+    int _domains   = 0;
+    QVector<Prefix> _prefixes;  // node 0 is ::/0
+    int _networks = 0;
+    QStringList _profiles;
+};
@@ -0,0 +1,108 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "configstore.h"
+#include "proxyserver.h"
+
+static constexpr auto kReloadDelay = 200;  // ms, editors write in several steps
+
+ConfigStore* ConfigStore::_instance = nullptr;
+
+ConfigStore::ConfigStore(const QString& file, bool seed, QObject* parent) : QObject(parent), _file{file} {
+    Settings settings(_file, seed);
+    _current = Snapshot::create(ProxyConfig::load(settings));
+    _version.store(1, std::memory_order_release);
+    _instance = this;
+}
+
+ConfigStore::~ConfigStore() {
+    if (_instance == this) {
+        _instance = nullptr;
+    }
+}
+
+ConfigStore* ConfigStore::instance() {
+    return _instance;
+}
+
+ConfigStore::Snapshot ConfigStore::snapshot() const {
+    thread_local const ConfigStore* store = nullptr;
+    thread_local quint64 version          = 0;
+    thread_local Snapshot cached;
+
+    if ((store != this) || (version != _version.load(std::memory_order_acquire))) {
+        QMutexLocker locker(&_lock);
+        cached  = _current;
+        version = _version.load(std::memory_order_relaxed);
+        store   = this;
+    }
+
+    return cached;
+}
+
+quint64 ConfigStore::version() const {
+    return _version.load(std::memory_order_acquire);
+}
+
+void ConfigStore::watch() {
+    if (_watcher) {
+        return;
+    }
+
+    const auto path = QFileInfo(_file).absoluteFilePath();
+    _watcher  = new QFileSystemWatcher(this);
+    _debounce = new QTimer(this);
+    _debounce->setSingleShot(true);
+    _debounce->setInterval(kReloadDelay);
+    QObject::connect(_debounce, &QTimer::timeout, this, &ConfigStore::reload);
+    QObject::connect(_watcher, &QFileSystemWatcher::fileChanged, this, [this, path]() {
+        // saving through a rename drops the old inode from the watch
+        if (!_watcher->files().contains(path)) {
+            _watcher->addPath(path);
+        }
+
+        _debounce->start();
+    });
+
+    if (!_watcher->addPath(path)) {
+        qWarning() << QStringLiteral("Cannot watch") << path << QStringLiteral("for changes");
+    }
+}
+
+void ConfigStore::seed() {
+    Settings settings(_file);
+    ProxyConfig::load(settings);
+}
+
+bool ConfigStore::reload() {
+    Settings settings(_file);
+    auto next = Snapshot::create(ProxyConfig::load(settings));
+
+    if (settings.status() != QSettings::NoError) {
+        qWarning() << QStringLiteral("Failed to read") << _file << QStringLiteral("keeping the current settings");
+        return false;
+    }
+
+    {
+        QMutexLocker locker(&_lock);
+        _current = std::move(next);
+        _version.fetch_add(1, std::memory_order_release);
+    }
+
+    qInfo() << QStringLiteral("Reloaded") << _file << QStringLiteral("version") << version();
+    Q_EMIT reloaded();
+    return true;
+}
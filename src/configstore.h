@@ -0,0 +1,74 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <atomic>
+
+struct ProxyConfig;
+
+///
+/// \brief The ConfigStore class
+/// Holds the current ProxyConfig as an immutable snapshot and swaps in a new one
+/// when the settings file changes or reload() is called. Readers on any thread
+/// get the snapshot without locking: each thread keeps the last one it saw and
+/// only takes the lock to pick up a newer version. Consumers take a snapshot when
+/// they start a unit of work (a connection) and keep it for its lifetime.
+///
+class ConfigStore final : public QObject {
+    Q_OBJECT
+
+  public:
+    using Snapshot = QSharedPointer<const ProxyConfig>;
+
+    ///
+    /// Loads \a file, without writing the missing defaults back when \a seed is false (see seed()).
+    ///
+    explicit ConfigStore(const QString& file, bool seed = true, QObject* parent = nullptr);
+    ~ConfigStore() override;
+
+    static ConfigStore* instance();
+
+    Snapshot snapshot() const;
+    quint64  version() const;
+
+    ///
+    /// Watches the settings file and reloads shortly after it changes.
+    ///
+    void watch();
+
+    ///
+    /// Writes the defaults of keys missing from the settings file, for a store constructed without.
+    ///
+    void seed();
+
+  public Q_SLOTS:
+    bool reload();
+
+  Q_SIGNALS:
+    void reloaded();
+
+  private:
+    const QString _file;
+    mutable QMutex _lock;
+    Snapshot _current;
+    std::atomic<quint64> _version{0};
+    QFileSystemWatcher* _watcher = nullptr;
+    QTimer* _debounce            = nullptr;
+
+    static ConfigStore* _instance;
+};
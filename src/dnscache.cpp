@@ -0,0 +1,147 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "dnscache.h"
+
+DnsCache* DnsCache::_instance = nullptr;
+
+DnsCache::DnsCache(const Limits& limits, QObject* parent) : QObject(parent), _limits{limits} {
+    _entries.setMaxCost(qMax(1, _limits.maxEntries));
+    _clock.start();
+    _instance = this;
+}
+
+DnsCache::~DnsCache() {
+    if (_instance == this) {
+        _instance = nullptr;
+    }
+}
+
+DnsCache* DnsCache::instance() {
+    return _instance;
+}
+
+void DnsCache::lookup(const QString& host, QObject* context, Callback callback) {
+    QHostAddress literal;
+
+    if (literal.setAddress(host)) {
+        callback({literal});
+        return;
+    }
+
+    const auto name = host.toLower();
+    QMutexLocker locker(&_lock);
+
+    if (auto entry = _entries.object(name)) {
+        if (entry->expires > _clock.elapsed()) {
+            const auto addresses = entry->addresses;
+            locker.unlock();
+            _hits.fetch_add(1, std::memory_order_relaxed);
+            callback(addresses);
+            return;
+        }
+
+        _entries.remove(name);
+    }
+
+    auto it             = _inflight.find(name);
+    const auto inflight = (it != _inflight.end());
+
+    if (!inflight) {
+        it = _inflight.insert(name, {});
+    }
+
+    it->append({context ? dispatcher() : nullptr, context, std::move(callback)});
+    locker.unlock();
+
+    if (inflight) {
+        _coalesced.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    _misses.fetch_add(1, std::memory_order_relaxed);
+
+    if (thread() == QThread::currentThread()) {
+        resolve(name);
+    } else {
+        QMetaObject::invokeMethod(this, [this, name]() {
+            resolve(name);
+        }, Qt::QueuedConnection);
+    }
+}
+
+quint64 DnsCache::hits() const {
+    return _hits.load(std::memory_order_relaxed);
+}
+
+quint64 DnsCache::misses() const {
+    return _misses.load(std::memory_order_relaxed);
+}
+
+quint64 DnsCache::coalesced() const {
+    return _coalesced.load(std::memory_order_relaxed);
+}
+
+void DnsCache::setLimits(const Limits& limits) {
+    QMutexLocker locker(&_lock);
+    _limits = limits;
+    _entries.setMaxCost(qMax(1, _limits.maxEntries));
+}
+
+void DnsCache::resolve(const QString& host) {
+    QHostInfo::lookupHost(host, this, [this, host](const QHostInfo & info) {
+        resolved(host, info);
+    });
+}
+
+void DnsCache::resolved(const QString& host, const QHostInfo& info) {
+    const auto addresses = (info.error() == QHostInfo::NoError) ? info.addresses() : QList<QHostAddress>{};
+
+    QMutexLocker locker(&_lock);
+    const auto ttl = addresses.isEmpty() ? _limits.negativeTtl : _limits.ttl;
+
+    if (ttl > 0) {
+        _entries.insert(host, new Entry{addresses, _clock.elapsed() + ttl});
+    }
+
+    const auto waiters = _inflight.take(host);
+    locker.unlock();
+
+    for (const auto& waiter : waiters) {
+        if (!waiter.dispatcher) {
+            waiter.callback(addresses);
+            continue;
+        }
+
+        // hop onto the requester's thread before touching its context
+        QMetaObject::invokeMethod(waiter.dispatcher, [waiter, addresses]() {
+            if (waiter.context) {
+                waiter.callback(addresses);
+            }
+        }, Qt::QueuedConnection);
+    }
+}
+
+QObject* DnsCache::dispatcher() {
+    // one long lived object per thread, the contexts themselves may be gone by delivery time
+    static QThreadStorage<QObject*> dispatchers;
+
+    if (!dispatchers.hasLocalData()) {
+        dispatchers.setLocalData(new QObject);
+    }
+
+    return dispatchers.localData();
+}
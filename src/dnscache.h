@@ -0,0 +1,92 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <QtNetwork>
+#include <atomic>
+#include <functional>
+
+///
+/// \brief The DnsCache class
+/// Process wide resolver cache in front of QHostInfo. Answers are kept for a
+/// fixed TTL (QHostInfo does not expose the record TTL), failures for a shorter
+/// negative TTL, and concurrent lookups of the same name share one query.
+/// lookup() may be called from any thread, the callback runs on the caller's thread
+/// (or on the cache's own thread for callers without a context).
+///
+class DnsCache final : public QObject {
+    Q_OBJECT
+
+  public:
+    struct Limits {
+        int ttl         = 60000;  // ms
+        int negativeTtl = 5000;   // ms
+        int maxEntries  = 4096;
+    };
+
+    using Callback = std::function<void(const QList<QHostAddress>& addresses)>;
+
+    explicit DnsCache(const Limits& limits, QObject* parent = nullptr);
+    ~DnsCache() override;
+
+    static DnsCache* instance();
+
+    ///
+    /// Resolves \a host and invokes \a callback unless \a context is destroyed first.
+    /// Cached answers are delivered synchronously. A null \a context is for callers
+    /// without a Qt event loop: the callback then runs on whichever thread resolved it.
+    ///
+    void lookup(const QString& host, QObject* context, Callback callback);
+
+    quint64 hits() const;
+    quint64 misses() const;
+    quint64 coalesced() const;
+
+    ///
+    /// Applies \a limits to answers cached from now on, shrinking the cache if needed.
+    ///
+    void setLimits(const Limits& limits);
+
+  private:
+    struct Entry {
+        QList<QHostAddress> addresses;
+        qint64 expires = 0;
+    };
+
+    struct Waiter {
+        QObject* dispatcher = nullptr;  // lives on the requesting thread, null for direct delivery
+        QPointer<QObject> context;
+        Callback callback;
+    };
+
+    void resolve(const QString& host);
+    void resolved(const QString& host, const QHostInfo& info);
+
+    static QObject* dispatcher();
+
+    Limits _limits;
+    QMutex _lock;
+    QCache<QString, Entry> _entries;
+    QHash<QString, QVector<Waiter>> _inflight;
+    QElapsedTimer _clock;
+    std::atomic<quint64> _hits{0};
+    std::atomic<quint64> _misses{0};
+    std::atomic<quint64> _coalesced{0};
+
+    static DnsCache* _instance;
+};
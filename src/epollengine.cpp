@@ -0,0 +1,1513 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "epollengine.h"
+#include "socketutils.h"
+
+#ifdef Q_OS_LINUX
+# include <fcntl.h>
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+# include <sys/socket.h>
+# include <unistd.h>
+
+static constexpr auto kMaxEvents = 256;
+static constexpr quint32 kEvents = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+static constexpr auto kListenTag = ~quint64{0};
+static constexpr auto kWakeTag   = ~quint64{0} - 1;
+static constexpr auto kRingTag   = ~quint64{0} - 2;
+static constexpr auto kTickResolution = 100;  // ms, also the epoll_wait timeout while timers are armed
+
+///
+/// \brief The LookupTask class
+/// Blocking resolve on the global thread pool, used when the DNS cache is disabled.
+///
+class LookupTask final : public QRunnable {
+  public:
+    LookupTask(const QString& host, DnsCache::Callback callback) : _host{host}, _callback{std::move(callback)} {}
+
+    void run() override {
+        const auto info = QHostInfo::fromName(_host);
+        _callback((info.error() == QHostInfo::NoError) ? info.addresses() : QList<QHostAddress>{});
+    }
+
+  private:
+    const QString _host;
+    const DnsCache::Callback _callback;
+};
+
+///
+/// \brief The EpollLoop class
+/// One epoll instance with its own listener and the connections it accepted.
+/// Connections live in a flat table indexed by slot; epoll tags carry the slot,
+/// its generation and the side so events for a recycled slot are dropped.
+///
+/// With a ring the listener accepts through io_uring, and a connection moves
+/// there once it relays: each direction has one request in flight, a receive
+/// into a provided buffer or the send of that buffer with the next receive
+/// linked behind it. Completions come back through an eventfd in the epoll set.
+///
+class EpollLoop final : public QThread {
+  public:
+    EpollLoop(const ProxyConfig& config, QObject* parent = nullptr);
+    ~EpollLoop() override;
+
+    bool open(qintptr inherited = -1, bool uring = false);
+    void stop();
+    void stopAccepting();
+    void replaceListener(int fd);
+
+    int listener() const {
+        return _listener;
+    }
+
+    int activeConnections() const {
+        return _active.load(std::memory_order_relaxed);
+    }
+
+  protected:
+    void run() override;
+
+  private:
+    enum class State : quint8 {
+        Head,
+        Resolving,
+        Connecting,
+        Relay
+    };
+
+    enum class RingOp : quint8 {
+        None,  // cancellations, their completions are dropped
+        Accept,
+        Receive,
+        Send
+    };
+
+    struct Side {
+        int fd    = -1;
+        bool eof  = false;  // nothing more to read
+        bool shut = false;  // write half shut down
+        bool queued = false;  // pending was gathered in this iteration and not tried yet
+        bool more   = false;  // gathering stopped at the cap, the socket may hold more
+        int sending = 0;      // bytes of the ring buffer in flight to this side, 0 when idle
+        int sent    = 0;      // of which already went out
+        QByteArray pending;   // what the socket would not take, at most one chunk unless queued
+    };
+
+    struct Connection {
+        Side down;
+        Side up;
+        quint32 generation  = 0;
+        State state         = State::Head;
+        bool tunnel         = false;
+        quint8 versionMajor = 1;
+        quint8 versionMinor = 1;
+        quint16 port        = 0;
+        int next            = 0;   // next address to try
+        int profile         = -1;  // socket profile of the ACL rule that let the target through
+        bool ring           = false;  // relayed by the ring, epoll no longer watches the sockets
+        QByteArray head;          // request head, then whatever goes upstream once connected
+        BodyFramer body;          // the request body, client bytes past it are dropped
+        QList<QHostAddress> addresses;
+        QHostAddress client;  // admitted by RateLimiter, null when not tracked
+        ConfigStore::Snapshot config;  // current when accepted, kept for the connection's lifetime
+        qint64 activity = 0;  // _clock ms of the last relay event, the idle timer checks it when due
+    };
+
+    struct Resolved {
+        quint64 id;
+        QList<QHostAddress> addresses;
+    };
+
+    static quint64 tag(quint32 index, quint32 generation, bool up) {
+        return (quint64{generation} << 32) | (quint64{index} << 1) | (up ? 1 : 0);
+    }
+
+    // [op:2][generation:14][buffer:16][index:31][up:1], listeners put their fd in place of the index.
+    // The generation wraps, but a slot is not reused before all of its requests completed.
+    static quint64 ringTag(RingOp op, quint32 index, quint32 generation = 0, bool up = false, int buffer = 0) {
+        return (quint64{static_cast<quint8>(op)} << 62) | (quint64{generation & 0x3fff} << 48)
+               | (quint64{static_cast<quint16>(buffer)} << 32) | (quint64{index} << 1) | (up ? 1 : 0);
+    }
+
+    void accept();
+    void adopt(int fd);
+    void wake();
+    void dispatch(quint64 tag, quint32 events);
+    void readHead(quint32 index);
+    void handleRequest(quint32 index, int headSize);
+    void resolved(quint64 id, const QList<QHostAddress>& addresses);
+    void connectNext(quint32 index);
+    void connected(quint32 index);
+    void relay(quint32 index, bool up, quint32 events);
+    bool pump(quint32 index, Side& from, Side& to, Metrics::Counter counter);
+    bool gather(quint32 index, Side& from, Side& to, Metrics::Counter counter);
+    void queue(quint32 index, Side& to);
+    void flushQueued();
+    bool flush(Side& to, const Side& from);
+    bool send(Side& to, const char* data, qint64 size);
+    void reap();
+    void ringAccepted(int fd, const IoUring::Completion& completion);
+    void startRing(quint32 index);
+    bool ringReceive(quint32 index, bool up);
+    bool ringForward(quint32 index, bool up, int buffer);
+    void ringReceived(quint32 index, bool up, int buffer, int result);
+    void ringSent(quint32 index, bool up, int buffer, int result);
+
+    ///
+    /// Returns \a buffer to the ring and re-arms a receive that was starved of one.
+    ///
+    void giveBack(int buffer);
+    void reject(quint32 index, int statusCode, const char* reason, Metrics::Termination termination = Metrics::Termination::Rejected);
+    void arm(quint32 index, int msecs);
+    void expire(quint32 index);
+    void close(quint32 index, Metrics::Termination termination = Metrics::Termination::Closed);
+
+    ///
+    /// How many of the \a size client bytes at \a data go upstream, -1 for a malformed body.
+    /// A plain request stops at the end of its body: the upstream closes after one response,
+    /// so a pipelined request behind it must not reach it.
+    ///
+    static qint64 requestBytes(Connection& connection, const char* data, qint64 size);
+
+    ///
+    /// Whether both directions of \a connection are done, a plain request is once its response is.
+    ///
+    static bool finished(const Connection& connection) {
+        return connection.down.shut && (connection.up.shut || (!connection.tunnel && connection.body.complete()));
+    }
+
+    ConfigStore::Snapshot snapshot() const;
+
+    const ProxyConfig& _config;  // listener and loop settings, read at startup
+    const ConfigStore::Snapshot _fallback;  // used when nothing publishes snapshots
+    int _listener = -1;
+    int _epoll    = -1;
+    int _wake     = -1;
+    std::atomic<bool> _stopping{false};
+    std::atomic<bool> _accepting{true};
+    std::atomic<int> _replacement{-1};
+    std::atomic<int> _active{0};
+    QByteArray _chunk;
+    QVector<Connection> _connections;
+    QVector<quint32> _free;
+    QVector<quint64> _queued;  // tags of connections with gathered data, sent after each epoll_wait
+    IoUring _ring;
+    QVector<quint64> _starved;    // tag() of receives that found no free buffer, retried as buffers come back
+    QVector<int> _ringOps;        // ring requests still due per slot, a closed slot is only reused at 0
+    bool _acceptStalled = false;  // the ring accept failed, it is armed again once a connection closes
+    QElapsedTimer _clock;
+    TimingWheel _wheel{kTickResolution};
+    QVector<QSharedPointer<TimingWheel::Timer>> _timers;  // one per slot: header read, connect, then idle
+    QMutex _resolvedLock;
+    QVector<Resolved> _resolved;
+};
+
+EpollLoop::EpollLoop(const ProxyConfig& config, QObject* parent) : QThread(parent), _config{config},
+    _fallback{ConfigStore::Snapshot::create(config)} {
+    _chunk.resize(qMax(4096, _config.readBufferSize));
+    _clock.start();
+}
+
+EpollLoop::~EpollLoop() {
+    stop();
+    wait();
+    _ring.close();
+    closeSocket(_listener);
+    closeSocket(_replacement.exchange(-1));
+    closeSocket(_epoll);
+    closeSocket(_wake);
+}
+
+bool EpollLoop::open(qintptr inherited, bool uring) {
+    if (inherited >= 0) {
+        _listener = static_cast<int>(inherited);
+        ::fcntl(_listener, F_SETFL, ::fcntl(_listener, F_GETFL) | O_NONBLOCK);
+    } else {
+        _listener = static_cast<int>(openListenSocket(_config.address, _config.port, true));
+    }
+
+    _epoll    = ::epoll_create1(EPOLL_CLOEXEC);
+    _wake     = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if ((_listener < 0) || (_epoll < 0) || (_wake < 0)) {
+        return false;
+    }
+
+    tuneListener(_listener, _config.socketTuning);
+
+    if (uring && !_ring.open(_config.uringOptions, _chunk.size())) {
+        qWarning() << QStringLiteral("io_uring setup failed:") << qt_error_string(errno) << QStringLiteral("relaying through epoll");
+    }
+
+    epoll_event wake{};
+    wake.events   = EPOLLIN;
+    wake.data.u64 = kWakeTag;
+
+    if (::epoll_ctl(_epoll, EPOLL_CTL_ADD, _wake, &wake) < 0) {
+        return false;
+    }
+
+    // the ring accepts on its own, run() arms it
+    if (_ring.isOpen()) {
+        epoll_event completions{};
+        completions.events   = EPOLLIN;
+        completions.data.u64 = kRingTag;
+        return ::epoll_ctl(_epoll, EPOLL_CTL_ADD, _ring.eventFd(), &completions) == 0;
+    }
+
+    epoll_event incoming{};
+    incoming.events   = EPOLLIN | EPOLLET;
+    incoming.data.u64 = kListenTag;
+    return ::epoll_ctl(_epoll, EPOLL_CTL_ADD, _listener, &incoming) == 0;
+}
+
+void EpollLoop::stop() {
+    _stopping.store(true);
+
+    if (_wake >= 0) {
+        const quint64 one = 1;
+        Q_UNUSED(::write(_wake, &one, sizeof(one)))
+    }
+}
+
+void EpollLoop::stopAccepting() {
+    _accepting.store(false);
+
+    if (_wake >= 0) {
+        const quint64 one = 1;
+        Q_UNUSED(::write(_wake, &one, sizeof(one)))
+    }
+}
+
+void EpollLoop::replaceListener(int fd) {
+    closeSocket(_replacement.exchange(fd));
+
+    if (_wake >= 0) {
+        const quint64 one = 1;
+        Q_UNUSED(::write(_wake, &one, sizeof(one)))
+    }
+}
+
+void EpollLoop::run() {
+    epoll_event events[kMaxEvents];
+
+    if (_ring.isOpen()) {
+        _ring.accept(_listener, ringTag(RingOp::Accept, static_cast<quint32>(_listener)));
+        _ring.submit();
+    }
+
+    while (!_stopping.load(std::memory_order_relaxed)) {
+        // batches gathered at the cap go out next without waiting, the wheel needs a tick while armed
+        const auto timeout = !_queued.isEmpty() ? 0 : ((_wheel.size() > 0) ? kTickResolution : -1);
+        const auto count   = ::epoll_wait(_epoll, events, kMaxEvents, timeout);
+        Metrics::add(Metrics::Counter::Polls);
+
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            qWarning() << QStringLiteral("epoll_wait failed:") << qt_error_string(errno);
+            break;
+        }
+
+        for (auto i = 0; i < count; ++i) {
+            const auto tag = events[i].data.u64;
+
+            if (tag == kListenTag) {
+                accept();
+            } else if (tag == kWakeTag) {
+                wake();
+            } else if (tag == kRingTag) {
+                reap();
+            } else {
+                dispatch(tag, events[i].events);
+            }
+        }
+
+        if (_wheel.size() > 0) {
+            _wheel.advance();
+        }
+
+        flushQueued();
+
+        // what this iteration queued on the ring goes out in one go
+        if (_ring.isOpen() && _ring.submit()) {
+            Metrics::add(Metrics::Counter::Submits);
+        }
+    }
+
+    for (quint32 index = 0; index < static_cast<quint32>(_connections.size()); ++index) {
+        close(index);
+    }
+}
+
+void EpollLoop::accept() {
+    while (_listener >= 0) {
+        const auto fd = ::accept4(_listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                qWarning() << QStringLiteral("accept failed:") << qt_error_string(errno);
+            }
+
+            return;
+        }
+
+        adopt(fd);
+    }
+}
+
+ConfigStore::Snapshot EpollLoop::snapshot() const {
+    const auto store = ConfigStore::instance();
+    return store ? store->snapshot() : _fallback;
+}
+
+void EpollLoop::adopt(int fd) {
+    Metrics::add(Metrics::Counter::Accepts);
+    auto config = snapshot();
+    QHostAddress client;
+
+    if (RateLimiter::limitsClients(config->rateLimits)) {
+        client = peerAddress(fd);
+
+        if (!client.isNull() && !RateLimiter::admit(client, config->rateLimits)) {
+            Metrics::add(Metrics::Counter::RateLimited);
+            closeSocket(fd);
+            return;
+        }
+    }
+
+    quint32 index = 0;
+
+    if (!_free.isEmpty()) {
+        index = _free.takeLast();
+    } else {
+        index = static_cast<quint32>(_connections.size());
+        _connections.append({});
+        _ringOps.append(0);
+        _timers.append(QSharedPointer<TimingWheel::Timer>::create([this, index]() {
+            expire(index);
+        }));
+    }
+
+    tuneSocket(fd, config->socketTuning);
+
+    auto& connection   = _connections[index];
+    connection.down.fd = fd;
+    connection.client  = client;
+    connection.config  = std::move(config);
+    _active.fetch_add(1, std::memory_order_relaxed);
+    Metrics::add(Metrics::Counter::ConnectionsOpened);
+    arm(index, connection.config->headerReadTimeout);
+
+    epoll_event event{};
+    event.events   = kEvents;
+    event.data.u64 = tag(index, connection.generation, false);
+
+    // edge-triggered registration reports data that is already queued
+    if (::epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        close(index);
+    }
+}
+
+void EpollLoop::wake() {
+    quint64 value = 0;
+    Q_UNUSED(::read(_wake, &value, sizeof(value)))
+
+    const auto replacement = _replacement.exchange(-1);
+
+    if ((replacement >= 0) || !_accepting.load()) {
+        if ((_listener >= 0) && _ring.isOpen()) {
+            // the armed accept holds the socket open until it is cancelled
+            _ring.cancel(ringTag(RingOp::Accept, static_cast<quint32>(_listener)));
+            closeSocket(_listener);
+            _listener = -1;
+        } else if (_listener >= 0) {
+            ::epoll_ctl(_epoll, EPOLL_CTL_DEL, _listener, nullptr);
+            closeSocket(_listener);
+            _listener = -1;
+        }
+
+        if (_accepting.load() && _ring.isOpen()) {
+            _listener      = replacement;
+            _acceptStalled = false;
+            _ring.accept(_listener, ringTag(RingOp::Accept, static_cast<quint32>(_listener)));
+        } else if (_accepting.load()) {
+            epoll_event incoming{};
+            incoming.events   = EPOLLIN | EPOLLET;
+            incoming.data.u64 = kListenTag;
+            _listener         = replacement;
+            ::epoll_ctl(_epoll, EPOLL_CTL_ADD, _listener, &incoming);
+        } else {
+            closeSocket(replacement);
+        }
+    }
+
+    QVector<Resolved> resolved;
+    {
+        QMutexLocker locker(&_resolvedLock);
+        resolved.swap(_resolved);
+    }
+
+    for (const auto& entry : qAsConst(resolved)) {
+        this->resolved(entry.id, entry.addresses);
+    }
+}
+
+void EpollLoop::dispatch(quint64 tag, quint32 events) {
+    const auto index      = static_cast<quint32>((tag & 0xffffffff) >> 1);
+    const auto generation = static_cast<quint32>(tag >> 32);
+    const auto up         = ((tag & 1) != 0);
+
+    if (index >= static_cast<quint32>(_connections.size())) {
+        return;
+    }
+
+    const auto& connection = _connections.at(index);
+
+    if ((connection.generation != generation) || (connection.down.fd < 0)) {
+        return;  // the slot was recycled earlier in this batch
+    }
+
+    switch (connection.state) {
+        case State::Head:
+
+            if (!up) {
+                readHead(index);
+            }
+
+            break;
+
+        case State::Resolving:
+            break;
+
+        case State::Connecting:
+
+            if (up && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                connected(index);
+            }
+
+            break;
+
+        case State::Relay:
+            relay(index, up, events);
+            break;
+    }
+}
+
+void EpollLoop::readHead(quint32 index) {
+    auto& connection = _connections[index];
+
+    for (;;) {
+        const auto read = ::recv(connection.down.fd, _chunk.data(), static_cast<size_t>(_chunk.size()), 0);
+        Metrics::add(Metrics::Counter::Reads);
+
+        if (read > 0) {
+            const auto fed = connection.head.size();
+            connection.head.append(_chunk.constData(), static_cast<int>(read));
+            const auto end = connection.head.indexOf("\r\n\r\n", qMax(0, fed - 3));
+
+            if ((end >= 0) && (end + 4 <= connection.config->maxHeaderSize)) {
+                handleRequest(index, end + 4);
+                return;
+            }
+
+            if (connection.head.size() > connection.config->maxHeaderSize) {
+                qWarning() << QStringLiteral("HttpRequest head exceeds") << connection.config->maxHeaderSize << QStringLiteral("bytes");
+                reject(index, 431, "Request Header Fields Too Large");
+                return;
+            }
+
+            continue;
+        }
+
+        if ((read < 0) && (errno == EINTR)) {
+            continue;
+        }
+
+        if ((read < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            return;
+        }
+
+        close(index);
+        return;
+    }
+}
+
+void EpollLoop::handleRequest(quint32 index, int headSize) {
+    using namespace httpparser;
+
+    auto& connection = _connections[index];
+    Request request;
+    RequestLine line;
+    HttpTarget target;
+
+    const auto begin = connection.head.constData();
+
+    // a CONNECT needs nothing past its request line, the parser only runs for everything else
+    if (line.scan(begin, headSize) && (line.method == RequestLine::Method::Connect)) {
+        target = connectTarget(line);
+    }
+
+    if (target.valid) {
+        request.versionMajor = line.versionMajor;
+        request.versionMinor = line.versionMinor;
+    } else {
+        HttpRequestParser parser;
+
+        if (parser.parse(request, begin, begin + headSize) == HttpRequestParser::ParsingError) {
+            qWarning() << QStringLiteral("HttpRequest parse failed!") << connection.head.left(headSize).constData();
+            Metrics::add(Metrics::Counter::ParseFailures);
+            close(index, Metrics::Termination::ParseError);
+            return;
+        }
+
+        line.method = RequestLine::methodOf(request.method);
+    }
+
+    Metrics::add(Metrics::Counter::Requests);
+
+    if (line.method == RequestLine::Method::Other) {
+        reject(index, 501, "Not Implemented");
+        return;
+    }
+
+    if (!target.valid) {
+        target = requestTarget(request);
+    }
+
+    if (!target.valid) {
+        qWarning() << QStringLiteral("Invaid URI found!");
+        reject(index, 400, "Bad Request");
+        return;
+    }
+
+    const auto& config = *connection.config;
+
+    if (config.acl && (config.acl->check(target.host, &connection.profile) == Acl::Action::Deny)) {
+        qWarning() << QStringLiteral("Target denied by ACL:") << target.host;
+        reject(index, 403, "Forbidden", Metrics::Termination::Denied);
+        return;
+    }
+
+    if (connection.profile >= 0) {
+        tuneSocket(connection.down.fd, config.tuning(connection.profile));
+    }
+
+    connection.tunnel       = (line.method == RequestLine::Method::Connect);
+    connection.versionMajor = static_cast<quint8>(request.versionMajor);
+    connection.versionMinor = static_cast<quint8>(request.versionMinor);
+    connection.port         = target.port;
+
+    const auto rest = connection.head.mid(headSize);
+
+    if (connection.tunnel) {
+        connection.head = rest;
+    } else {
+        auto mode   = BodyFramer::Mode::None;
+        auto length = qint64{0};
+
+        if (!requestBodyMode(request, mode, length)) {
+            reject(index, 400, "Bad Request");
+            return;
+        }
+
+        connection.body.reset(mode, length);
+        const auto body = requestBytes(connection, rest.constData(), rest.size());
+
+        if (body < 0) {
+            reject(index, 400, "Bad Request");
+            return;
+        }
+
+        // the upstream is told to close after one response, anything past the body is dropped
+        connection.head = forwardHead(request, target, false) + rest.left(static_cast<int>(body));
+    }
+
+    connection.state = State::Resolving;
+
+    // from here the clock covers resolving and connecting the upstream
+    arm(index, connection.config->connectTimeout);
+
+    const auto id      = (quint64{connection.generation} << 32) | index;
+    const auto deliver = [this, id](const QList<QHostAddress>& addresses) {
+        {
+            QMutexLocker locker(&_resolvedLock);
+            _resolved.append({id, addresses});
+        }
+
+        const quint64 one = 1;
+        Q_UNUSED(::write(_wake, &one, sizeof(one)))
+    };
+
+    if (auto cache = DnsCache::instance()) {
+        cache->lookup(target.host, nullptr, deliver);
+    } else {
+        QThreadPool::globalInstance()->start(new LookupTask(target.host, deliver));
+    }
+}
+
+void EpollLoop::resolved(quint64 id, const QList<QHostAddress>& addresses) {
+    const auto index = static_cast<quint32>(id);
+
+    if (index >= static_cast<quint32>(_connections.size())) {
+        return;
+    }
+
+    auto& connection = _connections[index];
+
+    if ((connection.generation != static_cast<quint32>(id >> 32)) || (connection.state != State::Resolving)) {
+        return;
+    }
+
+    if (addresses.isEmpty()) {
+        qWarning() << QStringLiteral("HostLookup failed!");
+        reject(index, 502, "Bad Gateway", Metrics::Termination::DnsFailed);
+        return;
+    }
+
+    const auto& acl      = connection.config->acl;
+    const auto permitted = acl ? acl->permitted(addresses) : addresses;
+
+    if (permitted.isEmpty()) {
+        qWarning() << QStringLiteral("Target addresses denied by ACL");
+        reject(index, 403, "Forbidden", Metrics::Termination::Denied);
+        return;
+    }
+
+    connection.addresses = UpstreamConnector::sortAddresses(permitted);
+    connection.next      = 0;
+    connection.state     = State::Connecting;
+    connectNext(index);
+}
+
+void EpollLoop::connectNext(quint32 index) {
+    auto& connection = _connections[index];
+    closeSocket(connection.up.fd);
+    connection.up.fd = -1;
+
+    while (connection.next < connection.addresses.size()) {
+        const auto address = connection.addresses.at(connection.next++);
+        auto inProgress    = false;
+        const auto fd      = static_cast<int>(openConnectSocket(address, connection.port, inProgress,
+                                                             connection.config->tuning(connection.profile)));
+
+        if (fd < 0) {
+            continue;
+        }
+
+        epoll_event event{};
+        event.events   = kEvents;
+        event.data.u64 = tag(index, connection.generation, true);
+
+        if (::epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+            closeSocket(fd);
+            continue;
+        }
+
+        connection.up.fd = fd;
+
+        if (!inProgress) {
+            connected(index);
+        }
+
+        return;
+    }
+
+    qWarning() << QStringLiteral("Upstream connect failed!");
+    reject(index, 502, "Bad Gateway", Metrics::Termination::UpstreamFailed);
+}
+
+void EpollLoop::connected(quint32 index) {
+    auto& connection = _connections[index];
+
+    if (socketError(connection.up.fd) != 0) {
+        connectNext(index);
+        return;
+    }
+
+    sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+
+    if (::getpeername(connection.up.fd, reinterpret_cast<sockaddr*>(&peer), &length) < 0) {
+        return;  // stale readiness left over from a previous attempt, still in progress
+    }
+
+    connection.state    = State::Relay;
+    connection.activity = _clock.elapsed();
+    connection.addresses.clear();
+    arm(index, connection.config->idleTimeout);
+
+    QByteArray upStream;
+    upStream.swap(connection.head);
+    auto ok = true;
+
+    if (connection.tunnel) {
+        const auto response = QStringLiteral("HTTP/%1.%2 200 Connection established\r\nProxy-agent: %3/%4\r\n\r\n")
+                              .arg(connection.versionMajor)
+                              .arg(connection.versionMinor)
+                              .arg(QCoreApplication::applicationName())
+                              .arg(QCoreApplication::applicationVersion())
+                              .toLatin1();
+        ok = send(connection.down, response.constData(), response.size());
+        Metrics::add(Metrics::Counter::TunnelsOpened);
+    }
+
+    ok = ok && send(connection.up, upStream.constData(), upStream.size());
+
+    // the ring takes over once both heads went out, until then epoll reports writability
+    if (ok && _ring.isOpen()) {
+        if (connection.down.pending.isEmpty() && connection.up.pending.isEmpty()) {
+            startRing(index);
+        }
+
+        return;
+    }
+
+    // both sides may have been readable for a while, their edges are long gone
+    ok = ok
+         && pump(index, connection.down, connection.up, Metrics::Counter::BytesUp)
+         && pump(index, connection.up, connection.down, Metrics::Counter::BytesDown);
+
+    if (!ok || finished(connection)) {
+        close(index);
+    }
+}
+
+void EpollLoop::relay(quint32 index, bool up, quint32 events) {
+    auto& connection = _connections[index];
+    auto& self       = up ? connection.up : connection.down;
+    auto& other      = up ? connection.down : connection.up;
+    const auto from  = up ? Metrics::Counter::BytesDown : Metrics::Counter::BytesUp;
+    const auto to    = up ? Metrics::Counter::BytesUp : Metrics::Counter::BytesDown;
+    auto ok          = true;
+
+    // any event counts, the idle timer only compares when it is due
+    connection.activity = _clock.elapsed();
+
+    // nothing is read before the ring takes over, only the heads sent on connect are drained
+    if (_ring.isOpen()) {
+        if (connection.ring) {
+            return;  // taken over earlier in this batch
+        }
+
+        ok = flush(connection.down, connection.up) && flush(connection.up, connection.down);
+
+        if (!ok) {
+            close(index);
+        } else if (connection.down.pending.isEmpty() && connection.up.pending.isEmpty()) {
+            startRing(index);
+        }
+
+        return;
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        ok = pump(index, self, other, from);
+    }
+
+    if (ok && (events & EPOLLOUT)) {
+        // reading from the other side stopped while this one was backed up
+        ok = flush(self, other) && pump(index, other, self, to);
+    }
+
+    if (!ok || finished(connection)) {
+        close(index);
+    }
+}
+
+bool EpollLoop::pump(quint32 index, Side& from, Side& to, Metrics::Counter counter) {
+    auto& connection = _connections[index];
+
+    if (connection.config->batchWrites) {
+        return gather(index, from, to, counter);
+    }
+
+    while (!from.eof && to.pending.isEmpty()) {
+        const auto read = ::recv(from.fd, _chunk.data(), static_cast<size_t>(_chunk.size()), 0);
+        Metrics::add(Metrics::Counter::Reads);
+
+        if (read > 0) {
+            Metrics::add(counter, static_cast<quint64>(read));
+            const auto forward = (&from == &connection.down) ? requestBytes(connection, _chunk.constData(), read) : read;
+
+            if ((forward < 0) || !send(to, _chunk.constData(), forward)) {
+                return false;
+            }
+
+            continue;
+        }
+
+        if (read == 0) {
+            from.eof = true;
+            return flush(to, from);
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+    }
+
+    return true;
+}
+
+bool EpollLoop::gather(quint32 index, Side& from, Side& to, Metrics::Counter counter) {
+    auto& connection = _connections[index];
+    const auto limit = _chunk.size();  // a gathered batch costs no more memory than an unbatched chunk
+    from.more        = false;
+
+    // reads land behind what this iteration already gathered, one send takes them all
+    while (!from.eof && (to.pending.isEmpty() || to.queued) && (to.pending.size() < limit)) {
+        const auto offset = to.pending.size();
+        to.pending.resize(limit);
+        const auto read = ::recv(from.fd, to.pending.data() + offset, static_cast<size_t>(limit - offset), 0);
+        Metrics::add(Metrics::Counter::Reads);
+        to.pending.resize(offset + static_cast<int>(qMax<ssize_t>(0, read)));
+
+        if (read > 0) {
+            Metrics::add(counter, static_cast<quint64>(read));
+            const auto data    = to.pending.constData() + offset;
+            const auto forward = (&from == &connection.down) ? requestBytes(connection, data, read) : read;
+
+            if (forward < 0) {
+                return false;
+            }
+
+            to.pending.resize(offset + static_cast<int>(forward));
+
+            if (forward > 0) {
+                queue(index, to);
+            }
+
+            continue;
+        }
+
+        if (read == 0) {
+            from.eof = true;
+            queue(index, to);  // the half-close follows the gathered data
+            return true;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+    }
+
+    // stopped before EAGAIN, the edge is spent: flushQueued() gathers again once this went out
+    from.more = !from.eof && (to.pending.size() >= limit);
+    return true;
+}
+
+void EpollLoop::queue(quint32 index, Side& to) {
+    const auto& connection = _connections.at(index);
+
+    if (!connection.down.queued && !connection.up.queued) {
+        _queued.append(tag(index, connection.generation, false));
+    }
+
+    to.queued = true;
+}
+
+void EpollLoop::flushQueued() {
+    // what gathers again here is queued for the next iteration, which then polls without waiting
+    QVector<quint64> queued;
+    queued.swap(_queued);
+
+    for (const auto tag : qAsConst(queued)) {
+        const auto index = static_cast<quint32>((tag & 0xffffffff) >> 1);
+        auto& connection = _connections[index];
+
+        if ((connection.generation != static_cast<quint32>(tag >> 32)) || (connection.down.fd < 0)) {
+            continue;  // closed after it gathered
+        }
+
+        auto ok = true;
+
+        if (connection.up.queued) {
+            ok = flush(connection.up, connection.down);
+        }
+
+        if (ok && connection.down.queued) {
+            ok = flush(connection.down, connection.up);
+        }
+
+        if (ok && connection.down.more && connection.up.pending.isEmpty()) {
+            ok = gather(index, connection.down, connection.up, Metrics::Counter::BytesUp);
+        }
+
+        if (ok && connection.up.more && connection.down.pending.isEmpty()) {
+            ok = gather(index, connection.up, connection.down, Metrics::Counter::BytesDown);
+        }
+
+        if (!ok || finished(connection)) {
+            close(index);
+        }
+    }
+}
+
+bool EpollLoop::flush(Side& to, const Side& from) {
+    to.queued = false;
+
+    if (!to.pending.isEmpty()) {
+        QByteArray pending;
+        pending.swap(to.pending);
+
+        if (!send(to, pending.constData(), pending.size())) {
+            return false;
+        }
+    }
+
+    // forward the half-close once everything before it went out
+    if (from.eof && !to.shut && to.pending.isEmpty()) {
+        ::shutdown(to.fd, SHUT_WR);
+        to.shut = true;
+    }
+
+    return true;
+}
+
+bool EpollLoop::send(Side& to, const char* data, qint64 size) {
+    while (to.pending.isEmpty() && (size > 0)) {
+        const auto written = ::send(to.fd, data, static_cast<size_t>(size), MSG_NOSIGNAL);
+        Metrics::add(Metrics::Counter::Writes);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
+
+            return false;
+        }
+
+        data += written;
+        size -= written;
+    }
+
+    if (size > 0) {
+        to.pending.append(data, static_cast<int>(size));
+    }
+
+    return true;
+}
+
+void EpollLoop::reap() {
+    quint64 value = 0;
+    Q_UNUSED(::read(_ring.eventFd(), &value, sizeof(value)))
+
+    IoUring::Completion completion;
+
+    while (_ring.next(completion)) {
+        const auto op     = static_cast<RingOp>(completion.data >> 62);
+        const auto index  = static_cast<quint32>((completion.data & 0xffffffff) >> 1);
+        const auto up     = ((completion.data & 1) != 0);
+        const auto buffer = (op == RingOp::Send) ? static_cast<int>((completion.data >> 32) & 0xffff) : completion.buffer();
+
+        if (op == RingOp::None) {
+            continue;
+        }
+
+        if (op == RingOp::Accept) {
+            ringAccepted(static_cast<int>(index), completion);
+            continue;
+        }
+
+        if (index >= static_cast<quint32>(_connections.size())) {
+            continue;
+        }
+
+        const auto stale = ((_connections.at(index).generation & 0x3fff) != ((completion.data >> 48) & 0x3fff))
+                           || !_connections.at(index).ring;
+
+        if (stale) {
+            // the connection closed while this was in flight, its slot is free once nothing else is
+            if (buffer >= 0) {
+                giveBack(buffer);
+            }
+
+            if ((--_ringOps[index] == 0) && (_connections.at(index).down.fd < 0)) {
+                _free.append(index);
+            }
+
+            continue;
+        }
+
+        --_ringOps[index];
+
+        if (op == RingOp::Receive) {
+            ringReceived(index, up, buffer, completion.result);
+        } else {
+            ringSent(index, up, buffer, completion.result);
+        }
+    }
+}
+
+void EpollLoop::ringAccepted(int fd, const IoUring::Completion& completion) {
+    if (completion.result >= 0) {
+        if (_accepting.load() && (fd == _listener)) {
+            adopt(completion.result);
+        } else {
+            closeSocket(completion.result);  // raced with the cancel of a replaced listener
+        }
+    } else if (completion.result != -ECANCELED) {
+        qWarning() << QStringLiteral("accept failed:") << qt_error_string(-completion.result);
+    }
+
+    if (completion.more() || (fd != _listener) || (_listener < 0)) {
+        return;
+    }
+
+    // out of descriptors would fail again right away, a closing connection frees one
+    if (completion.result < 0) {
+        _acceptStalled = true;
+    } else {
+        _ring.accept(_listener, ringTag(RingOp::Accept, static_cast<quint32>(_listener)));
+    }
+}
+
+void EpollLoop::startRing(quint32 index) {
+    auto& connection = _connections[index];
+    ::epoll_ctl(_epoll, EPOLL_CTL_DEL, connection.down.fd, nullptr);
+    ::epoll_ctl(_epoll, EPOLL_CTL_DEL, connection.up.fd, nullptr);
+    connection.ring = true;
+
+    if (!ringReceive(index, false) || !ringReceive(index, true)) {
+        close(index);
+    }
+}
+
+bool EpollLoop::ringReceive(quint32 index, bool up) {
+    const auto& connection = _connections.at(index);
+    const auto& from       = up ? connection.up : connection.down;
+
+    if (from.eof) {
+        return true;
+    }
+
+    if (!_ring.receive(from.fd, ringTag(RingOp::Receive, index, connection.generation, up))) {
+        return false;
+    }
+
+    ++_ringOps[index];
+    return true;
+}
+
+bool EpollLoop::ringForward(quint32 index, bool up, int buffer) {
+    const auto& connection = _connections.at(index);
+    const auto& to         = up ? connection.up : connection.down;
+    const auto& from       = up ? connection.down : connection.up;
+
+    if (!_ring.forward(to.fd, _ring.buffer(buffer) + to.sent, to.sending - to.sent,
+                       ringTag(RingOp::Send, index, connection.generation, up, buffer),
+                       from.fd, ringTag(RingOp::Receive, index, connection.generation, !up))) {
+        return false;
+    }
+
+    _ringOps[index] += 2;  // the linked receive completes as well, cancelled if nothing else
+    return true;
+}
+
+void EpollLoop::ringReceived(quint32 index, bool up, int buffer, int result) {
+    auto& connection = _connections[index];
+    auto& from       = up ? connection.up : connection.down;
+    auto& to         = up ? connection.down : connection.up;
+
+    if (result > 0) {
+        connection.activity = _clock.elapsed();
+        Metrics::add(up ? Metrics::Counter::BytesDown : Metrics::Counter::BytesUp, static_cast<quint64>(result));
+        const auto forward = up ? result : requestBytes(connection, _ring.buffer(buffer), result);
+
+        if (forward <= 0) {
+            // past the request body, dropped while the response is still on its way
+            giveBack(buffer);
+
+            if ((forward < 0) || !ringReceive(index, up)) {
+                close(index);
+            }
+
+            return;
+        }
+
+        to.sending = static_cast<int>(forward);
+        to.sent    = 0;
+
+        if (!ringForward(index, !up, buffer)) {
+            giveBack(buffer);
+            close(index);
+        }
+
+        return;
+    }
+
+    if (buffer >= 0) {
+        giveBack(buffer);
+    }
+
+    if (result == 0) {
+        // nothing is in flight to the other side, the receive only followed a completed send
+        from.eof = true;
+        ::shutdown(to.fd, SHUT_WR);
+        to.shut = true;
+
+        if (finished(connection)) {
+            close(index);
+        }
+
+        return;
+    }
+
+    switch (-result) {
+        case ECANCELED:
+            break;  // behind a send that failed or fell short, ringSent() has it
+
+        case ENOBUFS:
+            _starved.append(tag(index, connection.generation, up));
+            break;
+
+        case EINTR:
+        case EAGAIN:
+
+            if (!ringReceive(index, up)) {
+                close(index);
+            }
+
+            break;
+
+        default:
+            close(index);
+            break;
+    }
+}
+
+void EpollLoop::ringSent(quint32 index, bool up, int buffer, int result) {
+    auto& connection = _connections[index];
+    auto& to         = up ? connection.up : connection.down;
+
+    if (result < 0) {
+        giveBack(buffer);
+        close(index);
+        return;
+    }
+
+    to.sent += result;
+
+    // the linked receive was cancelled, both go again for the rest
+    if (to.sent < to.sending) {
+        if (!ringForward(index, up, buffer)) {
+            giveBack(buffer);
+            close(index);
+        }
+
+        return;
+    }
+
+    to.sending = 0;
+    to.sent    = 0;
+    giveBack(buffer);
+}
+
+void EpollLoop::giveBack(int buffer) {
+    _ring.recycle(buffer);
+
+    // the buffer that just came back goes to a receive that waited for one
+    while (!_starved.isEmpty()) {
+        const auto tag      = _starved.takeFirst();
+        const auto starved  = static_cast<quint32>((tag & 0xffffffff) >> 1);
+        const auto& waiting = _connections.at(starved);
+
+        if (waiting.ring && (waiting.generation == static_cast<quint32>(tag >> 32))) {
+            if (!ringReceive(starved, (tag & 1) != 0)) {
+                close(starved);
+            }
+
+            break;
+        }
+    }
+}
+
+void EpollLoop::arm(quint32 index, int msecs) {
+    auto& timer = *_timers.at(static_cast<int>(index));
+
+    // a slot's timer is stopped when it closes, so it never fires for the next connection in it
+    if (msecs > 0) {
+        _wheel.start(timer, msecs);
+    } else {
+        _wheel.stop(timer);
+    }
+}
+
+void EpollLoop::expire(quint32 index) {
+    auto& connection   = _connections[index];
+    const auto& config = *connection.config;
+
+    switch (connection.state) {
+        case State::Head:
+            qWarning() << QStringLiteral("HttpRequest head not received within") << config.headerReadTimeout << QStringLiteral("ms");
+            reject(index, 408, "Request Timeout", Metrics::Termination::Timeout);
+            break;
+
+        case State::Resolving:
+        case State::Connecting:
+            qWarning() << QStringLiteral("UpStream not connected within") << config.connectTimeout << QStringLiteral("ms");
+            reject(index, 504, "Gateway Timeout", Metrics::Termination::UpstreamTimeout);
+            break;
+
+        case State::Relay: {
+            // relay events only stamp the activity, the timer is re-armed here for whatever is left
+            const auto quiet = _clock.elapsed() - connection.activity;
+
+            if (quiet < config.idleTimeout) {
+                arm(index, static_cast<int>(config.idleTimeout - quiet));
+            } else {
+                close(index, Metrics::Termination::Timeout);
+            }
+
+            break;
+        }
+    }
+}
+
+qint64 EpollLoop::requestBytes(Connection& connection, const char* data, qint64 size) {
+    if (connection.tunnel) {
+        return size;
+    }
+
+    const auto consumed = connection.body.consume(data, size);
+    return connection.body.failed() ? -1 : consumed;
+}
+
+void EpollLoop::reject(quint32 index, int statusCode, const char* reason, Metrics::Termination termination) {
+    const auto response = QStringLiteral("HTTP/1.1 %1 %2\r\nContent-Length: 0\r\nConnection: close\r\n\r\n")
+                          .arg(statusCode)
+                          .arg(QLatin1String(reason))
+                          .toLatin1();
+    Q_UNUSED(::send(_connections.at(index).down.fd, response.constData(), static_cast<size_t>(response.size()), MSG_NOSIGNAL))
+    close(index, termination);
+}
+
+void EpollLoop::close(quint32 index, Metrics::Termination termination) {
+    auto& connection = _connections[index];
+
+    if (connection.down.fd < 0) {
+        return;
+    }
+
+    Metrics::add(Metrics::Counter::ConnectionsClosed);
+    Metrics::terminated(termination);
+
+    if (connection.tunnel && (connection.state == State::Relay)) {
+        Metrics::add(Metrics::Counter::TunnelsClosed);
+    }
+
+    if (!connection.client.isNull()) {
+        RateLimiter::release(connection.client);
+    }
+
+    // requests in flight hold the sockets open, the shutdown completes them
+    if (connection.ring) {
+        ::shutdown(connection.down.fd, SHUT_RDWR);
+        ::shutdown(connection.up.fd, SHUT_RDWR);
+    }
+
+    // closing the descriptors drops them from the epoll set as well
+    closeSocket(connection.down.fd);
+    closeSocket(connection.up.fd);
+
+    _wheel.stop(*_timers.at(static_cast<int>(index)));
+
+    const auto generation = connection.generation + 1;
+    connection            = Connection{};
+    connection.generation = generation;
+
+    if (_ringOps.at(index) == 0) {
+        _free.append(index);
+    }
+
+    _active.fetch_sub(1, std::memory_order_relaxed);
+
+    if (_acceptStalled && (_listener >= 0) && _accepting.load()) {
+        _acceptStalled = false;
+        _ring.accept(_listener, ringTag(RingOp::Accept, static_cast<quint32>(_listener)));
+    }
+}
+
+#else // ifdef Q_OS_LINUX
+
+class EpollLoop {};
+
+#endif // Q_OS_LINUX
+
+EpollEngine::EpollEngine(const ProxyConfig& config) : _config{config} {
+}
+
+EpollEngine::~EpollEngine() {
+    stop();
+#ifdef Q_OS_LINUX
+    // pending lookups hold on to their loop
+    QThreadPool::globalInstance()->waitForDone();
+    qDeleteAll(_loops);
+#endif // Q_OS_LINUX
+}
+
+bool EpollEngine::isSupported() {
+#ifdef Q_OS_LINUX
+    return true;
+#else // ifdef Q_OS_LINUX
+    return false;
+#endif // Q_OS_LINUX
+}
+
+bool EpollEngine::start(const QVector<qintptr>& inherited) {
+#ifdef Q_OS_LINUX
+    auto loops = _config.workers;
+
+    if (loops <= 0) {
+        loops = QThread::idealThreadCount();
+    }
+
+    auto uring = (_config.engine == QLatin1String("uring"));
+    QString reason;
+
+    if (uring && !IoUring::isSupported(&reason)) {
+        qWarning() << QStringLiteral("io_uring is not available:") << reason << QStringLiteral("relaying through epoll");
+        uring = false;
+    }
+
+    for (auto i = 0; i < qMax(1, loops); ++i) {
+        auto loop = new EpollLoop(_config);
+        loop->setObjectName(QStringLiteral("EpollLoop-%1").arg(i));
+        _loops.append(loop);
+
+        if (!loop->open(i < inherited.size() ? inherited.at(i) : -1, uring)) {
+            return false;
+        }
+    }
+
+    // a predecessor with more loops, nothing here would accept on the rest
+    for (auto i = _loops.size(); i < inherited.size(); ++i) {
+        closeSocket(inherited.at(i));
+    }
+
+    for (auto loop : qAsConst(_loops)) {
+        loop->start();
+    }
+
+    return true;
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(inherited)
+    return false;
+#endif // Q_OS_LINUX
+}
+
+void EpollEngine::stop() {
+#ifdef Q_OS_LINUX
+
+    for (auto loop : qAsConst(_loops)) {
+        loop->stop();
+    }
+
+    for (auto loop : qAsConst(_loops)) {
+        loop->wait();
+    }
+
+#endif // Q_OS_LINUX
+}
+
+void EpollEngine::stopAccepting() {
+#ifdef Q_OS_LINUX
+
+    for (auto loop : qAsConst(_loops)) {
+        loop->stopAccepting();
+    }
+
+#endif // Q_OS_LINUX
+}
+
+bool EpollEngine::rebind(const QHostAddress& address, quint16 port) {
+#ifdef Q_OS_LINUX
+    QVector<qintptr> fds;
+
+    // all or nothing, a loop without a listener would sit idle
+    for (auto i = 0; i < _loops.size(); ++i) {
+        const auto fd = openListenSocket(address, port, true);
+
+        if (fd < 0) {
+            for (auto opened : qAsConst(fds)) {
+                closeSocket(opened);
+            }
+
+            qWarning() << QStringLiteral("Cannot move the listeners to") << QStringLiteral("%1:%2").arg(address.toString()).arg(port);
+            return false;
+        }
+
+        tuneListener(fd, _config.socketTuning);
+        fds.append(fd);
+    }
+
+    for (auto i = 0; i < _loops.size(); ++i) {
+        _loops.at(i)->replaceListener(static_cast<int>(fds.at(i)));
+    }
+
+    return true;
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(address)
+    Q_UNUSED(port)
+    return false;
+#endif // Q_OS_LINUX
+}
+
+QVector<qintptr> EpollEngine::listeners() const {
+    QVector<qintptr> fds;
+#ifdef Q_OS_LINUX
+
+    for (auto loop : _loops) {
+        if (loop->listener() >= 0) {
+            fds.append(loop->listener());
+        }
+    }
+
+#endif // Q_OS_LINUX
+    return fds;
+}
+
+int EpollEngine::loops() const {
+    return _loops.size();
+}
+
+int EpollEngine::activeConnections() const {
+    auto active = 0;
+#ifdef Q_OS_LINUX
+
+    for (auto loop : _loops) {
+        active += loop->activeConnections();
+    }
+
+#endif // Q_OS_LINUX
+    return active;
+}
@@ -0,0 +1,62 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include "proxyserver.h"
+
+class EpollLoop;
+
+///
+/// \brief The EpollEngine class
+/// Alternative to WorkerPool/ProxyServer that drives connections straight off
+/// epoll: one loop thread per worker, each with its own SO_REUSEPORT listener
+/// and a compact record per connection instead of two QTcpSockets. Relay is
+/// edge-triggered and only buffers what the receiving side would not take.
+/// Plain HTTP requests are forwarded one per connection. Linux only.
+///
+/// With the uring engine each loop accepts and relays through its own io_uring
+/// instead, falling back to epoll where the kernel or a seccomp policy refuses it.
+///
+/// start() adopts listening sockets inherited from a previous instance before
+/// opening new ones; stopAccepting() closes the listeners and lets the live
+/// connections run on for a drain.
+///
+class EpollEngine final {
+  public:
+    explicit EpollEngine(const ProxyConfig& config);
+    ~EpollEngine();
+
+    static bool isSupported();
+
+    bool start(const QVector<qintptr>& inherited = {});
+    void stop();
+    void stopAccepting();
+
+    ///
+    /// Opens listeners on \a address:\a port and swaps them in, live connections stay.
+    ///
+    bool rebind(const QHostAddress& address, quint16 port);
+
+    QVector<qintptr> listeners() const;
+
+    int loops() const;
+    int activeConnections() const;
+
+  private:
+    const ProxyConfig _config;
+    QVector<EpollLoop*> _loops;
+};
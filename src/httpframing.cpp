@@ -0,0 +1,172 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "httpframing.h"
+
+static int hexValue(char c) {
+    if ((c >= '0') && (c <= '9')) {
+        return c - '0';
+    }
+
+    if ((c >= 'a') && (c <= 'f')) {
+        return c - 'a' + 10;
+    }
+
+    if ((c >= 'A') && (c <= 'F')) {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+void BodyFramer::reset(Mode mode, qint64 length) {
+    _mode       = mode;
+    _remaining  = 0;
+    _sizeDigits = 0;
+
+    switch (mode) {
+        case Mode::None:
+            _state = State::Done;
+            break;
+
+        case Mode::Length:
+            _remaining = length;
+            _state     = (length > 0) ? State::Data : State::Done;
+            break;
+
+        case Mode::Chunked:
+            _state = State::Size;
+            break;
+
+        case Mode::UntilClose:
+            _state = State::Data;
+            break;
+    }
+}
+
+qint64 BodyFramer::consume(const char* data, qint64 size) {
+    if (_mode == Mode::UntilClose) {
+        return size;
+    }
+
+    qint64 offset = 0;
+
+    while ((offset < size) && (_state != State::Done) && (_state != State::Error)) {
+        const auto c = data[offset];
+
+        switch (_state) {
+            case State::Size: {
+                const auto digit = hexValue(c);
+
+                if (digit >= 0) {
+                    // 15 hex digits is already far beyond any sane chunk
+                    if (++_sizeDigits > 15) {
+                        _state = State::Error;
+                        break;
+                    }
+
+                    _remaining = (_remaining << 4) | digit;
+                } else if ((_sizeDigits > 0) && ((c == ';') || (c == ' ') || (c == '\t'))) {
+                    _state = State::Extension;
+                } else if ((_sizeDigits > 0) && (c == '\r')) {
+                    _state = State::SizeLF;
+                } else {
+                    _state = State::Error;
+                }
+
+                ++offset;
+                break;
+            }
+
+            case State::Extension:
+                if (c == '\r') {
+                    _state = State::SizeLF;
+                }
+
+                ++offset;
+                break;
+
+            case State::SizeLF:
+                _state      = (c != '\n') ? State::Error : ((_remaining == 0) ? State::TrailerStart : State::Data);
+                _sizeDigits = 0;
+                ++offset;
+                break;
+
+            case State::Data: {
+                const auto chunk = qMin(_remaining, size - offset);
+                _remaining -= chunk;
+                offset     += chunk;
+
+                if (_remaining == 0) {
+                    _state = (_mode == Mode::Length) ? State::Done : State::DataCR;
+                }
+
+                break;
+            }
+
+            case State::DataCR:
+                _state = (c == '\r') ? State::DataLF : State::Error;
+                ++offset;
+                break;
+
+            case State::DataLF:
+                _state = (c == '\n') ? State::Size : State::Error;
+                ++offset;
+                break;
+
+            case State::TrailerStart:
+                _state = (c == '\r') ? State::FinalLF : State::Trailer;
+                ++offset;
+                break;
+
+            case State::Trailer:
+                if (c == '\r') {
+                    _state = State::TrailerLF;
+                }
+
+                ++offset;
+                break;
+
+            case State::TrailerLF:
+                _state = (c == '\n') ? State::TrailerStart : State::Error;
+                ++offset;
+                break;
+
+            case State::FinalLF:
+                _state = (c == '\n') ? State::Done : State::Error;
+                ++offset;
+                break;
+
+            case State::Done:
+            case State::Error:
+                break;
+        }
+    }
+
+    return offset;
+}
+
+BodyFramer::Mode BodyFramer::mode() const {
+    return _mode;
+}
+
+bool BodyFramer::complete() const {
+    return _state == State::Done;
+}
+
+bool BodyFramer::failed() const {
+    return _state == State::Error;
+}
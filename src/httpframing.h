@@ -0,0 +1,67 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+
+///
+/// \brief The BodyFramer class
+/// Tracks where an HTTP/1.x message body ends without buffering or decoding it,
+/// so the bytes can be relayed as they arrive (RFC 9112 section 6).
+///
+class BodyFramer final {
+  public:
+    enum class Mode {
+        None,       // no body, complete right away
+        Length,     // Content-Length
+        Chunked,    // Transfer-Encoding: chunked
+        UntilClose  // response delimited by the connection close
+    };
+
+    void reset(Mode mode, qint64 length = 0);
+
+    ///
+    /// Consumes the body bytes at the front of \a data and returns how many belong to it.
+    /// Anything past the returned count is the start of the next message.
+    ///
+    qint64 consume(const char* data, qint64 size);
+
+    Mode mode() const;
+    bool complete() const;
+    bool failed() const;
+
+  private:
+    enum class State {
+        Size,
+        Extension,
+        SizeLF,
+        Data,
+        DataCR,
+        DataLF,
+        TrailerStart,
+        Trailer,
+        TrailerLF,
+        FinalLF,
+        Done,
+        Error
+    };
+
+    Mode _mode        = Mode::None;
+    State _state      = State::Done;
+    qint64 _remaining = 0;
+    int _sizeDigits   = 0;
+};
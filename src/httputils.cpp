@@ -0,0 +1,471 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "httputils.h"
+#include <cctype>
+#include <cstring>
+
+static constexpr auto kHttpScheme = "http://";
+
+// a method token in the low bytes of an integer, first character lowest
+static constexpr quint64 packMethod(const char* name, int index = 0) {
+    return (name[index] == '\0') ? 0 : ((quint64{static_cast<quint8>(name[index])} << (8 * index)) | packMethod(name, index + 1));
+}
+
+static constexpr auto kMaxMethodSize = 7;
+static constexpr auto kConnectMethod = packMethod("CONNECT");
+static constexpr auto kGetMethod     = packMethod("GET");
+static constexpr auto kPutMethod     = packMethod("PUT");
+static constexpr auto kPostMethod    = packMethod("POST");
+static constexpr auto kHeadMethod    = packMethod("HEAD");
+static constexpr auto kDeleteMethod  = packMethod("DELETE");
+
+static bool splitAuthority(const QByteArray& authority, quint16 defaultPort, HttpTarget& target) {
+    auto host = authority;
+    auto port = defaultPort;
+
+    // "[v6]:port", "host:port" or a bare host
+    const auto colon   = authority.lastIndexOf(':');
+    const auto bracket = authority.lastIndexOf(']');
+
+    if ((colon > 0) && (colon > bracket)) {
+        auto ok = false;
+        port    = authority.mid(colon + 1).toUShort(&ok);
+
+        if (!ok || (port == 0)) {
+            return false;
+        }
+
+        host = authority.left(colon);
+    }
+
+    if (host.startsWith('[') && host.endsWith(']')) {
+        host = host.mid(1, host.size() - 2);
+    }
+
+    if (host.isEmpty()) {
+        return false;
+    }
+
+    target.host      = QString::fromLatin1(host);
+    target.port      = port;
+    target.authority = authority;
+    return true;
+}
+
+bool RequestLine::scan(const char* data, int size) {
+    // memchr runs vectorized, the line end is usually the only thing worth searching for
+    const auto newline = static_cast<const char*>(std::memchr(data, '\n', static_cast<size_t>(qMax(0, size))));
+
+    if (!newline || (newline == data) || (newline[-1] != '\r')) {
+        return false;
+    }
+
+    const auto end   = newline - 1;
+    const auto space = static_cast<const char*>(std::memchr(data, ' ', static_cast<size_t>(qMin<qint64>(kMaxMethodSize + 1, end - data))));
+
+    if (!space) {
+        return false;
+    }
+
+    // "HTTP/d.d" closes the line, one space before it
+    const auto version = end - 8;
+
+    if ((version <= space + 1) || (version[-1] != ' ') || (std::memcmp(version, "HTTP/", 5) != 0)
+            || !isdigit(static_cast<uchar>(version[5])) || (version[6] != '.') || !isdigit(static_cast<uchar>(version[7]))) {
+        return false;
+    }
+
+    method       = methodOf(data, static_cast<int>(space - data));
+    target       = space + 1;
+    targetSize   = static_cast<int>(version - 1 - target);
+    versionMajor = static_cast<quint8>(version[5] - '0');
+    versionMinor = static_cast<quint8>(version[7] - '0');
+    return !std::memchr(target, ' ', static_cast<size_t>(targetSize));
+}
+
+RequestLine::Method RequestLine::methodOf(const char* data, int size) {
+    if ((size <= 0) || (size > kMaxMethodSize)) {
+        return Method::Other;
+    }
+
+    quint64 word = 0;
+    std::memcpy(&word, data, static_cast<size_t>(size));
+
+    switch (qFromLittleEndian(word)) {
+        case kConnectMethod:
+            return Method::Connect;
+
+        case kGetMethod:
+            return Method::Get;
+
+        case kPutMethod:
+            return Method::Put;
+
+        case kPostMethod:
+            return Method::Post;
+
+        case kHeadMethod:
+            return Method::Head;
+
+        case kDeleteMethod:
+            return Method::Delete;
+
+        default:
+            return Method::Other;
+    }
+}
+
+HttpTarget connectTarget(const RequestLine& line) {
+    HttpTarget target;
+    auto colon = line.targetSize - 1;
+
+    while ((colon >= 0) && (line.target[colon] != ':')) {
+        --colon;
+    }
+
+    const auto digits = line.targetSize - colon - 1;
+
+    if ((colon <= 0) || (digits == 0) || (digits > 5)) {
+        return target;
+    }
+
+    quint32 port = 0;
+
+    for (auto i = colon + 1; i < line.targetSize; ++i) {
+        if (!isdigit(static_cast<uchar>(line.target[i]))) {
+            return target;
+        }
+
+        port = port * 10 + static_cast<quint32>(line.target[i] - '0');
+    }
+
+    auto host     = line.target;
+    auto hostSize = colon;
+
+    if ((host[0] == '[') && (hostSize > 2) && (host[hostSize - 1] == ']')) {
+        ++host;
+        hostSize -= 2;
+    } else if (std::memchr(host, ':', static_cast<size_t>(hostSize)) || std::memchr(host, '[', static_cast<size_t>(hostSize))) {
+        return target;
+    }
+
+    if ((port == 0) || (port > 65535)) {
+        return target;
+    }
+
+    target.host  = QString::fromLatin1(host, hostSize);
+    target.port  = static_cast<quint16>(port);
+    target.valid = true;
+    return target;
+}
+
+bool headerNameEquals(const std::string& name, const char* other) {
+    return qstricmp(name.c_str(), other) == 0;
+}
+
+HttpTarget requestTarget(const httpparser::Request& request) {
+    HttpTarget target;
+    const auto uri = QByteArray::fromStdString(request.uri);
+
+    if (headerNameEquals(request.method, "CONNECT")) {
+        // authority-form, a port is mandatory
+        target.valid = uri.contains(':') && splitAuthority(uri, 0, target);
+        return target;
+    }
+
+    if (uri.startsWith('/')) {
+        // origin-form, the authority comes from Host
+        for (const auto& header : request.headers) {
+            if (headerNameEquals(header.name, "Host")) {
+                target.path  = uri;
+                target.valid = splitAuthority(QByteArray::fromStdString(header.value).trimmed(), 80, target);
+                break;
+            }
+        }
+
+        return target;
+    }
+
+    const auto schemeSize = static_cast<int>(qstrlen(kHttpScheme));
+
+    if (qstrnicmp(uri.constData(), kHttpScheme, static_cast<uint>(schemeSize)) != 0) {
+        return target;
+    }
+
+    auto authorityEnd = uri.size();
+
+    for (const auto delimiter : {'/', '?', '#'}) {
+        const auto index = uri.indexOf(delimiter, schemeSize);
+
+        if ((index >= 0) && (index < authorityEnd)) {
+            authorityEnd = index;
+        }
+    }
+
+    auto authority = uri.mid(schemeSize, authorityEnd - schemeSize);
+
+    // drop userinfo, it must never reach the origin
+    const auto at = authority.lastIndexOf('@');
+
+    if (at >= 0) {
+        authority = authority.mid(at + 1);
+    }
+
+    target.path = uri.mid(authorityEnd);
+    const auto fragment = target.path.indexOf('#');
+
+    if (fragment >= 0) {
+        target.path.truncate(fragment);
+    }
+
+    if (target.path.isEmpty() || target.path.startsWith('?')) {
+        target.path.prepend('/');
+    }
+
+    target.valid = splitAuthority(authority, 80, target);
+    return target;
+}
+
+///
+/// Returns every field called \a name joined by commas, as a recipient that combines
+/// repeated fields sees it (RFC 9110 5.3), or a null array when there is none.
+///
+template<typename Headers>
+static QByteArray joinedValue(const Headers& headers, const char* name) {
+    QByteArray joined;
+    auto found = false;
+
+    for (const auto& header : headers) {
+        if (headerNameEquals(header.name, name)) {
+            if (found) {
+                joined.append(", ");
+            }
+
+            joined.append(header.value.c_str(), static_cast<int>(header.value.size()));
+            found = true;
+        }
+    }
+
+    // an empty field is present all the same
+    return found ? (joined.isNull() ? QByteArray("") : joined) : QByteArray();
+}
+
+template<typename Headers>
+static QList<QByteArray> hopByHopHeaders(const Headers& headers) {
+    // RFC 9110 7.6.1: these plus anything listed in Connection are hop-by-hop.
+    // Transfer-Encoding is kept because the body is relayed untouched.
+    QList<QByteArray> hopByHop = {
+        "connection", "proxy-connection", "keep-alive", "proxy-authorization",
+        "proxy-authenticate", "te", "trailer", "upgrade"
+    };
+
+    for (const auto& header : headers) {
+        if (headerNameEquals(header.name, "Connection")) {
+            for (const auto& value : QByteArray::fromStdString(header.value).split(',')) {
+                const auto option = value.trimmed().toLower();
+
+                // the framing and Host are ours to keep, dropping them would let the next hop frame the body differently
+                if ((option != "content-length") && (option != "transfer-encoding") && (option != "host")) {
+                    hopByHop.append(option);
+                }
+            }
+        }
+    }
+
+    return hopByHop;
+}
+
+template<typename Headers>
+static bool appendEndToEndHeaders(QByteArray& head, const Headers& headers) {
+    const auto hopByHop = hopByHopHeaders(headers);
+    const auto encoded  = !joinedValue(headers, "Transfer-Encoding").isNull();
+    auto hasHost        = false;
+
+    for (const auto& header : headers) {
+        const auto name = QByteArray::fromStdString(header.name);
+
+        // RFC 9112 6.3: Transfer-Encoding overrides Content-Length, which must not be forwarded with it
+        if (hopByHop.contains(name.toLower()) || (encoded && headerNameEquals(header.name, "Content-Length"))) {
+            continue;
+        }
+
+        hasHost = hasHost || headerNameEquals(header.name, "Host");
+        head.append(name).append(": ").append(header.value.c_str()).append("\r\n");
+    }
+
+    return hasHost;
+}
+
+template<typename Headers>
+static bool headerHasToken(const Headers& headers, const char* name, const char* token) {
+    for (const auto& header : headers) {
+        if (headerNameEquals(header.name, name)) {
+            for (const auto& value : QByteArray::fromStdString(header.value).split(',')) {
+                if (qstricmp(value.trimmed().constData(), token) == 0) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    return false;
+}
+
+template<typename Headers>
+static bool contentLength(const Headers& headers, qint64& length) {
+    length = -1;
+
+    // every Content-Length must be one plain decimal and all of them the same, anything
+    // else is read differently by different parsers (request smuggling)
+    for (const auto& header : headers) {
+        if (!headerNameEquals(header.name, "Content-Length")) {
+            continue;
+        }
+
+        const auto value = QByteArray::fromStdString(header.value).trimmed();
+
+        if (value.isEmpty() || (value.size() > 18)) {
+            return false;
+        }
+
+        for (const auto c : value) {
+            if ((c < '0') || (c > '9')) {
+                return false;
+            }
+        }
+
+        const auto parsed = value.toLongLong();
+
+        if ((length >= 0) && (parsed != length)) {
+            return false;
+        }
+
+        length = parsed;
+    }
+
+    return true;
+}
+
+template<typename Headers>
+static void transferCoding(const Headers& headers, bool& present, bool& chunked) {
+    // the last coding of all fields together decides, not that of the first field
+    const auto value = joinedValue(headers, "Transfer-Encoding");
+    present          = !value.isNull();
+    chunked          = present && (qstricmp(value.split(',').last().trimmed().constData(), "chunked") == 0);
+}
+
+QByteArray forwardHead(const httpparser::Request& request, const HttpTarget& target, bool keepAlive) {
+    QByteArray head;
+    head.reserve(static_cast<int>(request.uri.size()) + 64 * static_cast<int>(request.headers.size() + 2));
+    head.append(request.method.c_str()).append(' ').append(target.path)
+    .append(" HTTP/").append(QByteArray::number(request.versionMajor))
+    .append('.').append(QByteArray::number(request.versionMinor)).append("\r\n");
+
+    if (!appendEndToEndHeaders(head, request.headers)) {
+        head.append("Host: ").append(target.authority).append("\r\n");
+    }
+
+    head.append(keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+    return head;
+}
+
+QByteArray responseHead(const httpparser::Response& response, bool keepAlive) {
+    QByteArray head;
+    head.reserve(64 * static_cast<int>(response.headers.size() + 2));
+    head.append("HTTP/").append(QByteArray::number(response.versionMajor))
+    .append('.').append(QByteArray::number(response.versionMinor))
+    .append(' ').append(QByteArray::number(response.statusCode))
+    .append(' ').append(response.status.c_str()).append("\r\n");
+    appendEndToEndHeaders(head, response.headers);
+    head.append(keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+    return head;
+}
+
+bool requestBodyMode(const httpparser::Request& request, BodyFramer::Mode& mode, qint64& length) {
+    auto encoded = false;
+    auto chunked = false;
+    transferCoding(request.headers, encoded, chunked);
+
+    if (encoded) {
+        // RFC 9112 6.3: a request whose final coding is not chunked cannot be framed
+        mode   = BodyFramer::Mode::Chunked;
+        length = 0;
+        return chunked;
+    }
+
+    if (!contentLength(request.headers, length)) {
+        return false;
+    }
+
+    mode = (length > 0) ? BodyFramer::Mode::Length : BodyFramer::Mode::None;
+    return true;
+}
+
+bool responseBodyMode(const httpparser::Response& response, const std::string& method, BodyFramer::Mode& mode, qint64& length) {
+    length = 0;
+
+    if (headerNameEquals(method, "HEAD")
+            || ((response.statusCode >= 100) && (response.statusCode < 200))
+            || (response.statusCode == 204)
+            || (response.statusCode == 304)) {
+        mode = BodyFramer::Mode::None;
+        return true;
+    }
+
+    auto encoded = false;
+    auto chunked = false;
+    transferCoding(response.headers, encoded, chunked);
+
+    if (encoded) {
+        mode = chunked ? BodyFramer::Mode::Chunked : BodyFramer::Mode::UntilClose;
+        return true;
+    }
+
+    if (!contentLength(response.headers, length)) {
+        return false;
+    }
+
+    mode = (length < 0) ? BodyFramer::Mode::UntilClose : ((length > 0) ? BodyFramer::Mode::Length : BodyFramer::Mode::None);
+    return true;
+}
+
+template<typename Message>
+static bool persistent(const Message& message, const char* connection) {
+    if (headerHasToken(message.headers, connection, "close")) {
+        return false;
+    }
+
+    if ((message.versionMajor == 1) && (message.versionMinor == 0)) {
+        return headerHasToken(message.headers, connection, "keep-alive");
+    }
+
+    return message.versionMajor >= 1;
+}
+
+bool isPersistent(const httpparser::Response& response) {
+    return persistent(response, "Connection");
+}
+
+bool isPersistent(const httpparser::Request& request) {
+    // RFC 9112 6.3: a request framed by both Transfer-Encoding and Content-Length ends the connection
+    if (!joinedValue(request.headers, "Transfer-Encoding").isNull() && !headerValue(request.headers, "Content-Length").isNull()) {
+        return false;
+    }
+
+    // clients talking to a proxy often send the legacy Proxy-Connection instead
+    return persistent(request, "Connection") && !headerHasToken(request.headers, "Proxy-Connection", "close");
+}
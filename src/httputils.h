@@ -0,0 +1,137 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <httpparser/request.h>
+#include <httpparser/response.h>
+#include "httpframing.h"
+
+///
+/// \brief The HttpTarget struct
+/// Where a proxied request has to go, taken from its request-target or Host header.
+///
+struct HttpTarget {
+    QString host;
+    quint16 port = 0;
+    QByteArray authority;  // host[:port] as sent in the Host header
+    QByteArray path;       // origin-form for plain HTTP, empty for CONNECT
+    bool valid   = false;
+};
+
+///
+/// \brief The RequestLine struct
+/// The request line of a head, scanned in place without allocating: target points
+/// into the scanned buffer and is only valid as long as that is.
+///
+struct RequestLine {
+    enum class Method : quint8 {
+        Other,  // anything but the methods below
+        Connect,
+        Get,
+        Put,
+        Post,
+        Head,
+        Delete
+    };
+
+    Method method       = Method::Other;
+    const char* target  = nullptr;
+    int targetSize      = 0;
+    quint8 versionMajor = 0;
+    quint8 versionMinor = 0;
+
+    ///
+    /// Scans the first line of the \a size bytes at \a data. False unless it is a
+    /// complete "method SP target SP HTTP/d.d CRLF", anything else is left to httpparser.
+    ///
+    bool scan(const char* data, int size);
+
+    ///
+    /// Classifies the method token at \a data with a single compare of its packed bytes.
+    ///
+    static Method methodOf(const char* data, int size);
+
+    static Method methodOf(const std::string& method) {
+        return methodOf(method.data(), static_cast<int>(method.size()));
+    }
+};
+
+///
+/// Resolves the authority-form target of a scanned CONNECT \a line, copying only the host.
+/// Invalid for anything but a plain "host:port" or "[v6]:port", which httpparser then handles.
+///
+HttpTarget connectTarget(const RequestLine& line);
+
+///
+/// Resolves the target of \a request: authority-form for CONNECT,
+/// absolute-form or origin-form (using Host) for the other methods.
+///
+HttpTarget requestTarget(const httpparser::Request& request);
+
+///
+/// Builds the head that is forwarded upstream for a plain HTTP \a request:
+/// origin-form request line, hop-by-hop headers stripped, Host guaranteed and
+/// Connection set according to \a keepAlive.
+///
+QByteArray forwardHead(const httpparser::Request& request, const HttpTarget& target, bool keepAlive);
+
+///
+/// Builds the head relayed back to the client for \a response, with hop-by-hop
+/// headers stripped and Connection set according to \a keepAlive.
+///
+QByteArray responseHead(const httpparser::Response& response, bool keepAlive);
+
+///
+/// How the body of \a request is delimited. Returns false when the framing
+/// headers are invalid and the request must be rejected.
+///
+bool requestBodyMode(const httpparser::Request& request, BodyFramer::Mode& mode, qint64& length);
+
+///
+/// How the body of \a response to a \a method request is delimited.
+///
+bool responseBodyMode(const httpparser::Response& response, const std::string& method, BodyFramer::Mode& mode, qint64& length);
+
+///
+/// Whether \a response leaves the upstream connection reusable.
+///
+bool isPersistent(const httpparser::Response& response);
+
+///
+/// Whether the client of \a request keeps its connection open for further requests.
+///
+bool isPersistent(const httpparser::Request& request);
+
+///
+/// Returns true when \a name equals \a other ignoring ASCII case.
+///
+bool headerNameEquals(const std::string& name, const char* other);
+
+///
+/// Returns the value of the first header called \a name, or a null array.
+///
+template<typename Headers>
+QByteArray headerValue(const Headers& headers, const char* name) {
+    for (const auto& header : headers) {
+        if (headerNameEquals(header.name, name)) {
+            return QByteArray::fromStdString(header.value);
+        }
+    }
+
+    return {};
+}
@@ -0,0 +1,519 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "iouring.h"
+
+#ifdef Q_OS_LINUX
+# include <linux/io_uring.h>
+# include <sys/eventfd.h>
+# include <sys/mman.h>
+# include <sys/socket.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+
+static constexpr quint16 kBufferGroup = 0;
+static constexpr auto kMaxBuffers     = 32768;  // buffer ids are 16 bits, ring sizes powers of two
+
+static int setup(unsigned entries, io_uring_params& params) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+}
+
+static int enter(int fd, unsigned submit, unsigned complete, unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, submit, complete, flags, nullptr, 0));
+}
+
+static int registerRing(int fd, unsigned opcode, const void* argument, unsigned count) {
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, argument, count));
+}
+
+static quint32 loadAcquire(const quint32* value) {
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+static void storeRelease(quint32* value, quint32 next) {
+    __atomic_store_n(value, next, __ATOMIC_RELEASE);
+}
+
+static void* mapAnonymous(size_t size) {
+    const auto memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (memory == MAP_FAILED) ? nullptr : memory;
+}
+
+int IoUring::Completion::buffer() const {
+    return (flags & IORING_CQE_F_BUFFER) ? static_cast<int>(flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+}
+
+bool IoUring::Completion::more() const {
+    return (flags & IORING_CQE_F_MORE) != 0;
+}
+
+IoUring::IoUring() = default;
+
+IoUring::~IoUring() {
+    close();
+}
+
+bool IoUring::isSupported(QString* reason) {
+    struct Probe {
+        bool supported = false;
+        QString reason;
+    };
+
+    // seccomp filters and kernel.io_uring_disabled show up as EPERM, old kernels as ENOSYS or EINVAL
+    static const auto probe = []() {
+        Probe result;
+        IoUring ring;
+        Options options;
+        options.entries = 8;
+        options.buffers = 2;
+        result.supported = ring.open(options, 4096);
+        result.reason    = result.supported ? QString() : qt_error_string(errno);
+        return result;
+    }();
+
+    if (reason) {
+        *reason = probe.reason;
+    }
+
+    return probe.supported;
+}
+
+bool IoUring::open(const Options& options, int bufferSize) {
+    io_uring_params params{};
+    params.flags      = IORING_SETUP_CQSIZE;
+    params.cq_entries = static_cast<quint32>(options.entries) * 4;
+
+    if (options.sqPoll) {
+        params.flags          |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle  = static_cast<quint32>(options.sqPollIdle);
+    }
+
+    _fd = setup(static_cast<unsigned>(options.entries), params);
+
+    if ((_fd < 0) && options.sqPoll) {
+        qWarning() << QStringLiteral("io_uring SQPOLL refused:") << qt_error_string(errno) << QStringLiteral("submitting with syscalls");
+        params            = {};
+        params.flags      = IORING_SETUP_CQSIZE;
+        params.cq_entries = static_cast<quint32>(options.entries) * 4;
+        _fd               = setup(static_cast<unsigned>(options.entries), params);
+    }
+
+    if (_fd < 0) {
+        return false;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        close();
+        errno = ENOSYS;
+        return false;
+    }
+
+    _sqPoll    = (params.flags & IORING_SETUP_SQPOLL) != 0;
+    _ringsSize = qMax<size_t>(params.sq_off.array + params.sq_entries * sizeof(quint32),
+                              params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    _sqesSize  = params.sq_entries * sizeof(io_uring_sqe);
+
+    auto rings = ::mmap(nullptr, _ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    auto sqes  = ::mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    _rings     = (rings == MAP_FAILED) ? nullptr : rings;
+    _sqes      = (sqes == MAP_FAILED) ? nullptr : sqes;
+
+    if (!_rings || !_sqes) {
+        close();
+        return false;
+    }
+
+    const auto base = static_cast<char*>(_rings);
+    _sqHead  = reinterpret_cast<quint32*>(base + params.sq_off.head);
+    _sqTail  = reinterpret_cast<quint32*>(base + params.sq_off.tail);
+    _sqFlags = reinterpret_cast<quint32*>(base + params.sq_off.flags);
+    _sqMask  = *reinterpret_cast<quint32*>(base + params.sq_off.ring_mask);
+    _sqLocal = *_sqTail;
+    _cqHead  = reinterpret_cast<quint32*>(base + params.cq_off.head);
+    _cqTail  = reinterpret_cast<quint32*>(base + params.cq_off.tail);
+    _cqMask  = *reinterpret_cast<quint32*>(base + params.cq_off.ring_mask);
+    _cqes    = base + params.cq_off.cqes;
+
+    // slot i of the submission queue always holds SQE i
+    const auto array = reinterpret_cast<quint32*>(base + params.sq_off.array);
+
+    for (quint32 i = 0; i < params.sq_entries; ++i) {
+        array[i] = i;
+    }
+
+    _event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if ((_event < 0) || (registerRing(_fd, IORING_REGISTER_EVENTFD, &_event, 1) < 0)) {
+        close();
+        return false;
+    }
+
+    auto buffers = 1;
+
+    while ((buffers < options.buffers) && (buffers < kMaxBuffers)) {
+        buffers *= 2;
+    }
+
+    _bufferSize       = bufferSize;
+    _bufferMask       = static_cast<quint16>(buffers - 1);
+    _bufferRingSize   = static_cast<size_t>(buffers) * sizeof(io_uring_buf);
+    _bufferMemorySize = static_cast<size_t>(buffers) * static_cast<size_t>(bufferSize);
+    _bufferRing       = mapAnonymous(_bufferRingSize);
+    _bufferMemory     = static_cast<char*>(mapAnonymous(_bufferMemorySize));
+
+    if (!_bufferRing || !_bufferMemory) {
+        close();
+        return false;
+    }
+
+    io_uring_buf_reg registration{};
+    registration.ring_addr    = reinterpret_cast<quint64>(_bufferRing);
+    registration.ring_entries = static_cast<quint32>(buffers);
+    registration.bgid         = kBufferGroup;
+
+    if (registerRing(_fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        close();
+        return false;
+    }
+
+    for (auto id = 0; id < buffers; ++id) {
+        recycle(id);
+    }
+
+    return true;
+}
+
+void IoUring::close() {
+    if ((_fd >= 0) && _rings && _sqes && (_inflight > 0)) {
+        // receives in flight still write into the buffers, they have to be gone before the unmap
+        if (reserve(1)) {
+            const auto sqe    = static_cast<io_uring_sqe*>(prepare());
+            sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+            sqe->fd           = -1;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        }
+
+        submit();
+        Completion completion;
+
+        while (_inflight > 0) {
+            while (next(completion)) {}
+
+            if ((_inflight > 0) && (enter(_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) && (errno != EINTR)) {
+                break;
+            }
+        }
+    }
+
+    if (_rings) {
+        ::munmap(_rings, _ringsSize);
+    }
+
+    if (_sqes) {
+        ::munmap(_sqes, _sqesSize);
+    }
+
+    if (_fd >= 0) {
+        ::close(_fd);
+    }
+
+    if (_event >= 0) {
+        ::close(_event);
+    }
+
+    if (_bufferRing) {
+        ::munmap(_bufferRing, _bufferRingSize);
+    }
+
+    if (_bufferMemory) {
+        ::munmap(_bufferMemory, _bufferMemorySize);
+    }
+
+    _fd           = -1;
+    _event        = -1;
+    _rings        = nullptr;
+    _sqes         = nullptr;
+    _bufferRing   = nullptr;
+    _bufferMemory = nullptr;
+    _inflight     = 0;
+}
+
+bool IoUring::isOpen() const {
+    return _fd >= 0;
+}
+
+int IoUring::eventFd() const {
+    return _event;
+}
+
+int IoUring::bufferSize() const {
+    return _bufferSize;
+}
+
+char* IoUring::buffer(int id) const {
+    return _bufferMemory + static_cast<qint64>(id) * _bufferSize;
+}
+
+void IoUring::recycle(int id) {
+    // not io_uring_buf_ring::bufs, its empty struct takes a byte in C++ and shifts the array;
+    // the ring is a plain array whose first entry's resv field is the tail
+    const auto ring = static_cast<io_uring_buf*>(_bufferRing);
+    auto& entry     = ring[_bufferTail & _bufferMask];
+    entry.addr      = reinterpret_cast<quint64>(buffer(id));
+    entry.len       = static_cast<quint32>(_bufferSize);
+    entry.bid       = static_cast<quint16>(id);
+    ++_bufferTail;
+    __atomic_store_n(&ring[0].resv, _bufferTail, __ATOMIC_RELEASE);
+}
+
+bool IoUring::reserve(int count) {
+    const auto free = [this]() {
+        return static_cast<qint64>(_sqMask) + 1 - static_cast<qint64>(_sqLocal - loadAcquire(_sqHead));
+    };
+
+    if (free() < count) {
+        submit();
+
+        if (_sqPoll && (free() < count)) {
+            enter(_fd, 0, 0, IORING_ENTER_SQ_WAIT);
+        }
+    }
+
+    return free() >= count;
+}
+
+void* IoUring::prepare() {
+    const auto sqe = static_cast<io_uring_sqe*>(_sqes) + (_sqLocal & _sqMask);
+    *sqe = io_uring_sqe{};
+    ++_sqLocal;
+    ++_inflight;
+    return sqe;
+}
+
+bool IoUring::accept(int listener, quint64 data) {
+    if (!reserve(1)) {
+        return false;
+    }
+
+    const auto sqe = static_cast<io_uring_sqe*>(prepare());
+
+    // one request keeps accepting until it fails or is cancelled
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = listener;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data    = data;
+    return true;
+}
+
+bool IoUring::receive(int fd, quint64 data) {
+    if (!reserve(1)) {
+        return false;
+    }
+
+    // the kernel picks a buffer once data is there, idle connections hold none
+    const auto sqe = static_cast<io_uring_sqe*>(prepare());
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = fd;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufferGroup;
+    sqe->user_data = data;
+    return true;
+}
+
+bool IoUring::cancel(quint64 data) {
+    if (!reserve(1)) {
+        return false;
+    }
+
+    const auto sqe = static_cast<io_uring_sqe*>(prepare());
+
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = data;
+    sqe->user_data = 0;
+    return true;
+}
+
+bool IoUring::forward(int to, const char* data, int size, quint64 sendData, int from, quint64 receiveData) {
+    // both in one submission, a link left open at its end would not reach the receive
+    if (!reserve(2)) {
+        return false;
+    }
+
+    // MSG_WAITALL makes a short send a failure, which cancels the linked receive
+    const auto send = static_cast<io_uring_sqe*>(prepare());
+    send->opcode    = IORING_OP_SEND;
+    send->fd        = to;
+    send->addr      = reinterpret_cast<quint64>(data);
+    send->len       = static_cast<quint32>(size);
+    send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    send->flags     = IOSQE_IO_LINK;
+    send->user_data = sendData;
+
+    const auto receive = static_cast<io_uring_sqe*>(prepare());
+    receive->opcode    = IORING_OP_RECV;
+    receive->fd        = from;
+    receive->flags     = IOSQE_BUFFER_SELECT;
+    receive->buf_group = kBufferGroup;
+    receive->user_data = receiveData;
+    return true;
+}
+
+bool IoUring::submit() {
+    const auto queued = _sqLocal - *_sqTail;
+    storeRelease(_sqTail, _sqLocal);
+
+    if (_sqPoll) {
+        // the flag is only current after the tail store is visible to the poll thread
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        return ((loadAcquire(_sqFlags) & IORING_SQ_NEED_WAKEUP) != 0) && (enter(_fd, 0, 0, IORING_ENTER_SQ_WAKEUP) >= 0);
+    }
+
+    if (queued == 0) {
+        return false;
+    }
+
+    while ((enter(_fd, queued, 0, 0) < 0) && (errno == EINTR)) {}
+
+    return true;
+}
+
+bool IoUring::next(Completion& completion) {
+    const auto head = *_cqHead;
+
+    if (head == loadAcquire(_cqTail)) {
+        return false;
+    }
+
+    const auto cqe    = static_cast<const io_uring_cqe*>(_cqes) + (head & _cqMask);
+    completion.data   = cqe->user_data;
+    completion.result = cqe->res;
+    completion.flags  = cqe->flags;
+    storeRelease(_cqHead, head + 1);
+
+    if (!completion.more()) {
+        --_inflight;
+    }
+
+    return true;
+}
+
+int IoUring::inflight() const {
+    return _inflight;
+}
+
+#else // ifdef Q_OS_LINUX
+
+int IoUring::Completion::buffer() const {
+    return -1;
+}
+
+bool IoUring::Completion::more() const {
+    return false;
+}
+
+IoUring::IoUring() = default;
+
+IoUring::~IoUring() = default;
+
+bool IoUring::isSupported(QString* reason) {
+    if (reason) {
+        *reason = QStringLiteral("io_uring is Linux only");
+    }
+
+    return false;
+}
+
+bool IoUring::open(const Options& options, int bufferSize) {
+    Q_UNUSED(options)
+    Q_UNUSED(bufferSize)
+    return false;
+}
+
+void IoUring::close() {}
+
+bool IoUring::isOpen() const {
+    return false;
+}
+
+int IoUring::eventFd() const {
+    return -1;
+}
+
+int IoUring::bufferSize() const {
+    return 0;
+}
+
+char* IoUring::buffer(int id) const {
+    Q_UNUSED(id)
+    return nullptr;
+}
+
+void IoUring::recycle(int id) {
+    Q_UNUSED(id)
+}
+
+bool IoUring::reserve(int count) {
+    Q_UNUSED(count)
+    return false;
+}
+
+void* IoUring::prepare() {
+    return nullptr;
+}
+
+bool IoUring::accept(int listener, quint64 data) {
+    Q_UNUSED(listener)
+    Q_UNUSED(data)
+    return false;
+}
+
+bool IoUring::receive(int fd, quint64 data) {
+    Q_UNUSED(fd)
+    Q_UNUSED(data)
+    return false;
+}
+
+bool IoUring::cancel(quint64 data) {
+    Q_UNUSED(data)
+    return false;
+}
+
+bool IoUring::forward(int to, const char* data, int size, quint64 sendData, int from, quint64 receiveData) {
+    Q_UNUSED(to)
+    Q_UNUSED(data)
+    Q_UNUSED(size)
+    Q_UNUSED(sendData)
+    Q_UNUSED(from)
+    Q_UNUSED(receiveData)
+    return false;
+}
+
+bool IoUring::submit() {
+    return false;
+}
+
+bool IoUring::next(Completion& completion) {
+    Q_UNUSED(completion)
+    return false;
+}
+
+int IoUring::inflight() const {
+    return 0;
+}
+
+#endif // Q_OS_LINUX
@@ -0,0 +1,125 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+
+///
+/// \brief The IoUring class
+/// A single-issuer io_uring instance driven through the raw syscalls, no liburing:
+/// submission and completion rings, an eventfd signalled on completions and one
+/// provided buffer ring that receives pick their buffers from. Requires Linux 5.19
+/// for multishot accept and buffer rings; open() fails cleanly on older kernels and
+/// where seccomp or kernel.io_uring_disabled refuse the setup. Only functional on
+/// Linux, isSupported() reports false elsewhere.
+///
+class IoUring final {
+  public:
+    struct Options {
+        int entries    = 1024;   // submission queue size, completions get four times as many
+        int buffers    = 256;    // provided receive buffers, rounded up to a power of two
+        bool sqPoll    = false;  // a kernel thread polls the submission queue, no submit syscalls
+        int sqPollIdle = 1000;   // ms the poll thread spins before it sleeps
+    };
+
+    struct Completion {
+        quint64 data  = 0;
+        qint32 result = 0;
+        quint32 flags = 0;
+
+        int  buffer() const;  // the provided buffer a receive filled, -1 for none
+        bool more() const;    // a multishot request stays armed
+    };
+
+    IoUring();
+    ~IoUring();
+
+    ///
+    /// Probes once per process whether a ring with a buffer ring can be set up, \a reason tells why not.
+    ///
+    static bool isSupported(QString* reason = nullptr);
+
+    bool open(const Options& options, int bufferSize);
+    void close();
+    bool isOpen() const;
+
+    int eventFd() const;
+    int bufferSize() const;
+    char* buffer(int id) const;
+
+    ///
+    /// Hands buffer \a id back to the kernel for further receives.
+    ///
+    void recycle(int id);
+
+    // each queues its requests and fails only when the submission queue stays full
+    bool accept(int listener, quint64 data);
+    bool receive(int fd, quint64 data);
+    bool cancel(quint64 data);
+
+    ///
+    /// Queues a send of \a size bytes to \a to and, linked behind it, the next receive on
+    /// \a from: the kernel starts the receive once the send went out completely and
+    /// cancels it when the send fails or falls short.
+    ///
+    bool forward(int to, const char* data, int size, quint64 sendData, int from, quint64 receiveData);
+
+    ///
+    /// Passes the queued requests to the kernel, true when that took a syscall; under
+    /// SQPOLL one is only needed to wake a poll thread that went to sleep.
+    ///
+    bool submit();
+
+    ///
+    /// Takes the next completion off the ring, false when it is empty.
+    ///
+    bool next(Completion& completion);
+
+    int inflight() const;
+
+  private:
+    bool reserve(int count);
+    void* prepare();
+
+    int _fd      = -1;
+    int _event   = -1;
+    bool _sqPoll = false;
+    int _inflight = 0;  // requests whose last completion is still due
+
+    // SQ and CQ rings share one mapping, the kernel reads and writes the heads and tails
+    void* _rings      = nullptr;
+    size_t _ringsSize = 0;
+    void* _sqes       = nullptr;
+    size_t _sqesSize  = 0;
+    quint32* _sqHead  = nullptr;
+    quint32* _sqTail  = nullptr;
+    quint32* _sqFlags = nullptr;
+    quint32 _sqMask   = 0;
+    quint32 _sqLocal  = 0;  // tail including requests not published yet
+    quint32* _cqHead  = nullptr;
+    quint32* _cqTail  = nullptr;
+    quint32 _cqMask   = 0;
+    void* _cqes       = nullptr;
+
+    void* _bufferRing        = nullptr;
+    size_t _bufferRingSize   = 0;
+    char* _bufferMemory      = nullptr;
+    size_t _bufferMemorySize = 0;
+    quint16 _bufferMask      = 0;
+    quint16 _bufferTail      = 0;
+    int _bufferSize          = 0;
+};
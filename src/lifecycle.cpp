@@ -0,0 +1,141 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "lifecycle.h"
+#include "socketutils.h"
+
+static constexpr auto kDrainPollInterval = 100;  // ms
+
+Lifecycle* Lifecycle::_instance = nullptr;
+
+Lifecycle::Lifecycle(const Options& options, QObject* parent) : QObject(parent), _options{options} {
+    _instance = this;
+}
+
+Lifecycle::~Lifecycle() {
+    if (_instance == this) {
+        _instance = nullptr;
+    }
+}
+
+Lifecycle* Lifecycle::instance() {
+    return _instance;
+}
+
+QVector<qintptr> Lifecycle::inherit() const {
+    if (_options.handoffPath.isEmpty()) {
+        return {};
+    }
+
+#ifndef Q_OS_LINUX
+    qWarning() << QStringLiteral("Listener handoff is not supported on this platform");
+    return {};
+#else // ifndef Q_OS_LINUX
+    const auto fds = receiveDescriptors(_options.handoffPath, _options.handoffTimeout);
+
+    if (!fds.isEmpty()) {
+        qInfo() << QStringLiteral("Took over %1 listener(s) from the running instance").arg(fds.size());
+    }
+
+    return fds;
+#endif // Q_OS_LINUX
+}
+
+void Lifecycle::attach(const Hooks& hooks) {
+    _hooks = hooks;
+
+#ifdef Q_OS_LINUX
+
+    if (_options.handoffPath.isEmpty()) {
+        return;
+    }
+
+    // a predecessor that handed off to us still holds the path, take it over
+    QLocalServer::removeServer(_options.handoffPath);
+    _successors = new QLocalServer(this);
+    _successors->setSocketOptions(QLocalServer::UserAccessOption);
+    QObject::connect(_successors, &QLocalServer::newConnection, this, &Lifecycle::handOff);
+
+    if (!_successors->listen(_options.handoffPath)) {
+        qWarning() << QStringLiteral("Handoff path:") << _successors->errorString();
+    }
+
+#endif // Q_OS_LINUX
+}
+
+bool Lifecycle::draining() const {
+    return _draining;
+}
+
+void Lifecycle::drain() {
+    if (_draining) {
+        return;
+    }
+
+    _draining = true;
+
+    if (_successors) {
+        _successors->close();
+    }
+
+    if (_hooks.stopAccepting) {
+        _hooks.stopAccepting();
+    }
+
+    qInfo() << QStringLiteral("Draining, waiting up to %1 ms for live connections").arg(_options.drainTimeout);
+    _drainStarted.start();
+    _poll = new QTimer(this);
+    QObject::connect(_poll, &QTimer::timeout, this, &Lifecycle::poll);
+    _poll->start(kDrainPollInterval);
+    poll();
+}
+
+void Lifecycle::stop() {
+    _draining = true;
+    QCoreApplication::quit();
+}
+
+void Lifecycle::handOff() {
+    while (auto successor = _successors->nextPendingConnection()) {
+        const auto fds = _hooks.listeners ? _hooks.listeners() : QVector<qintptr>{};
+
+        if (!_draining && !fds.isEmpty() && sendDescriptors(successor->socketDescriptor(), fds)) {
+            qInfo() << QStringLiteral("Handed %1 listener(s) to the next instance").arg(fds.size());
+            successor->disconnectFromServer();
+            successor->deleteLater();
+            drain();
+            return;
+        }
+
+        successor->abort();
+        successor->deleteLater();
+    }
+}
+
+void Lifecycle::poll() {
+    const auto active = _hooks.activeConnections ? _hooks.activeConnections() : 0;
+
+    if (active == 0) {
+        QCoreApplication::quit();
+    } else if (_drainStarted.hasExpired(_options.drainTimeout)) {
+        qWarning() << QStringLiteral("Drain deadline passed, dropping %1 connection(s)").arg(active);
+        QCoreApplication::quit();
+    } else {
+        return;
+    }
+
+    _poll->stop();
+}
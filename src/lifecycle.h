@@ -0,0 +1,85 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <QtNetwork>
+#include <atomic>
+#include <functional>
+
+///
+/// \brief The Lifecycle class
+/// Drain and hot restart. drain() stops accepting, waits for the live connections
+/// to finish up to a deadline and quits the event loop; stop() quits right away.
+/// With a handoff path set, a starting instance first asks the running one for its
+/// listening sockets over that Unix domain socket, so accept never pauses during a
+/// rolling upgrade: the old instance passes the descriptors (SCM_RIGHTS) and drains.
+///
+class Lifecycle final : public QObject {
+    Q_OBJECT
+
+  public:
+    struct Options {
+        QString handoffPath;         // empty: no handoff
+        int drainTimeout   = 30000;  // ms to wait for live connections on drain
+        int handoffTimeout = 5000;   // ms to wait for the running instance's descriptors
+    };
+
+    ///
+    /// What the engine in use exposes to the lifecycle, set once listening.
+    ///
+    struct Hooks {
+        std::function<void()> stopAccepting;
+        std::function<int()> activeConnections;
+        std::function<QVector<qintptr>()> listeners;
+    };
+
+    explicit Lifecycle(const Options& options, QObject* parent = nullptr);
+    ~Lifecycle() override;
+
+    static Lifecycle* instance();
+
+    ///
+    /// Takes over the listening sockets of a running instance, empty when there is
+    /// none or the handoff is disabled. Called before listening.
+    ///
+    QVector<qintptr> inherit() const;
+
+    ///
+    /// Installs \a hooks and serves the handoff path for the next instance.
+    ///
+    void attach(const Hooks& hooks);
+
+    bool draining() const;
+
+  public Q_SLOTS:
+    void drain();
+    void stop();
+
+  private:
+    void handOff();
+    void poll();
+
+    const Options _options;
+    Hooks _hooks;
+    QLocalServer* _successors = nullptr;
+    QTimer* _poll             = nullptr;
+    QElapsedTimer _drainStarted;
+    std::atomic<bool> _draining{false};  // read by the workers between requests
+
+    static Lifecycle* _instance;
+};
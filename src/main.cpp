@@ -14,20 +14,13 @@
  * GNU General Public License for more details.
 */
 
-#include <QtCore>
-#include <QtNetwork>
-#include <httpparser/request.h>
-#include <httpparser/httprequestparser.h>
-
-// key registry
-static constexpr auto kAddress = "Address";
-static constexpr auto kPort    = "Port";
-static constexpr auto kConnect = "CONNECT";
-static constexpr auto kGet     = "GET";
-static constexpr auto kPut     = "PUT";
-static constexpr auto kPost    = "POST";
-static constexpr auto kHead    = "HEAD";
-static constexpr auto kDelete  = "DELETE";
+#include "epollengine.h"
+#include "muxserver.h"
+#include "proxyserver.h"
+#include "socketutils.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #ifdef QT_NO_DEBUG
 void qMessageHandler(QtMsgType, const QMessageLogContext&, const QString&) {
@@ -36,76 +29,267 @@ void qMessageHandler(QtMsgType, const QMessageLogContext&, const QString&) {
 
 #endif // QT_NO_DEBUG
 
-///
-/// \brief The Settings class
-///
-class Settings final : protected QSettings {
-  public:
-    explicit Settings(const QString& file);
-    QVariant read(const QString& key, const QVariant& defaultValue);
-};
+static MetricsServer* startMetrics(const ProxyConfig& config, const QVector<ProxyWorker*>& workers) {
+    if (config.metricsPort == 0) {
+        return nullptr;
+    }
 
-///
-/// \brief The ProxyConnection class
-///
-class ProxyConnection final : public QObject {
-    Q_OBJECT
+    auto server = new MetricsServer(workers);
+
+    if (!server->listen(config.metricsAddress, config.metricsPort)) {
+        qWarning() << QStringLiteral("Metrics endpoint:") << server->errorString();
+    } else {
+        qInfo() << QStringLiteral("Serving metrics on") << QStringLiteral("%1:%2").arg(config.metricsAddress.toString()).arg(config.metricsPort);
+    }
 
-  public:
-    ProxyConnection(const QSharedPointer<QTcpSocket>& downStream, int id);
-    ~ProxyConnection() override;
+    return server;
+}
 
-  private Q_SLOTS:
-    void terminate();
-    void downStreamReadyRead();
-    void upStreamReadyRead();
+static MuxServer* startMux(const ProxyConfig& config, const QVector<ProxyWorker*>& workers) {
+    const auto& options = config.muxOptions;
 
-  private:
-    int _id = 0;
-    QSharedPointer<QTcpSocket> _downStream;
-    QSharedPointer<QTcpSocket> _upStream;
+    if (options.listenPort == 0) {
+        return nullptr;
+    }
 
-  Q_SIGNALS:
-    void terminated(int id, QPrivateSignal);
-};
+    auto server = new MuxServer(workers);
+
+    if (!server->listen(options.listenAddress, options.listenPort)) {
+        qWarning() << QStringLiteral("Mux endpoint:") << server->errorString();
+    } else {
+        qInfo() << QStringLiteral("Accepting mux links on") << QStringLiteral("%1:%2").arg(options.listenAddress.toString()).arg(options.listenPort);
+    }
+
+    if (options.secret.isEmpty()) {
+        qWarning() << QStringLiteral("Mux/Secret is empty, any client may open links");
+    }
+
+    return server;
+}
 
 ///
-/// \brief The ProxyServer class
+/// Applies what a reload changes outside the connection snapshots: the listen
+/// address through \a rebind and the DNS cache limits.
 ///
-class ProxyServer final : public QTcpServer {
-    Q_OBJECT
+static void followReloads(ConfigStore& store, const std::function<bool(const QHostAddress&, quint16)>& rebind) {
+    auto previous = store.snapshot();
+
+    QObject::connect(&store, &ConfigStore::reloaded, &store, [&store, previous, rebind]() mutable {
+        const auto current = store.snapshot();
+
+        if ((current->engine != previous->engine) || (current->workers != previous->workers)
+            || (current->reusePort != previous->reusePort) || (current->dnsCache != previous->dnsCache)
+            || (current->responseCache != previous->responseCache) || (current->responseCacheLimits.diskPath != previous->responseCacheLimits.diskPath)
+            || (current->responseCacheLimits.memorySize != previous->responseCacheLimits.memorySize)
+            || (current->metricsAddress != previous->metricsAddress) || (current->metricsPort != previous->metricsPort)
+            || (current->accessLogOptions.path != previous->accessLogOptions.path)
+            || (current->tracingOptions.enabled != previous->tracingOptions.enabled) || (current->tracingOptions.path != previous->tracingOptions.path)
+            || (current->lifecycleOptions.handoffPath != previous->lifecycleOptions.handoffPath)
+            || (current->muxOptions.parentHost != previous->muxOptions.parentHost) || (current->muxOptions.parentPort != previous->muxOptions.parentPort)
+            || (current->muxOptions.listenAddress != previous->muxOptions.listenAddress) || (current->muxOptions.listenPort != previous->muxOptions.listenPort)
+            || (current->muxOptions.secret != previous->muxOptions.secret)) {
+            qWarning() << QStringLiteral("Engine, workers, listeners, metrics, access log, tracing, handoff, parent proxy and cache changes take effect after a restart");
+        }
 
-  public:
-    explicit ProxyServer(QObject* parent = nullptr);
+        if (auto cache = DnsCache::instance()) {
+            cache->setLimits(current->dnsCacheLimits);
+        }
 
-  protected:
-    void        incomingConnection(qintptr handle) override;
-    Q_SLOT void onConnectionTerminate(int id);
+        if (((current->address != previous->address) || (current->port != previous->port))
+            && rebind(current->address, current->port)) {
+            qInfo() << QStringLiteral("Now listening on") << QStringLiteral("%1:%2").arg(current->address.toString()).arg(current->port);
+        }
 
-  private:
-    QMap<int, QSharedPointer<ProxyConnection>> _connections;
-};
+        previous = current;
+    });
+}
 
-void startServer(int argc, char* argv[]) {
+///
+/// Watches the settings file of a started server. A \a deferred start has not written
+/// the missing defaults yet, it does so once the event loop runs and watches after.
+///
+static void watchSettings(ConfigStore& store, bool deferred) {
+    if (!deferred) {
+        store.watch();
+        return;
+    }
+
+    QTimer::singleShot(0, &store, [&store]() {
+        store.seed();
+        store.watch();
+    });
+}
+
+///
+/// Runs the proxy until it is stopped. With \a ready set, it is called once the listeners
+/// are up (true) or failed (false), and the settings defaults are only written after that.
+///
+void startServer(int argc, char* argv[], const std::function<void(bool)>& ready = {}) {
     new QCoreApplication(argc, argv);
+    const auto deferred = static_cast<bool>(ready);
 
 #ifdef QT_NO_DEBUG
     qInstallMessageHandler(qMessageHandler);
 #endif // QT_NO_DEBUG
     QCoreApplication::setApplicationName(QStringLiteral("DllProxyServer"));
     QCoreApplication::setApplicationVersion(QStringLiteral("1.0.0"));
-    Settings settings(QStringLiteral("proxy-settings.ini"));
-    ProxyServer server;
+    ConfigStore store(QStringLiteral("proxy-settings.ini"), !deferred);
+    const auto config    = *store.snapshot();
+    const auto& host     = config.address;
+    const auto port      = config.port;
+    const auto reusePort = config.reusePort;
+    QScopedPointer<DnsCache> dnsCache(config.dnsCache ? new DnsCache(config.dnsCacheLimits) : nullptr);
+    QScopedPointer<ResponseCache> responseCache(config.responseCache ? new ResponseCache(config.responseCacheLimits) : nullptr);
+    QScopedPointer<AccessLog> accessLog(config.accessLogOptions.path.isEmpty() ? nullptr : new AccessLog(config.accessLogOptions));
+    QScopedPointer<Tracer> tracer(config.tracingOptions.enabled ? new Tracer(config.tracingOptions) : nullptr);
+    Lifecycle lifecycle(config.lifecycleOptions);
+    const auto inherited = lifecycle.inherit();
+
+    // uring is the native engine relaying through io_uring, it falls back to epoll where that is refused
+    if ((config.engine == QLatin1String("native")) || (config.engine == QLatin1String("uring"))) {
+        if (EpollEngine::isSupported()) {
+            EpollEngine engine(config);
+            QScopedPointer<MetricsServer> metrics(startMetrics(config, {}));
+
+            if ((config.muxOptions.parentPort != 0) || (config.muxOptions.listenPort != 0)) {
+                qWarning() << QStringLiteral("The native engine connects directly, parent proxy and mux settings need the Qt engine");
+            }
 
-    const QHostAddress host(settings.read(kAddress, QHostAddress(QHostAddress::Any).toString()).toString());
-    const auto port = settings.read(kPort, 8888).toInt();
+            const auto started = engine.start(inherited);
+
+            if (!started) {
+                qWarning() << QStringLiteral("Failed to start the native engine on") << port;
+                QTimer::singleShot(0, Qt::PreciseTimer, QCoreApplication::instance(), &QCoreApplication::quit);
+            } else {
+                qInfo() << QStringLiteral("Start listening on") << QStringLiteral("%1:%2").arg(host.toString()).arg(port)
+                        << QStringLiteral("with %1 native loop(s)").arg(engine.loops());
+                lifecycle.attach({[&engine]() {
+                    engine.stopAccepting();
+                }, [&engine]() {
+                    return engine.activeConnections();
+                }, [&engine]() {
+                    return engine.listeners();
+                }});
+                followReloads(store, [&engine](const QHostAddress& address, quint16 port) {
+                    return engine.rebind(address, port);
+                });
+                watchSettings(store, deferred);
+            }
+
+            if (ready) {
+                ready(started);
+            }
+
+            // the loops run on their own threads, this one keeps serving the resolver
+            QCoreApplication::exec();
+            return;
+        }
+
+        qWarning() << QStringLiteral("The native engine is not supported on this platform, using the Qt engine");
+    }
+
+    WorkerPool pool(config);
+    QScopedPointer<MetricsServer> metrics(startMetrics(config, pool.workers()));
+    QScopedPointer<MuxServer> mux(startMux(config, pool.workers()));
+    QVector<ProxyServer*> servers;
+    QScopedPointer<ProxyServer> mainServer;
+
+    if (reusePort) {
+        // one listener per worker thread, the kernel balances accepts between them
+        for (auto worker : pool.workers()) {
+            auto server = new ProxyServer({worker});
+            server->moveToThread(worker->thread());
+            QObject::connect(worker->thread(), &QThread::finished, server, &QObject::deleteLater);
+            servers.append(server);
+        }
+    } else {
+        mainServer.reset(new ProxyServer(pool.workers()));
+        servers.append(mainServer.get());
+    }
+
+    auto listening = true;
+
+    for (auto i = 0; i < servers.size(); ++i) {
+        const auto server = servers.at(i);
+        const auto fd     = (i < inherited.size()) ? inherited.at(i) : -1;
+        const auto type   = (server->thread() == QThread::currentThread()) ? Qt::DirectConnection : Qt::BlockingQueuedConnection;
+        QMetaObject::invokeMethod(server, [&]() {
+            if (fd >= 0) {
+                if (!server->setSocketDescriptor(fd)) {
+                    qWarning() << server->errorString();
+                    closeSocket(fd);
+                    listening = false;
+                }
+            } else if (!(reusePort ? server->listenReusePort(host, port) : server->listen(host, port))) {
+                qWarning() << server->errorString();
+                listening = false;
+            }
 
-    if (!server.listen(host, port)) {
-        qWarning() << server.errorString();
+            if (server->isListening()) {
+                tuneListener(server->socketDescriptor(), config.socketTuning);
+            }
+        }, type);
+    }
+
+    // a predecessor with more listeners, nothing here would accept on the rest
+    for (auto i = servers.size(); i < inherited.size(); ++i) {
+        closeSocket(inherited.at(i));
+    }
+
+    if (!listening) {
         QTimer::singleShot(0, Qt::PreciseTimer, QCoreApplication::instance(), &QCoreApplication::quit);
     } else {
-        qInfo() << QStringLiteral("Start listening on") << QStringLiteral("%1:%2").arg(host.toString()).arg(port);
+        qInfo() << QStringLiteral("Start listening on") << QStringLiteral("%1:%2").arg(host.toString()).arg(port)
+                << QStringLiteral("with %1 listener(s)").arg(servers.size());
+        lifecycle.attach({[&servers]() {
+            for (auto server : qAsConst(servers)) {
+                QMetaObject::invokeMethod(server, [server]() {
+                    server->close();
+                });
+            }
+        }, [&pool]() {
+            auto active = 0;
+
+            for (auto worker : pool.workers()) {
+                active += worker->activeConnections();
+            }
+
+            return active;
+        }, [&servers]() {
+            QVector<qintptr> fds;
+
+            for (auto server : qAsConst(servers)) {
+                if (server->isListening()) {
+                    fds.append(server->socketDescriptor());
+                }
+            }
+
+            return fds;
+        }});
+        followReloads(store, [&servers, &store, reusePort](const QHostAddress& address, quint16 port) {
+            const auto tuning = store.snapshot()->socketTuning;
+            auto moved        = true;
+
+            for (auto server : qAsConst(servers)) {
+                const auto type = (server->thread() == QThread::currentThread()) ? Qt::DirectConnection : Qt::BlockingQueuedConnection;
+                QMetaObject::invokeMethod(server, [&]() {
+                    moved = server->rebind(address, port, reusePort) && moved;
+
+                    if (server->isListening()) {
+                        tuneListener(server->socketDescriptor(), tuning);
+                    }
+                }, type);
+            }
+
+            return moved;
+        });
+        watchSettings(store, deferred);
+    }
+
+    if (ready) {
+        ready(listening);
     }
+
     QCoreApplication::exec();
 }
 
@@ -116,8 +300,27 @@ int main(int argc, char* argv[]) {
 }
 
 #else // ifndef BUILD_AS_SHARED_LIB
+static constexpr auto kStatusStopped  = 0;  // not started, or returned from its event loop
+static constexpr auto kStatusStarting = 1;
+static constexpr auto kStatusRunning  = 2;  // listening
+static constexpr auto kStatusFailed   = 3;  // could not listen
+static constexpr auto kBackgroundEnv  = "PROXY_BACKGROUND";
+static constexpr auto kStopWait       = 1000;  // ms the exiting host waits for the background loop
+
+using ReadyCallback = void (*)(int status, void* context);
+
+static std::atomic<int> serverStatus{kStatusStopped};
+
+extern "C" Q_DECL_EXPORT bool startBackground(ReadyCallback callback, void* context);
+
 # ifdef Q_OS_LINUX
 void __attribute__((constructor)) ctor() {
+    // the host goes on loading while the proxy boots on its own thread
+    if (qEnvironmentVariableIsSet(kBackgroundEnv)) {
+        startBackground(nullptr, nullptr);
+        return;
+    }
+
     int argc    = 0;
     char** argv = nullptr;
 
@@ -135,142 +338,200 @@ extern "C" Q_DECL_EXPORT void start() {
     startServer(argc, argv);
 }
 
-#endif // BUILD_AS_SHARED_LIB
+///
+/// Rereads proxy-settings.ini, as saving the file does. New connections pick up the
+/// result, live ones keep the settings they were accepted with.
+///
+extern "C" Q_DECL_EXPORT void reload() {
+    if (auto store = ConfigStore::instance()) {
+        QMetaObject::invokeMethod(store, [store]() {
+            store->reload();
+        }, Qt::QueuedConnection);
+    }
+}
 
-#include "main.moc"
+///
+/// Stops accepting, lets the live connections finish (up to Drain/Timeout) and
+/// then returns from start().
+///
+extern "C" Q_DECL_EXPORT void drain() {
+    if (auto lifecycle = Lifecycle::instance()) {
+        QMetaObject::invokeMethod(lifecycle, &Lifecycle::drain, Qt::QueuedConnection);
+    }
+}
 
-ProxyServer::ProxyServer(QObject* parent) : QTcpServer(parent) {
-    QObject::connect(this, &ProxyServer::acceptError, [&](QAbstractSocket::SocketError err) {
-        qWarning() << errorString();
-    });
+///
+/// Returns from start() right away, live connections are dropped.
+///
+extern "C" Q_DECL_EXPORT void stop() {
+    if (auto lifecycle = Lifecycle::instance()) {
+        QMetaObject::invokeMethod(lifecycle, &Lifecycle::stop, Qt::QueuedConnection);
+    }
 }
 
-void ProxyServer::incomingConnection(qintptr handle) {
-    const auto id = static_cast<int>(handle);
+///
+/// \brief The Background struct
+/// The proxy started by startBackground(), shared with the host threads.
+///
+struct Background {
+    std::mutex lock;
+    std::condition_variable finished;
+    bool running           = false;  // from the start of the thread until startServer() returns
+    ReadyCallback callback = nullptr;
+    void* context          = nullptr;
+
+    static Background& instance() {
+        static Background background;
+        return background;
+    }
+};
 
-    if (auto socket = QSharedPointer<QTcpSocket>(new QTcpSocket, &QObject::deleteLater)) {
-        if (socket->setSocketDescriptor(handle)) {
-            auto connection = QSharedPointer<ProxyConnection>(new ProxyConnection(socket, id), &QObject::deleteLater);
-            _connections.insert(id, connection);
-            QObject::connect(connection.get(), &ProxyConnection::terminated, this, &ProxyServer::onConnectionTerminate);
-        } else {
-            qWarning() <<  QStringLiteral("Failed to set socket descriptor!") << socket->errorString();
-        }
+///
+/// Stops the background proxy when the host exits, so its loop is not left running
+/// while the statics it uses are destroyed. Waits at most kStopWait ms.
+///
+static void stopBackground() {
+    auto& background = Background::instance();
+    std::unique_lock<std::mutex> locker(background.lock);
+
+    if (background.running) {
+        stop();
+        background.finished.wait_for(locker, std::chrono::milliseconds(kStopWait), [&background]() {
+            return !background.running;
+        });
     }
-    qInfo() << QStringLiteral("Active Connections: ") << _connections.size();
 }
 
-void ProxyServer::onConnectionTerminate(int id) {
-    if (auto connection = _connections.value(id)) {
-        connection->blockSignals(true);
-        _connections.remove(id);
+///
+/// Starts the proxy on a thread with its own event loop and returns at once, it only
+/// reads proxy-settings.ini there and writes the missing defaults after it is listening.
+/// \a callback, if set, is called on that thread with the status() the start ended in
+/// (running or failed) and \a context.
+/// Returns false when a QCoreApplication exists already, including one of an earlier start.
+///
+extern "C" Q_DECL_EXPORT bool startBackground(ReadyCallback callback, void* context) {
+    auto& background = Background::instance();
+    std::lock_guard<std::mutex> locker(background.lock);
+
+    if (background.running || QCoreApplication::instance()) {
+        return false;
     }
 
-    qInfo() << QStringLiteral("Active Connections: ") << _connections.size();
+    background.running  = true;
+    background.callback = callback;
+    background.context  = context;
+    serverStatus.store(kStatusStarting, std::memory_order_release);
+
+    std::thread([&background]() {
+        int argc    = 0;
+        char** argv = nullptr;
+
+        startServer(argc, argv, [&background](bool listening) {
+            serverStatus.store(listening ? kStatusRunning : kStatusFailed, std::memory_order_release);
+
+            if (listening) {
+                // registered after Qt's own statics so it runs before they are destroyed
+                std::atexit(stopBackground);
+            }
+
+            if (background.callback) {
+                background.callback(serverStatus.load(std::memory_order_acquire), background.context);
+            }
+        });
+
+        auto running = kStatusRunning;
+        serverStatus.compare_exchange_strong(running, kStatusStopped, std::memory_order_acq_rel);
+        {
+            std::lock_guard<std::mutex> locker(background.lock);
+            background.running = false;
+        }
+        background.finished.notify_all();
+    }).detach();
+
+    return true;
 }
 
-ProxyConnection::ProxyConnection(const QSharedPointer<QTcpSocket>& downStream, int id) : _downStream{downStream}, _id{id},
-    _upStream{QSharedPointer<QTcpSocket>(new QTcpSocket, &QObject::deleteLater)} {
-    QObject::connect(_downStream.get(), &QTcpSocket::readyRead,     this, &ProxyConnection::downStreamReadyRead);
-    QObject::connect(_downStream.get(), &QTcpSocket::disconnected,  this, &ProxyConnection::terminate);
-    QObject::connect(_downStream.get(), qOverload<QAbstractSocket::SocketError>(&QTcpSocket::error), this, [this](QAbstractSocket::SocketError) {
-        qWarning() << QStringLiteral("DownStream error: ") << _downStream->errorString();
-    });
-    QObject::connect(_upStream.get(), &QTcpSocket::disconnected,  this, &ProxyConnection::terminate);
-    QObject::connect(_upStream.get(), &QTcpSocket::readyRead,     this, &ProxyConnection::upStreamReadyRead);
-    QObject::connect(_upStream.get(), qOverload<QAbstractSocket::SocketError>(&QTcpSocket::error), this, [this](QAbstractSocket::SocketError) {
-        qWarning() << QStringLiteral("UpStream error: ") << _upStream->errorString();
-    });
+///
+/// Reports the state of the proxy started by startBackground(): 0 stopped, 1 starting,
+/// 2 running, 3 failed to listen.
+///
+extern "C" Q_DECL_EXPORT int status() {
+    return serverStatus.load(std::memory_order_acquire);
 }
 
-ProxyConnection::~ProxyConnection() = default;
+///
+/// Copies the per-listener accept counters into \a counters (up to \a size entries)
+/// and returns the number of listeners.
+///
+extern "C" Q_DECL_EXPORT int acceptCounters(quint64* counters, int size) {
+    const auto values = ProxyServer::acceptCounters();
 
-void ProxyConnection::terminate() {
-    _downStream->blockSignals(true);
-    _upStream->blockSignals(true);
-    _downStream->disconnectFromHost();
-    _downStream->close();
-    _upStream->disconnectFromHost();
-    _upStream->close();
+    for (auto i = 0; counters && i < qMin(size, values.size()); ++i) {
+        counters[i] = values.at(i);
+    }
 
-    Q_EMIT terminated(_id, QPrivateSignal{});
+    return values.size();
 }
 
-void ProxyConnection::downStreamReadyRead() {
-    using namespace httpparser;
-
-    const auto data = _downStream->readAll();
-
-    if (QTcpSocket::ConnectedState != _upStream->state()) {
-        Request request;
-        HttpRequestParser parser;
-        const auto& result = parser.parse(request, data.constData(), data.constData() + data.size());
-
-        if (result == HttpRequestParser::ParsingCompleted) {
-            if ((request.method == kConnect)
-                    || (request.method == kGet)
-                    || (request.method == kPut)
-                    || (request.method == kPost)
-                    || (request.method == kHead)
-                    || (request.method == kDelete)) {
-                const QUrl url(QString::fromStdString(request.uri));
-
-                if (url.isValid()) {
-                    auto host = url.host();
-                    auto port = url.port(80);
-                    QHostInfo::lookupHost(host, this, [ = ](const QHostInfo & info) {
-                        const auto addresses = info.addresses();
-
-                        if (!addresses.isEmpty()) {
-                            _upStream->connectToHost(addresses.first(), port);
-                            QObject::connect(_upStream.get(), &QTcpSocket::connected,
-                            [ = ]() {
-                                if (request.method == kConnect) {
-                                    const auto response = QStringLiteral("HTTP/%1.%2 200 Connection established\r\nProxy-agent: %3/%4\r\n\r\n")
-                                                          .arg(request.versionMajor)
-                                                          .arg(request.versionMinor)
-                                                          .arg(qApp->applicationName())
-                                                          .arg(qApp->applicationVersion());
-                                    _downStream->write(response.toLatin1());
-                                    _downStream->flush();
-                                }
-                            });
-                        } else {
-                            qWarning() << QStringLiteral("HostLookup failed!");
-                            terminate();
-                        }
-                    });
-                } else {
-                    qWarning() << QStringLiteral("Invaid URI found!");
-                    terminate();
-                }
-            }
-        } else {
-            qWarning() << QStringLiteral("HttpRequest parse failed!") << data.constData();
-            terminate();
-        }
-    } else {
-        _upStream->write(data);
-        _upStream->flush();
+///
+/// Reports the shared DNS cache counters, all zero when the cache is disabled.
+///
+extern "C" Q_DECL_EXPORT void dnsCacheCounters(quint64* hits, quint64* misses, quint64* coalesced) {
+    const auto cache = DnsCache::instance();
+
+    if (hits) {
+        *hits = cache ? cache->hits() : 0;
+    }
+
+    if (misses) {
+        *misses = cache ? cache->misses() : 0;
+    }
+
+    if (coalesced) {
+        *coalesced = cache ? cache->coalesced() : 0;
     }
 }
 
-void ProxyConnection::upStreamReadyRead() {
-    _downStream->write(_upStream->readAll());
-    _downStream->flush();
+///
+/// Reports the shared response cache counters, all zero when the cache is disabled.
+///
+extern "C" Q_DECL_EXPORT void responseCacheCounters(quint64* hits, quint64* misses, quint64* revalidated, quint64* coalesced) {
+    const auto cache = ResponseCache::instance();
+
+    if (hits) {
+        *hits = cache ? cache->hits() : 0;
+    }
+
+    if (misses) {
+        *misses = cache ? cache->misses() : 0;
+    }
+
+    if (revalidated) {
+        *revalidated = cache ? cache->revalidated() : 0;
+    }
+
+    if (coalesced) {
+        *coalesced = cache ? cache->coalesced() : 0;
+    }
 }
 
-Settings::Settings(const QString& file) : QSettings(file, QSettings::IniFormat) {}
+///
+/// Copies five counters per SlabPool size class into \a counters (block size, hits,
+/// misses, high-water mark, cached blocks; up to \a size values) and returns the number of classes.
+///
+extern "C" Q_DECL_EXPORT int slabPoolCounters(quint64* counters, int size) {
+    const auto stats = SlabPool::stats();
+    QVector<quint64> values;
 
-QVariant Settings::read(const QString& key, const QVariant& defaultValue) {
-    QVariant result = defaultValue;
+    for (const auto& entry : stats) {
+        values << entry.size << entry.hits << entry.misses << entry.highWater << entry.cached;
+    }
 
-    if (contains(key)) {
-        result = value(key);
-    } else {
-        setValue(key, defaultValue);
-        sync();
+    for (auto i = 0; counters && i < qMin(size, values.size()); ++i) {
+        counters[i] = values.at(i);
     }
 
-    return result;
+    return stats.size();
 }
+
+#endif // BUILD_AS_SHARED_LIB
@@ -0,0 +1,375 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "metrics.h"
+#include "proxyserver.h"
+#include <atomic>
+
+static constexpr auto kCounters       = static_cast<int>(Metrics::Counter::Count);
+static constexpr auto kTerminations   = static_cast<int>(Metrics::Termination::Count);
+static constexpr auto kHistograms     = static_cast<int>(Metrics::Histogram::Count);
+static constexpr qint64 kBounds[]     = {1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};  // us
+static constexpr auto kBuckets        = static_cast<int>(sizeof(kBounds) / sizeof(kBounds[0])) + 1;  // the last one is +Inf
+static constexpr auto kMaxRequestSize = 8 * 1024;
+
+static constexpr const char* kTerminationNames[] = {
+    "closed", "rejected", "parse_error", "dns_failed", "upstream_failed", "upstream_timeout", "upstream_error", "timeout", "denied"
+};
+
+static_assert(sizeof(kTerminationNames) / sizeof(kTerminationNames[0]) == kTerminations, "a name per termination reason");
+
+// written by the owning thread only, read by render(): no read-modify-write needed
+static void bump(std::atomic<quint64>& counter, quint64 delta = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+///
+/// \brief The Snapshot struct
+/// Plain totals, what the per-thread blocks add up to.
+///
+struct Snapshot {
+    quint64 counters[kCounters]            = {};
+    quint64 terminations[kTerminations]    = {};
+    quint64 buckets[kHistograms][kBuckets] = {};
+    quint64 sum[kHistograms]               = {};
+    quint64 count[kHistograms]             = {};
+};
+
+///
+/// \brief The ThreadMetrics struct
+/// The calling thread's counters, registered for render() while the thread lives.
+///
+struct ThreadMetrics {
+    ThreadMetrics();
+    ~ThreadMetrics();
+
+    void addTo(Snapshot& snapshot) const;
+
+    std::atomic<quint64> counters[kCounters]            = {};
+    std::atomic<quint64> terminations[kTerminations]    = {};
+    std::atomic<quint64> buckets[kHistograms][kBuckets] = {};
+    std::atomic<quint64> sum[kHistograms]               = {};
+    std::atomic<quint64> count[kHistograms]             = {};
+};
+
+///
+/// \brief The MetricsRegistry struct
+/// Live per-thread blocks plus the totals of those whose threads already exited.
+///
+struct MetricsRegistry {
+    QMutex lock;
+    QVector<ThreadMetrics*> threads;
+    Snapshot retired;
+
+    static MetricsRegistry& instance() {
+        static MetricsRegistry registry;
+        return registry;
+    }
+};
+
+static thread_local bool tornDown = false;
+
+ThreadMetrics::ThreadMetrics() {
+    auto& registry = MetricsRegistry::instance();
+    QMutexLocker locker(&registry.lock);
+    registry.threads.append(this);
+}
+
+ThreadMetrics::~ThreadMetrics() {
+    tornDown = true;
+
+    auto& registry = MetricsRegistry::instance();
+    QMutexLocker locker(&registry.lock);
+    registry.threads.removeOne(this);
+    addTo(registry.retired);
+}
+
+void ThreadMetrics::addTo(Snapshot& snapshot) const {
+    for (auto i = 0; i < kCounters; ++i) {
+        snapshot.counters[i] += counters[i].load(std::memory_order_relaxed);
+    }
+
+    for (auto i = 0; i < kTerminations; ++i) {
+        snapshot.terminations[i] += terminations[i].load(std::memory_order_relaxed);
+    }
+
+    for (auto i = 0; i < kHistograms; ++i) {
+        for (auto j = 0; j < kBuckets; ++j) {
+            snapshot.buckets[i][j] += buckets[i][j].load(std::memory_order_relaxed);
+        }
+
+        snapshot.sum[i]   += sum[i].load(std::memory_order_relaxed);
+        snapshot.count[i] += count[i].load(std::memory_order_relaxed);
+    }
+}
+
+static ThreadMetrics* threadMetrics() {
+    if (tornDown) {
+        return nullptr;
+    }
+
+    static thread_local ThreadMetrics metrics;
+    return &metrics;
+}
+
+void Metrics::add(Counter counter, quint64 value) {
+    if (auto metrics = threadMetrics()) {
+        bump(metrics->counters[static_cast<int>(counter)], value);
+    }
+}
+
+void Metrics::terminated(Termination reason) {
+    if (auto metrics = threadMetrics()) {
+        bump(metrics->terminations[static_cast<int>(reason)]);
+    }
+}
+
+void Metrics::observe(Histogram histogram, qint64 microseconds) {
+    auto metrics = threadMetrics();
+
+    if (!metrics) {
+        return;
+    }
+
+    const auto index = static_cast<int>(histogram);
+    auto bucket      = 0;
+
+    while ((bucket < kBuckets - 1) && (microseconds > kBounds[bucket])) {
+        ++bucket;
+    }
+
+    bump(metrics->buckets[index][bucket]);
+    bump(metrics->sum[index], static_cast<quint64>(qMax<qint64>(0, microseconds)));
+    bump(metrics->count[index]);
+}
+
+const char* Metrics::terminationName(Termination reason) {
+    const auto index = static_cast<int>(reason);
+    return ((index >= 0) && (index < kTerminations)) ? kTerminationNames[index] : "unknown";
+}
+
+static void family(QByteArray& out, const char* name, const char* type, const char* help) {
+    out += QByteArrayLiteral("# HELP ") + name + ' ' + help + '\n';
+    out += QByteArrayLiteral("# TYPE ") + name + ' ' + type + '\n';
+}
+
+static void sample(QByteArray& out, const QByteArray& name, quint64 value, const QByteArray& labels = {}) {
+    out += name;
+
+    if (!labels.isEmpty()) {
+        out += '{' + labels + '}';
+    }
+
+    out += ' ' + QByteArray::number(value) + '\n';
+}
+
+static void histogram(QByteArray& out, const Snapshot& snapshot, Metrics::Histogram which, const char* name, const char* help,
+                      const QByteArray& labels = {}) {
+    const auto index = static_cast<int>(which);
+    const QByteArray base(name);
+    const auto prefix = labels.isEmpty() ? labels : (labels + ',');
+
+    // series with labels share the family of the first one
+    if (help) {
+        family(out, name, "histogram", help);
+    }
+
+    quint64 cumulative = 0;
+
+    for (auto i = 0; i < kBuckets; ++i) {
+        cumulative += snapshot.buckets[index][i];
+        const auto bound = (i < kBuckets - 1) ? QByteArray::number(kBounds[i] / 1e6) : QByteArrayLiteral("+Inf");
+        sample(out, base + "_bucket", cumulative, prefix + "le=\"" + bound + '"');
+    }
+
+    out += base + "_sum" + (labels.isEmpty() ? QByteArray() : ('{' + labels + '}')) + ' ' + QByteArray::number(snapshot.sum[index] / 1e6) + '\n';
+    sample(out, base + "_count", snapshot.count[index], labels);
+}
+
+void Metrics::render(QByteArray& out) {
+    Snapshot snapshot;
+    {
+        auto& registry = MetricsRegistry::instance();
+        QMutexLocker locker(&registry.lock);
+        snapshot = registry.retired;
+
+        for (auto metrics : qAsConst(registry.threads)) {
+            metrics->addTo(snapshot);
+        }
+    }
+
+    const auto counter = [&snapshot](Counter which) {
+        return snapshot.counters[static_cast<int>(which)];
+    };
+
+    family(out, "proxy_accepts_total", "counter", "Accepted client connections.");
+    sample(out, "proxy_accepts_total", counter(Counter::Accepts));
+    family(out, "proxy_active_connections", "gauge", "Client connections currently open.");
+    sample(out, "proxy_active_connections", counter(Counter::ConnectionsOpened) - counter(Counter::ConnectionsClosed));
+    family(out, "proxy_active_tunnels", "gauge", "CONNECT tunnels currently established.");
+    sample(out, "proxy_active_tunnels", counter(Counter::TunnelsOpened) - counter(Counter::TunnelsClosed));
+    family(out, "proxy_bytes_total", "counter", "Bytes relayed, up is client to upstream.");
+    sample(out, "proxy_bytes_total", counter(Counter::BytesUp), "direction=\"up\"");
+    sample(out, "proxy_bytes_total", counter(Counter::BytesDown), "direction=\"down\"");
+    family(out, "proxy_parse_failures_total", "counter", "Request or response heads that failed to parse.");
+    sample(out, "proxy_parse_failures_total", counter(Counter::ParseFailures));
+    family(out, "proxy_rate_limited_total", "counter", "Client connections refused by the per-client limits.");
+    sample(out, "proxy_rate_limited_total", counter(Counter::RateLimited));
+    family(out, "proxy_requests_total", "counter", "Request heads handled, including CONNECT.");
+    sample(out, "proxy_requests_total", counter(Counter::Requests));
+    family(out, "proxy_syscalls_total", "counter", "Relay system calls by operation, the Qt engine reports its forced flushes as writes.");
+    sample(out, "proxy_syscalls_total", counter(Counter::Reads), "op=\"read\"");
+    sample(out, "proxy_syscalls_total", counter(Counter::Writes), "op=\"write\"");
+    sample(out, "proxy_syscalls_total", counter(Counter::Polls), "op=\"poll\"");
+    sample(out, "proxy_syscalls_total", counter(Counter::Submits), "op=\"io_uring_enter\"");
+    family(out, "proxy_shed_total", "counter", "Overload shedding by admission control, refused connections and accept pauses.");
+    sample(out, "proxy_shed_total", counter(Counter::Shed), "action=\"reject\"");
+    sample(out, "proxy_shed_total", counter(Counter::AcceptPauses), "action=\"pause\"");
+    family(out, "proxy_terminations_total", "counter", "Closed client connections by reason.");
+
+    for (auto i = 0; i < kTerminations; ++i) {
+        sample(out, "proxy_terminations_total", snapshot.terminations[i],
+               QByteArrayLiteral("reason=\"") + terminationName(static_cast<Termination>(i)) + '"');
+    }
+
+    histogram(out, snapshot, Histogram::DnsLatency, "proxy_dns_latency_seconds", "Time to resolve an upstream host.");
+    histogram(out, snapshot, Histogram::ConnectLatency, "proxy_upstream_connect_latency_seconds", "Time to connect to an upstream.");
+
+    static constexpr const char* kStageNames[] = {"head", "resolve", "connect", "respond", "finish"};
+    const auto stages = static_cast<int>(Histogram::Count) - static_cast<int>(Histogram::StageHead);
+
+    for (auto i = 0; i < stages; ++i) {
+        histogram(out, snapshot, static_cast<Histogram>(static_cast<int>(Histogram::StageHead) + i), "proxy_request_stage_seconds",
+                  (i == 0) ? "Time traced requests spent in each stage, up to the event that ends it." : nullptr,
+                  QByteArrayLiteral("stage=\"") + kStageNames[i] + '"');
+    }
+}
+
+MetricsServer::MetricsServer(const QVector<ProxyWorker*>& workers, QObject* parent) : QTcpServer(parent), _workers{workers} {
+    QObject::connect(this, &QTcpServer::newConnection, this, [this]() {
+        while (auto socket = nextPendingConnection()) {
+            QObject::connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+            QObject::connect(socket, &QTcpSocket::readyRead, this, [this, socket]() {
+                serve(socket);
+            });
+        }
+    });
+}
+
+MetricsServer::~MetricsServer() = default;
+
+void MetricsServer::serve(QTcpSocket* socket) {
+    const auto request = socket->peek(socket->bytesAvailable());
+
+    if (!request.contains("\r\n\r\n")) {
+        if (request.size() > kMaxRequestSize) {
+            socket->abort();
+        }
+
+        return;
+    }
+
+    socket->readAll();
+    const auto target = request.left(request.indexOf("\r\n")).split(' ').value(1);
+    const auto found  = request.startsWith("GET ") && ((target == "/metrics") || (target == "/"));
+    const auto body   = found ? render() : QByteArrayLiteral("Not Found\n");
+
+    socket->write(QStringLiteral("HTTP/1.1 %1\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %2\r\nConnection: close\r\n\r\n")
+                  .arg(QLatin1String(found ? "200 OK" : "404 Not Found"))
+                  .arg(body.size())
+                  .toLatin1());
+    socket->write(body);
+    socket->disconnectFromHost();
+}
+
+QByteArray MetricsServer::render() const {
+    QByteArray out;
+    Metrics::render(out);
+
+    const auto accepts = ProxyServer::acceptCounters();
+    family(out, "proxy_listener_accepts_total", "counter", "Accepted connections per listener.");
+
+    for (auto i = 0; i < accepts.size(); ++i) {
+        sample(out, "proxy_listener_accepts_total", accepts.at(i), "listener=\"" + QByteArray::number(i) + '"');
+    }
+
+    if (auto cache = DnsCache::instance()) {
+        family(out, "proxy_dns_cache_lookups_total", "counter", "DNS cache lookups by outcome.");
+        sample(out, "proxy_dns_cache_lookups_total", cache->hits(), "result=\"hit\"");
+        sample(out, "proxy_dns_cache_lookups_total", cache->misses(), "result=\"miss\"");
+        sample(out, "proxy_dns_cache_lookups_total", cache->coalesced(), "result=\"coalesced\"");
+    }
+
+    if (auto cache = ResponseCache::instance()) {
+        family(out, "proxy_cache_lookups_total", "counter", "Response cache lookups by outcome.");
+        sample(out, "proxy_cache_lookups_total", cache->hits(), "result=\"hit\"");
+        sample(out, "proxy_cache_lookups_total", cache->misses(), "result=\"miss\"");
+        sample(out, "proxy_cache_lookups_total", cache->coalesced(), "result=\"coalesced\"");
+        family(out, "proxy_cache_revalidations_total", "counter", "Stale entries the origin confirmed with 304.");
+        sample(out, "proxy_cache_revalidations_total", cache->revalidated());
+    }
+
+    if (auto log = AccessLog::instance()) {
+        family(out, "proxy_access_log_records_total", "counter", "Access log records by outcome.");
+        sample(out, "proxy_access_log_records_total", log->written(), "result=\"written\"");
+        sample(out, "proxy_access_log_records_total", log->dropped(), "result=\"dropped\"");
+    }
+
+    family(out, "proxy_worker_active_connections", "gauge", "Client connections per worker.");
+
+    for (auto i = 0; i < _workers.size(); ++i) {
+        sample(out, "proxy_worker_active_connections", static_cast<quint64>(_workers.at(i)->activeConnections()),
+               "worker=\"" + QByteArray::number(i) + '"');
+    }
+
+    family(out, "proxy_worker_loop_lag_seconds", "gauge", "How late each worker's event loop runs its timers, smoothed.");
+
+    for (auto i = 0; i < _workers.size(); ++i) {
+        out += "proxy_worker_loop_lag_seconds{worker=\"" + QByteArray::number(i) + "\"} "
+               + QByteArray::number(_workers.at(i)->loopLag() / 1e3) + '\n';
+    }
+
+    family(out, "proxy_upstream_pool_acquires_total", "counter", "Upstream keep-alive pool acquires by outcome.");
+
+    for (auto i = 0; i < _workers.size(); ++i) {
+        const auto worker = "worker=\"" + QByteArray::number(i) + '"';
+        sample(out, "proxy_upstream_pool_acquires_total", _workers.at(i)->upstreamPool().hits(), worker + ",result=\"hit\"");
+        sample(out, "proxy_upstream_pool_acquires_total", _workers.at(i)->upstreamPool().misses(), worker + ",result=\"miss\"");
+    }
+
+    const auto slabs = SlabPool::stats();
+    family(out, "proxy_slab_allocations_total", "counter", "Slab pool allocations by size class and outcome.");
+
+    for (const auto& entry : slabs) {
+        const auto size = "size=\"" + QByteArray::number(entry.size) + '"';
+        sample(out, "proxy_slab_allocations_total", entry.hits, size + ",result=\"hit\"");
+        sample(out, "proxy_slab_allocations_total", entry.misses, size + ",result=\"miss\"");
+    }
+
+    family(out, "proxy_slab_high_water_blocks", "gauge", "Peak blocks in use per size class.");
+
+    for (const auto& entry : slabs) {
+        sample(out, "proxy_slab_high_water_blocks", entry.highWater, "size=\"" + QByteArray::number(entry.size) + '"');
+    }
+
+    family(out, "proxy_slab_cached_blocks", "gauge", "Blocks parked in free lists per size class.");
+
+    for (const auto& entry : slabs) {
+        sample(out, "proxy_slab_cached_blocks", entry.cached, "size=\"" + QByteArray::number(entry.size) + '"');
+    }
+
+    return out;
+}
@@ -0,0 +1,106 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <QtNetwork>
+
+class ProxyWorker;
+
+///
+/// \brief The Metrics class
+/// Process wide counters and latency histograms. Every thread updates its own
+/// block with plain relaxed stores, no locks and no shared cache lines on the
+/// relay path; render() sums the blocks into the Prometheus text format.
+///
+class Metrics final {
+  public:
+    enum class Counter {
+        Accepts,
+        ConnectionsOpened,
+        ConnectionsClosed,
+        TunnelsOpened,
+        TunnelsClosed,
+        BytesUp,    // client to upstream
+        BytesDown,  // upstream to client
+        ParseFailures,
+        RateLimited,  // connections refused by the per-client limits
+        Requests,     // request heads handled, a keep-alive connection carries several
+        Reads,        // recv() on the native relay path
+        Writes,       // send() on the native relay path, forced flushes on the Qt one
+        Polls,        // epoll_wait() returns of the native loops
+        Submits,      // io_uring_enter() calls of the uring engine
+        Shed,         // connections answered 503 by admission control
+        AcceptPauses, // times admission control stopped accepting
+        Count
+    };
+
+    enum class Termination {
+        Closed,
+        Rejected,
+        ParseError,
+        DnsFailed,
+        UpstreamFailed,
+        UpstreamTimeout,
+        UpstreamError,
+        Timeout,
+        Denied,
+        Count
+    };
+
+    enum class Histogram {
+        DnsLatency,
+        ConnectLatency,
+        StageHead,     // traced requests, in Tracer::Stage order
+        StageResolve,
+        StageConnect,
+        StageRespond,
+        StageFinish,
+        Count
+    };
+
+    static void add(Counter counter, quint64 value = 1);
+    static void terminated(Termination reason);
+    static void observe(Histogram histogram, qint64 microseconds);
+
+    static const char* terminationName(Termination reason);
+
+    ///
+    /// Appends all counters and histograms to \a out.
+    ///
+    static void render(QByteArray& out);
+};
+
+///
+/// \brief The MetricsServer class
+/// Serves GET /metrics on its own listener, next to the engine's counters it
+/// reports the per-listener accepts, the DNS cache, the access log, the upstream
+/// pools and the slab pool.
+///
+class MetricsServer final : public QTcpServer {
+    Q_OBJECT
+
+  public:
+    explicit MetricsServer(const QVector<ProxyWorker*>& workers, QObject* parent = nullptr);
+    ~MetricsServer() override;
+
+  private:
+    void serve(QTcpSocket* socket);
+    QByteArray render() const;
+
+    const QVector<ProxyWorker*> _workers;
+};
@@ -0,0 +1,365 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "muxlink.h"
+#include "slabpool.h"
+
+static constexpr auto kHeaderSize     = 8;
+static constexpr auto kMaxPayload     = 16 * 1024;
+static constexpr qint64 kWindow       = 256 * 1024;  // per stream and direction
+static constexpr qint64 kWindowUpdate = 64 * 1024;   // credit goes back in batches
+static constexpr auto kReconnectDelay = 1000;  // ms
+
+static quint32 readU32(const char* data) {
+    const auto bytes = reinterpret_cast<const uchar*>(data);
+    return (quint32{bytes[0]} << 24) | (quint32{bytes[1]} << 16) | (quint32{bytes[2]} << 8) | bytes[3];
+}
+
+static void writeU32(char* data, quint32 value) {
+    data[0] = static_cast<char>(value >> 24);
+    data[1] = static_cast<char>(value >> 16);
+    data[2] = static_cast<char>(value >> 8);
+    data[3] = static_cast<char>(value);
+}
+
+MuxStream::MuxStream(MuxLink* link, quint32 id, bool open) : _link{link}, _id{id}, _credit{kWindow}, _open{open} {
+}
+
+MuxStream::~MuxStream() {
+    if (_link) {
+        if (!_closed) {
+            _link->sendFrame(_id, MuxLink::Type::Close);
+        }
+
+        _link->_streams.remove(_id);
+    }
+}
+
+quint32 MuxStream::id() const {
+    return _id;
+}
+
+void MuxStream::write(const char* data, qint64 size) {
+    if (_closed || _closing || (size <= 0)) {
+        return;
+    }
+
+    _outgoing.append(data, static_cast<int>(size));
+    flush();
+}
+
+qint64 MuxStream::bytesToWrite() const {
+    return _outgoing.size();
+}
+
+void MuxStream::consumed(qint64 size) {
+    _unacked += size;
+
+    if (_link && !_closed && (_unacked >= kWindowUpdate)) {
+        char credit[4];
+        writeU32(credit, static_cast<quint32>(_unacked));
+        _link->sendFrame(_id, MuxLink::Type::Window, credit, sizeof(credit));
+        _unacked = 0;
+    }
+}
+
+void MuxStream::close() {
+    if (_closed) {
+        return;
+    }
+
+    _closing = true;
+    flush();
+}
+
+void MuxStream::accept() {
+    if (_link && !_closed && !_open) {
+        _open = true;
+        _link->sendFrame(_id, MuxLink::Type::Opened);
+        flush();
+    }
+}
+
+void MuxStream::refuse(int statusCode) {
+    if (_link && !_closed) {
+        char status[4];
+        writeU32(status, static_cast<quint32>(statusCode));
+        _link->sendFrame(_id, MuxLink::Type::Refused, status, sizeof(status));
+        _closed = true;
+    }
+}
+
+void MuxStream::flush() {
+    if (!_link || _closed) {
+        return;
+    }
+
+    if (_open) {
+        auto offset = 0;
+
+        while ((offset < _outgoing.size()) && (_credit > 0)) {
+            const auto size = static_cast<int>(qMin(qMin<qint64>(_outgoing.size() - offset, _credit), qint64{kMaxPayload}));
+            _link->sendFrame(_id, MuxLink::Type::Data, _outgoing.constData() + offset, size);
+            _credit -= size;
+            offset  += size;
+        }
+
+        _outgoing.remove(0, offset);
+    }
+
+    if (_closing && _outgoing.isEmpty()) {
+        _link->sendFrame(_id, MuxLink::Type::Close);
+        _closed = true;
+    }
+}
+
+void MuxStream::detach() {
+    _link   = nullptr;
+    _closed = true;
+    Q_EMIT closed();
+}
+
+MuxLink::MuxLink(const QSharedPointer<QTcpSocket>& socket, Role role, const QByteArray& secret, QObject* parent) :
+    QObject(parent), _socket{socket}, _role{role}, _secret{secret} {
+    QObject::connect(_socket.get(), &QTcpSocket::readyRead, this, &MuxLink::readFrames);
+    QObject::connect(_socket.get(), &QTcpSocket::disconnected, this, [this]() {
+        fail(QStringLiteral("link closed"));
+    });
+    QObject::connect(_socket.get(), qOverload<QAbstractSocket::SocketError>(&QTcpSocket::error), this, [this](QAbstractSocket::SocketError) {
+        fail(_socket->errorString());
+    });
+    QObject::connect(_socket.get(), &QTcpSocket::connected, this, [this]() {
+        _socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+        _socket->setSocketOption(QAbstractSocket::KeepAliveOption, 1);
+        _socket->write(_queued);
+        _queued.clear();
+    });
+
+    if (_role == Role::Client) {
+        sendFrame(0, Type::Hello, _secret.constData(), _secret.size());
+    }
+}
+
+MuxLink::~MuxLink() {
+    const auto streams = _streams;
+    _streams.clear();
+
+    for (auto stream : streams) {
+        stream->detach();
+    }
+
+    _socket->blockSignals(true);
+    _socket->abort();
+}
+
+QSharedPointer<MuxStream> MuxLink::open(const QByteArray& target) {
+    if (_lost || (_role != Role::Client)) {
+        return {};
+    }
+
+    const auto id = _nextId;
+    _nextId += 2;
+
+    auto stream = QSharedPointer<MuxStream>(new MuxStream(this, id, false), &QObject::deleteLater);
+    _streams.insert(id, stream.get());
+    sendFrame(id, Type::Open, target.constData(), target.size());
+    return stream;
+}
+
+int MuxLink::streams() const {
+    return _streams.size();
+}
+
+bool MuxLink::isLost() const {
+    return _lost;
+}
+
+void MuxLink::sendFrame(quint32 id, Type type, const char* data, int size) {
+    char header[kHeaderSize];
+    writeU32(header, id);
+    header[4] = static_cast<char>(type);
+    header[5] = 0;
+    header[6] = static_cast<char>(size >> 8);
+    header[7] = static_cast<char>(size);
+
+    if (_socket->state() == QAbstractSocket::ConnectedState) {
+        _socket->write(header, kHeaderSize);
+        _socket->write(data, size);
+    } else {
+        _queued.append(header, kHeaderSize);
+        _queued.append(data, size);
+    }
+}
+
+void MuxLink::readFrames() {
+    _input.append(_socket->readAll());
+    auto offset = 0;
+
+    while (!_lost && (_input.size() - offset >= kHeaderSize)) {
+        const auto header = _input.constData() + offset;
+        const auto size   = (static_cast<uchar>(header[6]) << 8) | static_cast<uchar>(header[7]);
+
+        if (_input.size() - offset - kHeaderSize < size) {
+            break;
+        }
+
+        handleFrame(readU32(header), static_cast<Type>(header[4]), header + kHeaderSize, size);
+        offset += kHeaderSize + size;
+    }
+
+    _input.remove(0, offset);
+}
+
+void MuxLink::handleFrame(quint32 id, Type type, const char* data, int size) {
+    if (!_authenticated) {
+        // the client speaks first, anything but a matching hello ends the link
+        if ((_role == Role::Server) && ((type != Type::Hello) || (QByteArray::fromRawData(data, size) != _secret))) {
+            fail(QStringLiteral("link not authenticated"));
+            return;
+        }
+
+        _authenticated = true;
+
+        if (type == Type::Hello) {
+            if (_role == Role::Server) {
+                sendFrame(0, Type::Hello);
+            }
+
+            return;
+        }
+    }
+
+    if (type == Type::Hello) {
+        return;
+    }
+
+    if (type == Type::Open) {
+        if ((_role != Role::Server) || _streams.contains(id)) {
+            fail(QStringLiteral("unexpected stream open"));
+            return;
+        }
+
+        auto stream = QSharedPointer<MuxStream>(new MuxStream(this, id, false), &QObject::deleteLater);
+        _streams.insert(id, stream.get());
+        Q_EMIT incoming(stream, QByteArray(data, size));
+        return;
+    }
+
+    const auto stream = _streams.value(id);
+
+    if (!stream || stream->_closed) {
+        return;  // already gone on this side
+    }
+
+    switch (type) {
+        case Type::Opened:
+            stream->_open = true;
+            stream->flush();
+            Q_EMIT stream->opened();
+            break;
+
+        case Type::Refused:
+            stream->_closed = true;
+            Q_EMIT stream->refused((size >= 4) ? static_cast<int>(readU32(data)) : 502);
+            break;
+
+        case Type::Data:
+            Q_EMIT stream->received(data, size);
+            break;
+
+        case Type::Close:
+            stream->_closed = true;
+            Q_EMIT stream->closed();
+            break;
+
+        case Type::Window:
+            if (size >= 4) {
+                stream->_credit += readU32(data);
+                stream->flush();
+                Q_EMIT stream->bytesWritten();
+            }
+
+            break;
+
+        default:
+            break;
+    }
+}
+
+void MuxLink::fail(const QString& reason) {
+    if (_lost) {
+        return;
+    }
+
+    _lost = true;
+    qWarning() << QStringLiteral("Mux link lost:") << reason;
+
+    const auto streams = _streams;
+    _streams.clear();
+
+    for (auto stream : streams) {
+        stream->detach();
+    }
+
+    Q_EMIT lost();
+}
+
+MuxPool::MuxPool(const MuxLink::Options& options, QObject* parent) : QObject(parent), _options{options} {
+    _links.resize(qMax(1, _options.links));
+
+    // runs once the owning worker sits on its thread, the sockets must live there
+    QTimer::singleShot(0, this, [this]() {
+        for (auto slot = 0; slot < _links.size(); ++slot) {
+            connectLink(slot);
+        }
+    });
+}
+
+MuxPool::~MuxPool() = default;
+
+QSharedPointer<MuxStream> MuxPool::open(const QString& host, quint16 port) {
+    MuxLink* best = nullptr;
+
+    for (auto link : qAsConst(_links)) {
+        if (link && !link->isLost() && (!best || (link->streams() < best->streams()))) {
+            best = link;
+        }
+    }
+
+    if (!best) {
+        return {};
+    }
+
+    const auto target = host.contains(QLatin1Char(':')) ? QStringLiteral("[%1]:%2").arg(host).arg(port)
+                        : QStringLiteral("%1:%2").arg(host).arg(port);
+    return best->open(target.toUtf8());
+}
+
+void MuxPool::connectLink(int slot) {
+    auto socket = QSharedPointer<QTcpSocket>(new PooledTcpSocket, &QObject::deleteLater);
+    auto link   = new MuxLink(socket, MuxLink::Role::Client, _options.secret, this);
+    _links[slot] = link;
+
+    QObject::connect(link, &MuxLink::lost, this, [this, link, slot]() {
+        _links[slot] = nullptr;
+        link->deleteLater();
+        QTimer::singleShot(kReconnectDelay, this, [this, slot]() {
+            connectLink(slot);
+        });
+    });
+
+    socket->connectToHost(_options.parentHost, _options.parentPort);
+}
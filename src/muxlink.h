@@ -0,0 +1,173 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <QtNetwork>
+
+class MuxLink;
+
+///
+/// \brief The MuxStream class
+/// One tunnel carried over a MuxLink. Each direction has a credit window:
+/// the sender frames data only while it holds credit and the receiver hands
+/// credit back with consumed() once it delivered the bytes, so a slow
+/// consumer stalls its own stream and never the link.
+///
+class MuxStream final : public QObject {
+    Q_OBJECT
+
+  public:
+    ~MuxStream() override;
+
+    quint32 id() const;
+
+    ///
+    /// Queues \a data, framed as credit allows. Writes before the stream is open are held back.
+    ///
+    void   write(const char* data, qint64 size);
+    qint64 bytesToWrite() const;  // held back for credit
+
+    ///
+    /// Returns credit for \a size received bytes the owner delivered.
+    ///
+    void consumed(qint64 size);
+
+    ///
+    /// Sends what is queued, then closes the stream.
+    ///
+    void close();
+
+    // server side, answers the peer's open
+    void accept();
+    void refuse(int statusCode);
+
+  Q_SIGNALS:
+    void opened();
+    void refused(int statusCode);
+    void received(const char* data, qint64 size);
+    void bytesWritten();  // credit came back and queued data moved on
+    void closed();        // by the peer or because the link was lost
+
+  private:
+    friend class MuxLink;
+
+    MuxStream(MuxLink* link, quint32 id, bool open);
+
+    void flush();
+    void detach();
+
+    QPointer<MuxLink> _link;
+    const quint32 _id = 0;
+    qint64 _credit    = 0;
+    qint64 _unacked   = 0;
+    QByteArray _outgoing;
+    bool _open    = false;
+    bool _closing = false;
+    bool _closed  = false;
+};
+
+///
+/// \brief The MuxLink class
+/// A persistent TCP connection to (or from) a parent proxy that carries many
+/// tunnels as framed streams. Every frame starts with an 8 byte header:
+/// u32 stream id, u8 type, u8 reserved, u16 payload length, all big endian.
+/// The client opens streams with odd ids and authenticates with a shared
+/// secret in the first frame.
+///
+class MuxLink final : public QObject {
+    Q_OBJECT
+
+  public:
+    enum class Role {
+        Client,
+        Server
+    };
+
+    struct Options {
+        QString parentHost;     // where tunnels are carried to
+        quint16 parentPort = 0;  // 0: connect to origins directly
+        int links          = 2;  // persistent links per worker
+        QHostAddress listenAddress = QHostAddress(QHostAddress::Any);
+        quint16 listenPort         = 0;  // 0: do not accept links
+        QByteArray secret;
+    };
+
+    MuxLink(const QSharedPointer<QTcpSocket>& socket, Role role, const QByteArray& secret, QObject* parent = nullptr);
+    ~MuxLink() override;
+
+    ///
+    /// Opens a stream to \a target ("host:port"), usable right away: writes are held until the peer accepts.
+    ///
+    QSharedPointer<MuxStream> open(const QByteArray& target);
+
+    int  streams() const;
+    bool isLost() const;
+
+  Q_SIGNALS:
+    void incoming(const QSharedPointer<MuxStream>& stream, const QByteArray& target);
+    void lost();
+
+  private:
+    friend class MuxStream;
+
+    enum class Type : quint8 {
+        Hello,
+        Open,
+        Opened,
+        Refused,
+        Data,
+        Close,
+        Window
+    };
+
+    void sendFrame(quint32 id, Type type, const char* data = nullptr, int size = 0);
+    void readFrames();
+    void handleFrame(quint32 id, Type type, const char* data, int size);
+    void fail(const QString& reason);
+
+    QSharedPointer<QTcpSocket> _socket;
+    const Role _role;
+    const QByteArray _secret;
+    QByteArray _input;
+    QByteArray _queued;  // frames written before the socket connected
+    QHash<quint32, MuxStream*> _streams;
+    quint32 _nextId     = 1;
+    bool _authenticated = false;
+    bool _lost          = false;
+};
+
+///
+/// \brief The MuxPool class
+/// A worker's links to the parent proxy: connected up front, reconnected
+/// after a short delay when lost, new streams go to the least loaded link.
+///
+class MuxPool final : public QObject {
+    Q_OBJECT
+
+  public:
+    explicit MuxPool(const MuxLink::Options& options, QObject* parent = nullptr);
+    ~MuxPool() override;
+
+    QSharedPointer<MuxStream> open(const QString& host, quint16 port);
+
+  private:
+    void connectLink(int slot);
+
+    const MuxLink::Options _options;
+    QVector<MuxLink*> _links;  // null while reconnecting
+};
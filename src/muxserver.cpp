@@ -0,0 +1,200 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "muxserver.h"
+
+MuxServer::MuxServer(const QVector<ProxyWorker*>& workers, QObject* parent) : QTcpServer(parent), _workers{workers} {
+}
+
+MuxServer::~MuxServer() {
+    close();
+}
+
+void MuxServer::incomingConnection(qintptr handle) {
+    const auto worker = _workers.at(_next);
+    _next = (_next + 1) % _workers.size();
+
+    // links are few and long lived, round robin spreads them well enough
+    QMetaObject::invokeMethod(worker, [worker, handle]() {
+        worker->addMuxLink(handle);
+    }, Qt::QueuedConnection);
+}
+
+MuxTunnel::MuxTunnel(const QSharedPointer<MuxStream>& stream, const QByteArray& target, ProxyWorker& worker) :
+    QObject(&worker), _worker{worker}, _snapshot{worker.config()}, _config{*_snapshot}, _stream{stream} {
+    QObject::connect(_stream.get(), &MuxStream::received, this, [this](const char* data, qint64 size) {
+        Metrics::add(Metrics::Counter::BytesUp, static_cast<quint64>(size));
+
+        if (_origin) {
+            _origin->write(data, size);
+            _unacked += size;
+            acknowledge();
+        } else {
+            _pending.append(data, static_cast<int>(size));
+        }
+    });
+    QObject::connect(_stream.get(), &MuxStream::bytesWritten, this, [this]() {
+        if (_originClosed) {
+            originClosed();
+        } else {
+            readOrigin();
+        }
+    });
+    QObject::connect(_stream.get(), &MuxStream::closed, this, &MuxTunnel::finish);
+
+    const auto colon = target.lastIndexOf(':');
+    auto host        = QString::fromUtf8(target.left(colon));
+    auto valid       = false;
+    const auto port  = target.mid(colon + 1).toUShort(&valid);
+
+    if (host.startsWith(QLatin1Char('[')) && host.endsWith(QLatin1Char(']'))) {
+        host = host.mid(1, host.size() - 2);
+    }
+
+    if ((colon <= 0) || !valid || (port == 0)) {
+        qWarning() << QStringLiteral("Invalid mux target:") << target;
+        refuse(400);
+        return;
+    }
+
+    if (_config.acl && (_config.acl->check(host, &_socketProfile) == Acl::Action::Deny)) {
+        qWarning() << QStringLiteral("Target denied by ACL:") << host;
+        refuse(403);
+        return;
+    }
+
+    const auto deliver = [this, port](const QList<QHostAddress>& addresses) {
+        resolved(addresses, port);
+    };
+
+    if (auto cache = DnsCache::instance()) {
+        cache->lookup(host, this, deliver);
+    } else {
+        QHostInfo::lookupHost(host, this, [deliver](const QHostInfo & info) {
+            deliver(info.addresses());
+        });
+    }
+}
+
+MuxTunnel::~MuxTunnel() = default;
+
+void MuxTunnel::resolved(const QList<QHostAddress>& addresses, quint16 port) {
+    if (_finished) {
+        return;
+    }
+
+    const auto permitted = _config.acl ? _config.acl->permitted(addresses) : addresses;
+
+    if (permitted.isEmpty()) {
+        refuse(addresses.isEmpty() ? 502 : 403);
+        return;
+    }
+
+    auto connector = new UpstreamConnector(UpstreamConnector::sortAddresses(permitted), port,
+                                           _config.connectAttemptDelay, _config.connectTimeout,
+                                           _config.tuning(_socketProfile), this);
+    QObject::connect(connector, &UpstreamConnector::connected, this,
+    [this, connector](const QSharedPointer<QTcpSocket>& socket, const QHostAddress&) {
+        connector->deleteLater();
+        connected(socket);
+    });
+    QObject::connect(connector, &UpstreamConnector::failed, this, [this, connector](const QString & reason, bool timedOut) {
+        connector->deleteLater();
+        qWarning() << QStringLiteral("Mux target connect failed:") << reason;
+        refuse(timedOut ? 504 : 502);
+    });
+    connector->start();
+}
+
+void MuxTunnel::connected(const QSharedPointer<QTcpSocket>& socket) {
+    if (_finished) {
+        return;
+    }
+
+    _origin = socket;
+    _origin->setReadBufferSize(_config.readBufferSize);
+    QObject::connect(_origin.get(), &QTcpSocket::readyRead, this, &MuxTunnel::readOrigin);
+    QObject::connect(_origin.get(), &QTcpSocket::bytesWritten, this, &MuxTunnel::acknowledge);
+    QObject::connect(_origin.get(), &QTcpSocket::disconnected, this, &MuxTunnel::originClosed);
+
+    _stream->accept();
+
+    if (!_pending.isEmpty()) {
+        _origin->write(_pending);
+        _unacked += _pending.size();
+        _pending.clear();
+    }
+
+    readOrigin();
+}
+
+void MuxTunnel::readOrigin() {
+    if (!_origin || _finished) {
+        return;
+    }
+
+    SlabPool::Buffer buffer(qMin<qint64>(_origin->bytesAvailable(), _config.readBufferSize));
+
+    // stop reading once the stream holds a window's worth, TCP pushes back on the origin
+    while ((_origin->bytesAvailable() > 0) && (_stream->bytesToWrite() < _config.highWatermark)) {
+        const auto size = _origin->read(buffer.data(), buffer.capacity());
+
+        if (size <= 0) {
+            break;
+        }
+
+        Metrics::add(Metrics::Counter::BytesDown, static_cast<quint64>(size));
+        _stream->write(buffer.data(), size);
+    }
+}
+
+void MuxTunnel::acknowledge() {
+    if (_origin && (_unacked > 0) && (_origin->bytesToWrite() <= _config.lowWatermark)) {
+        _stream->consumed(_unacked);
+        _unacked = 0;
+    }
+}
+
+void MuxTunnel::originClosed() {
+    _originClosed = true;
+    readOrigin();
+
+    if ((_origin->bytesAvailable() == 0) && (_stream->bytesToWrite() == 0)) {
+        _stream->close();
+        finish();
+    }
+}
+
+void MuxTunnel::refuse(int statusCode) {
+    _stream->refuse(statusCode);
+    finish();
+}
+
+void MuxTunnel::finish() {
+    if (_finished) {
+        return;
+    }
+
+    _finished = true;
+    QObject::disconnect(_stream.get(), nullptr, this, nullptr);
+
+    if (_origin) {
+        QObject::disconnect(_origin.get(), nullptr, this, nullptr);
+        _origin->disconnectFromHost();
+    }
+
+    deleteLater();
+}
@@ -0,0 +1,73 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include "proxyserver.h"
+
+///
+/// \brief The MuxServer class
+/// The parent side of proxy chaining: accepts MuxLinks from edge proxies and
+/// spreads them across the workers, which open a MuxTunnel per stream.
+///
+class MuxServer final : public QTcpServer {
+    Q_OBJECT
+
+  public:
+    explicit MuxServer(const QVector<ProxyWorker*>& workers, QObject* parent = nullptr);
+    ~MuxServer() override;
+
+  protected:
+    void incomingConnection(qintptr handle) override;
+
+  private:
+    QVector<ProxyWorker*> _workers;
+    int _next = 0;
+};
+
+///
+/// \brief The MuxTunnel class
+/// One stream of a MuxLink relayed to its origin: resolves and connects the
+/// "host:port" target the edge asked for, under this proxy's ACL, then moves
+/// bytes both ways with the stream's credit as back-pressure.
+///
+class MuxTunnel final : public QObject {
+    Q_OBJECT
+
+  public:
+    MuxTunnel(const QSharedPointer<MuxStream>& stream, const QByteArray& target, ProxyWorker& worker);
+    ~MuxTunnel() override;
+
+  private:
+    void resolved(const QList<QHostAddress>& addresses, quint16 port);
+    void connected(const QSharedPointer<QTcpSocket>& socket);
+    void readOrigin();
+    void acknowledge();
+    void originClosed();
+    void refuse(int statusCode);
+    void finish();
+
+    ProxyWorker& _worker;
+    const ConfigStore::Snapshot _snapshot;
+    const ProxyConfig& _config;
+    QSharedPointer<MuxStream> _stream;
+    QSharedPointer<QTcpSocket> _origin;
+    QByteArray _pending;  // received before the origin connected
+    qint64 _unacked     = 0;
+    int _socketProfile  = -1;  // of the ACL rule that let the target through
+    bool _originClosed  = false;
+    bool _finished      = false;
+};
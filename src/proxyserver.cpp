@@ -0,0 +1,1695 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "proxyserver.h"
+#include "muxserver.h"
+#include "socketutils.h"
+
+#ifdef Q_OS_LINUX
+# include <unistd.h>
+#endif // Q_OS_LINUX
+
+// key registry
+static constexpr auto kAddress                    = "Address";
+static constexpr auto kPort                       = "Port";
+static constexpr auto kEngine                     = "Engine";
+static constexpr auto kWorkers                    = "Workers";
+static constexpr auto kReusePort                  = "ReusePort";
+static constexpr auto kSplice                     = "Splice";
+static constexpr auto kMaxHeaderSize              = "MaxHeaderSize";
+static constexpr auto kUpstreamPool               = "UpstreamPool/Enabled";
+static constexpr auto kUpstreamPoolMaxIdlePerHost = "UpstreamPool/MaxIdlePerHost";
+static constexpr auto kUpstreamPoolMaxIdle        = "UpstreamPool/MaxIdle";
+static constexpr auto kUpstreamPoolIdleTimeout    = "UpstreamPool/IdleTimeout";
+static constexpr auto kConnectTimeout             = "ConnectTimeout";
+static constexpr auto kConnectAttemptDelay        = "ConnectAttemptDelay";
+static constexpr auto kHeaderReadTimeout          = "Timeouts/HeaderRead";
+static constexpr auto kIdleTimeout                = "Timeouts/Idle";
+static constexpr auto kReadBufferSize             = "Relay/ReadBufferSize";
+static constexpr auto kHighWatermark              = "Relay/HighWatermark";
+static constexpr auto kLowWatermark               = "Relay/LowWatermark";
+static constexpr auto kBatchWrites                = "Relay/BatchWrites";
+static constexpr auto kUringEntries               = "Uring/Entries";
+static constexpr auto kUringBuffers               = "Uring/Buffers";
+static constexpr auto kUringSqPoll                = "Uring/SqPoll";
+static constexpr auto kUringSqPollIdle            = "Uring/SqPollIdle";
+static constexpr auto kDnsCache                   = "DnsCache/Enabled";
+static constexpr auto kDnsCacheTtl                = "DnsCache/Ttl";
+static constexpr auto kDnsCacheNegativeTtl        = "DnsCache/NegativeTtl";
+static constexpr auto kDnsCacheMaxEntries         = "DnsCache/MaxEntries";
+static constexpr auto kCache                      = "Cache/Enabled";
+static constexpr auto kCacheMemorySize            = "Cache/MemorySize";
+static constexpr auto kCacheMaxObjectSize         = "Cache/MaxObjectSize";
+static constexpr auto kCacheDiskPath              = "Cache/DiskPath";
+static constexpr auto kCacheDiskSize              = "Cache/DiskSize";
+static constexpr auto kMetricsAddress             = "Metrics/Address";
+static constexpr auto kMetricsPort                = "Metrics/Port";
+static constexpr auto kAccessLogPath              = "AccessLog/Path";
+static constexpr auto kAccessLogFormat            = "AccessLog/Format";
+static constexpr auto kAccessLogSampleRate        = "AccessLog/SampleRate";
+static constexpr auto kAccessLogBufferSize        = "AccessLog/BufferSize";
+static constexpr auto kTracing                    = "Tracing/Enabled";
+static constexpr auto kTracingPath                = "Tracing/Path";
+static constexpr auto kTracingSampleRate          = "Tracing/SampleRate";
+static constexpr auto kHandoffPath                = "Handoff/Path";
+static constexpr auto kHandoffTimeout             = "Handoff/Timeout";
+static constexpr auto kDrainTimeout               = "Drain/Timeout";
+static constexpr auto kAclPath                    = "Acl/Path";
+static constexpr auto kAclDefault                 = "Acl/Default";
+static constexpr auto kConnectionRate             = "Limits/ConnectionRate";
+static constexpr auto kConnectionBurst            = "Limits/ConnectionBurst";
+static constexpr auto kMaxConnectionsPerClient    = "Limits/MaxConnectionsPerClient";
+static constexpr auto kConnectionBandwidth        = "Limits/ConnectionBandwidth";
+static constexpr auto kGlobalBandwidth            = "Limits/GlobalBandwidth";
+static constexpr auto kMaxConnections             = "Limits/MaxConnections";
+static constexpr auto kMaxLoopLag                 = "Limits/MaxLoopLag";
+static constexpr auto kOverloadAction             = "Limits/OverloadAction";
+static constexpr auto kParentHost                 = "Parent/Host";
+static constexpr auto kParentPort                 = "Parent/Port";
+static constexpr auto kParentLinks                = "Parent/Links";
+static constexpr auto kMuxAddress                 = "Mux/Address";
+static constexpr auto kMuxPort                    = "Mux/Port";
+static constexpr auto kMuxSecret                  = "Mux/Secret";
+static constexpr auto kSocket                     = "Socket/";  // profiles live at Socket/<name>/<option>
+static constexpr auto kNoDelay                    = "NoDelay";
+static constexpr auto kQuickAck                   = "QuickAck";
+static constexpr auto kFastOpen                   = "FastOpen";
+static constexpr auto kKeepAlive                  = "KeepAlive";
+static constexpr auto kSendBuffer                 = "SendBuffer";
+static constexpr auto kReceiveBuffer              = "ReceiveBuffer";
+static constexpr auto kKeepAliveIdle              = "KeepAliveIdle";
+static constexpr auto kKeepAliveInterval          = "KeepAliveInterval";
+static constexpr auto kKeepAliveCount             = "KeepAliveCount";
+static constexpr auto kConnect                    = "CONNECT";
+static constexpr auto kTickResolution             = 100;  // ms
+static constexpr auto kThrottleQuantum            = 4096;  // bytes a throttled side waits for
+static constexpr auto kLagInterval                = 50;  // ms between event loop lag probes
+static constexpr auto kServiceUnavailable         = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+WorkerPool::WorkerPool(const ProxyConfig& config, QObject* parent) : QObject(parent) {
+    auto workers = config.workers;
+
+    if (workers <= 0) {
+        workers = QThread::idealThreadCount();
+    }
+
+    for (auto i = 0; i < qMax(1, workers); ++i) {
+        auto thread = new QThread(this);
+        auto worker = new ProxyWorker(config);
+        worker->moveToThread(thread);
+        QObject::connect(thread, &QThread::finished, worker, &QObject::deleteLater);
+        thread->setObjectName(QStringLiteral("ProxyWorker-%1").arg(i));
+        thread->start();
+        _threads.append(thread);
+        _workers.append(worker);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    for (auto thread : qAsConst(_threads)) {
+        thread->quit();
+    }
+
+    for (auto thread : qAsConst(_threads)) {
+        thread->wait();
+    }
+}
+
+const QVector<ProxyWorker*>& WorkerPool::workers() const {
+    return _workers;
+}
+
+QMutex ProxyServer::_registryLock;
+QVector<ProxyServer*> ProxyServer::_registry;
+
+ProxyServer::ProxyServer(const QVector<ProxyWorker*>& workers, QObject* parent) : QTcpServer(parent), _workers{workers} {
+    QObject::connect(this, &ProxyServer::acceptError, [&](QAbstractSocket::SocketError err) {
+        qWarning() << errorString();
+    });
+
+    QMutexLocker locker(&_registryLock);
+    _registry.append(this);
+}
+
+ProxyServer::~ProxyServer() {
+    close();
+
+    QMutexLocker locker(&_registryLock);
+    _registry.removeOne(this);
+}
+
+bool ProxyServer::listenReusePort(const QHostAddress& address, quint16 port) {
+#ifdef Q_OS_LINUX
+    const auto fd = openListenSocket(address, port, true);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    if (!setSocketDescriptor(fd)) {
+        closeSocket(fd);
+        return false;
+    }
+
+    return true;
+#else // ifdef Q_OS_LINUX
+    return listen(address, port);
+#endif // Q_OS_LINUX
+}
+
+bool ProxyServer::rebind(const QHostAddress& address, quint16 port, bool reusePort) {
+    const auto previousAddress = serverAddress();
+    const auto previousPort    = serverPort();
+    close();
+
+    if (reusePort ? listenReusePort(address, port) : listen(address, port)) {
+        return true;
+    }
+
+    qWarning() << QStringLiteral("Cannot move the listener to") << QStringLiteral("%1:%2").arg(address.toString()).arg(port) << errorString();
+
+    if (!(reusePort ? listenReusePort(previousAddress, previousPort) : listen(previousAddress, previousPort))) {
+        qWarning() << QStringLiteral("Lost the listener on") << QStringLiteral("%1:%2").arg(previousAddress.toString()).arg(previousPort);
+    }
+
+    return false;
+}
+
+quint64 ProxyServer::acceptedConnections() const {
+    return _accepted.load(std::memory_order_relaxed);
+}
+
+QVector<quint64> ProxyServer::acceptCounters() {
+    QMutexLocker locker(&_registryLock);
+    QVector<quint64> result;
+    result.reserve(_registry.size());
+
+    for (auto server : qAsConst(_registry)) {
+        result.append(server->acceptedConnections());
+    }
+
+    return result;
+}
+
+void ProxyServer::incomingConnection(qintptr handle) {
+    _accepted.fetch_add(1, std::memory_order_relaxed);
+    Metrics::add(Metrics::Counter::Accepts);
+    auto worker        = nextWorker();
+    const auto config  = worker->config();
+    const auto& limits = config->rateLimits;
+    QHostAddress client;
+
+    // established tunnels come first, new work is shed before it is parsed or resolved
+    if (overloaded(*worker, limits)) {
+        if (!limits.pauseAccept) {
+            Metrics::add(Metrics::Counter::Shed);
+            refuseSocket(handle, QByteArray::fromRawData(kServiceUnavailable, static_cast<int>(qstrlen(kServiceUnavailable))));
+            return;
+        }
+
+        // this one is already out of the backlog, the ones behind it wait there until the load drops
+        if (!_resume || !_resume->isActive()) {
+            pause();
+        }
+    }
+
+    if (RateLimiter::limitsClients(limits)) {
+        client = peerAddress(handle);
+
+        if (!client.isNull() && !RateLimiter::admit(client, limits)) {
+            Metrics::add(Metrics::Counter::RateLimited);
+            closeSocket(handle);
+            return;
+        }
+    }
+
+    if (worker->thread() == QThread::currentThread()) {
+        worker->addConnection(handle, client);
+    } else {
+        // the socket must be adopted on the worker thread so it lives and dies there
+        QMetaObject::invokeMethod(worker, [worker, handle, client]() {
+            worker->addConnection(handle, client);
+        }, Qt::QueuedConnection);
+    }
+}
+
+ProxyWorker* ProxyServer::nextWorker() {
+    // least loaded worker, starting from a rotating index so ties are spread evenly
+    const auto count = _workers.size();
+    auto best = _workers.at(_next % count);
+
+    for (auto i = 1; i < count; ++i) {
+        auto worker = _workers.at((_next + i) % count);
+
+        if (worker->activeConnections() < best->activeConnections()) {
+            best = worker;
+        }
+    }
+
+    _next = (_next + 1) % count;
+    return best;
+}
+
+bool ProxyServer::overloaded(const ProxyWorker& worker, const RateLimits& limits) const {
+    if (limits.maxLoopLag > 0 && worker.loopLag() > limits.maxLoopLag) {
+        return true;
+    }
+
+    if (limits.maxConnections > 0) {
+        auto active = 0;
+
+        for (auto other : _workers) {
+            active += other->activeConnections();
+        }
+
+        return active >= limits.maxConnections;
+    }
+
+    return false;
+}
+
+void ProxyServer::pause() {
+    Metrics::add(Metrics::Counter::AcceptPauses);
+    pauseAccepting();
+
+    if (!_resume) {
+        _resume = new QTimer(this);
+        _resume->setInterval(kLagInterval);
+        QObject::connect(_resume, &QTimer::timeout, this, &ProxyServer::checkResume);
+    }
+
+    _resume->start();
+}
+
+void ProxyServer::checkResume() {
+    if (!isListening()) {
+        _resume->stop();
+        return;
+    }
+
+    for (auto worker : _workers) {
+        if (!overloaded(*worker, worker->config()->rateLimits)) {
+            _resume->stop();
+            resumeAccepting();
+            return;
+        }
+    }
+}
+
+ProxyWorker::ProxyWorker(const ProxyConfig& config, QObject* parent) : QObject(parent), _config{ConfigStore::Snapshot::create(config)},
+    _upstreamPool{config.upstreamPoolLimits, this}, _timingWheel{kTickResolution} {
+    if (auto store = ConfigStore::instance()) {
+        QObject::connect(store, &ConfigStore::reloaded, this, [this]() {
+            _upstreamPool.setLimits(this->config()->upstreamPoolLimits);
+            updateLagProbe();
+        });
+    }
+
+    if (config.muxOptions.parentPort != 0) {
+        _muxPool = new MuxPool(config.muxOptions, this);
+    }
+
+    _ticker = new QTimer(this);
+    _ticker->setInterval(kTickResolution);
+    QObject::connect(_ticker, &QTimer::timeout, this, [this]() {
+        _timingWheel.advance();
+
+        if (_timingWheel.size() == 0) {
+            _ticker->stop();
+        }
+    });
+
+    _lagProbe = new QTimer(this);
+    _lagProbe->setTimerType(Qt::PreciseTimer);
+    _lagProbe->setInterval(kLagInterval);
+    QObject::connect(_lagProbe, &QTimer::timeout, this, &ProxyWorker::probeLag);
+    updateLagProbe();
+}
+
+ProxyWorker::~ProxyWorker() = default;
+
+void ProxyWorker::addConnection(qintptr handle, const QHostAddress& client) {
+    if (auto socket = QSharedPointer<QTcpSocket>(new PooledTcpSocket, &QObject::deleteLater)) {
+        if (socket->setSocketDescriptor(handle)) {
+            tuneSocket(*socket, config()->socketTuning);
+            const auto id   = _connections.insert({});
+            auto connection = QSharedPointer<ProxyConnection>(new ProxyConnection(socket, id, *this, client), &QObject::deleteLater);
+            *_connections.find(id) = connection;
+            _active.store(_connections.size(), std::memory_order_relaxed);
+            QObject::connect(connection.get(), &ProxyConnection::terminated, this, &ProxyWorker::onConnectionTerminate);
+        } else {
+            qWarning() <<  QStringLiteral("Failed to set socket descriptor!") << socket->errorString();
+
+            if (!client.isNull()) {
+                RateLimiter::release(client);
+            }
+        }
+    }
+    qInfo() << QThread::currentThread()->objectName() << QStringLiteral("Active Connections: ") << _connections.size();
+}
+
+int ProxyWorker::activeConnections() const {
+    return _active.load(std::memory_order_relaxed);
+}
+
+int ProxyWorker::loopLag() const {
+    return _lag.load(std::memory_order_relaxed);
+}
+
+void ProxyWorker::probeLag() {
+    // a loop that is busy handling events fires the probe late, the lateness is the lag
+    const auto late = static_cast<int>(qMax<qint64>(0, _lagClock.restart() - kLagInterval));
+    const auto lag  = _lag.load(std::memory_order_relaxed);
+    _lag.store(late >= lag ? late : lag - (lag - late) / 4, std::memory_order_relaxed);
+}
+
+void ProxyWorker::updateLagProbe() {
+    if (config()->rateLimits.maxLoopLag > 0) {
+        if (!_lagProbe->isActive()) {
+            _lagClock.start();
+            _lagProbe->start();
+        }
+    } else {
+        _lagProbe->stop();
+        _lag.store(0, std::memory_order_relaxed);
+    }
+}
+
+ConfigStore::Snapshot ProxyWorker::config() const {
+    const auto store = ConfigStore::instance();
+    return store ? store->snapshot() : _config;
+}
+
+UpstreamPool& ProxyWorker::upstreamPool() {
+    return _upstreamPool;
+}
+
+TimingWheel& ProxyWorker::timingWheel() {
+    return _timingWheel;
+}
+
+MuxPool* ProxyWorker::muxPool() {
+    return _muxPool;
+}
+
+void ProxyWorker::addMuxLink(qintptr handle) {
+    auto socket = QSharedPointer<QTcpSocket>(new PooledTcpSocket, &QObject::deleteLater);
+
+    if (!socket->setSocketDescriptor(handle)) {
+        qWarning() <<  QStringLiteral("Failed to set socket descriptor!") << socket->errorString();
+        return;
+    }
+
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    socket->setSocketOption(QAbstractSocket::KeepAliveOption, 1);
+
+    auto link = new MuxLink(socket, MuxLink::Role::Server, config()->muxOptions.secret, this);
+    QObject::connect(link, &MuxLink::incoming, this, [this](const QSharedPointer<MuxStream>& stream, const QByteArray & target) {
+        new MuxTunnel(stream, target, *this);
+    });
+    QObject::connect(link, &MuxLink::lost, link, &QObject::deleteLater);
+}
+
+void ProxyWorker::schedule(TimingWheel::Timer& timer, qint64 msecs) {
+    _timingWheel.start(timer, msecs);
+
+    if (!_ticker->isActive()) {
+        _ticker->start();
+    }
+}
+
+void ProxyWorker::flushLater(QTcpSocket* socket) {
+    if (_flushes.isEmpty()) {
+        // posted events run after this iteration's socket notifiers, before the next poll
+        QMetaObject::invokeMethod(this, [this]() {
+            flushBatch();
+        }, Qt::QueuedConnection);
+    }
+
+    if (_flushes.isEmpty() || (_flushes.constLast() != socket)) {
+        _flushes.append(socket);
+    }
+}
+
+void ProxyWorker::flushBatch() {
+    QVector<QPointer<QTcpSocket>> flushes;
+    flushes.swap(_flushes);  // bytesWritten handlers may queue the next batch
+
+    for (const auto& socket : qAsConst(flushes)) {
+        if (socket && (socket->bytesToWrite() > 0)) {
+            Metrics::add(Metrics::Counter::Writes);
+            socket->flush();
+        }
+    }
+}
+
+void ProxyWorker::onConnectionTerminate(quint64 id) {
+    if (auto connection = _connections.take(id)) {
+        connection->blockSignals(true);
+        _active.store(_connections.size(), std::memory_order_relaxed);
+    }
+
+    qInfo() << QThread::currentThread()->objectName() << QStringLiteral("Active Connections: ") << _connections.size();
+}
+
+ProxyConnection::ProxyConnection(const QSharedPointer<QTcpSocket>& downStream, quint64 id, ProxyWorker& worker, const QHostAddress& client) :
+    _id{id}, _worker{worker}, _snapshot{worker.config()}, _config{*_snapshot},
+    _upBudget{_config.rateLimits.connectionBandwidth}, _downBudget{_config.rateLimits.connectionBandwidth}, _client{client},
+    _timer{[this]() { timeout(); }}, _downStream{downStream} {
+    Metrics::add(Metrics::Counter::ConnectionsOpened);
+    _started.start();
+    Tracer::begin(_trace);
+    _peerAddress = _downStream->peerAddress();
+    _peerPort    = _downStream->peerPort();
+
+    if (_config.headerReadTimeout > 0) {
+        _worker.schedule(_timer, _config.headerReadTimeout);
+    }
+
+    // a bounded read buffer lets TCP flow control push back on a paused sender
+    _downStream->setReadBufferSize(_config.readBufferSize);
+    QObject::connect(_downStream.get(), &QTcpSocket::readyRead,     this, &ProxyConnection::downStreamReadyRead);
+    QObject::connect(_downStream.get(), &QTcpSocket::bytesWritten,  this, &ProxyConnection::downStreamBytesWritten);
+    QObject::connect(_downStream.get(), &QTcpSocket::disconnected,  this, &ProxyConnection::terminate);
+    QObject::connect(_downStream.get(), qOverload<QAbstractSocket::SocketError>(&QTcpSocket::error), this, [this](QAbstractSocket::SocketError) {
+        qWarning() << QStringLiteral("DownStream error: ") << _downStream->errorString();
+    });
+}
+
+ProxyConnection::~ProxyConnection() {
+    if (!_client.isNull()) {
+        RateLimiter::release(_client);
+    }
+}
+
+void ProxyConnection::terminate() {
+    if (!_terminated) {
+        _terminated = true;
+        Metrics::add(Metrics::Counter::ConnectionsClosed);
+        Metrics::terminated(_termination);
+
+        if (_tunnelOpen) {
+            Metrics::add(Metrics::Counter::TunnelsClosed);
+        }
+
+        // a keep-alive client leaving between requests has nothing left to log
+        if ((_served == 0) || _headParsed || !_head.isEmpty()) {
+            writeAccessLog();
+            Tracer::finish(_trace, _id, _targetHost);
+        }
+    }
+
+    _worker.timingWheel().stop(_timer);
+    abandonCache();
+
+    if (_splice) {
+        _splice->blockSignals(true);
+    }
+
+    _downStream->blockSignals(true);
+    _downStream->disconnectFromHost();
+    _downStream->close();
+
+    if (_upStream) {
+        _upStream->blockSignals(true);
+        _upStream->disconnectFromHost();
+        _upStream->close();
+    }
+
+    if (_parentStream) {
+        QObject::disconnect(_parentStream.get(), nullptr, this, nullptr);
+        _parentStream->close();
+        _parentStream.reset();
+    }
+
+    Q_EMIT terminated(_id, QPrivateSignal{});
+}
+
+void ProxyConnection::downStreamReadyRead() {
+    _lastActivity = _started.elapsed();
+
+    if (_headParsed) {
+        if (queuedUpStream() >= _config.highWatermark) {
+            _downStreamPaused = true;
+            return;
+        }
+    }
+
+    if (_headParsed) {
+        if (_downStreamThrottled) {
+            return;
+        }
+
+        if (!_tunnel && _requestBody.complete()) {
+            // the next request waits in the socket until this response is done
+            return;
+        }
+
+        // relay through a recycled chunk rather than a fresh QByteArray per read
+        SlabPool::Buffer buffer(qMin<qint64>(_downStream->bytesAvailable(), _config.readBufferSize));
+
+        while (_downStream->bytesAvailable() > 0) {
+            const auto allowed = allowance(_upBudget, qMin(_downStream->bytesAvailable(), buffer.capacity()));
+
+            if (allowed == 0) {
+                throttle(_upBudget, false);
+                break;
+            }
+
+            const auto size = _downStream->read(buffer.data(), allowed);
+
+            if (size <= 0) {
+                break;
+            }
+
+            relayRequest(buffer.data(), size);
+        }
+
+        return;
+    }
+
+    readHead(_downStream->readAll());
+}
+
+void ProxyConnection::readHead(const QByteArray& data) {
+    using namespace httpparser;
+
+    // the head may arrive in any number of chunks, resume scanning where the last one ended
+    const auto fed = _head.size();
+    _head.append(data);
+    const auto end      = _head.indexOf("\r\n\r\n", qMax(0, fed - 3));
+    const auto headSize = (end < 0) ? _head.size() : (end + 4);
+
+    // a keep-alive request starts with its first byte, not with the idle gap before it
+    if ((fed == 0) && (_served > 0)) {
+        trace(Tracer::Stage::Started);
+    }
+
+    // a head that came in one go with its terminator is bound by the limit all the same
+    if ((end >= 0) && (headSize > _config.maxHeaderSize)) {
+        qWarning() << QStringLiteral("HttpRequest head exceeds") << _config.maxHeaderSize << QStringLiteral("bytes");
+        reject(431, "Request Header Fields Too Large");
+        return;
+    }
+
+    // a CONNECT that arrived whole needs nothing past its request line, the parser never runs
+    RequestLine line;
+    HttpTarget target;
+
+    if ((fed == 0) && (end >= 0) && line.scan(_head.constData(), headSize) && (line.method == RequestLine::Method::Connect)) {
+        target = connectTarget(line);
+    }
+
+    if (target.valid) {
+        _request.method       = kConnect;
+        _request.versionMajor = line.versionMajor;
+        _request.versionMinor = line.versionMinor;
+    } else {
+        const auto begin  = _head.constData() + fed;
+        const auto result = _parser.parse(_request, begin, _head.constData() + qMax(fed, headSize));
+
+        if (result == HttpRequestParser::ParsingError) {
+            qWarning() << QStringLiteral("HttpRequest parse failed!") << _head.constData();
+            Metrics::add(Metrics::Counter::ParseFailures);
+            fail(Metrics::Termination::ParseError);
+            return;
+        }
+
+        if (end < 0) {
+            if (_head.size() > _config.maxHeaderSize) {
+                qWarning() << QStringLiteral("HttpRequest head exceeds") << _config.maxHeaderSize << QStringLiteral("bytes");
+                reject(431, "Request Header Fields Too Large");
+            }
+
+            return;
+        }
+
+        line.method = RequestLine::methodOf(_request.method);
+
+        if (line.method != RequestLine::Method::Other) {
+            target = requestTarget(_request);
+        }
+    }
+
+    // feeding stops at the end of the head: a request with a body leaves the parser incomplete
+    _headParsed = true;
+    Metrics::add(Metrics::Counter::Requests);
+    trace(Tracer::Stage::HeadRead);
+
+    if (_config.connectTimeout > 0) {
+        // from here the clock covers resolving and connecting the upstream
+        _worker.schedule(_timer, _config.connectTimeout);
+    } else {
+        _worker.timingWheel().stop(_timer);
+    }
+
+    const auto rest = _head.mid(headSize);
+    _head.clear();
+    handleRequest(line.method, target);
+
+    if (!rest.isEmpty()) {
+        relayRequest(rest.constData(), rest.size());
+    }
+}
+
+void ProxyConnection::handleRequest(RequestLine::Method method, const HttpTarget& target) {
+    const auto& request = _request;
+
+    if (method != RequestLine::Method::Other) {
+        if (!target.valid) {
+            qWarning() << QStringLiteral("Invaid URI found!");
+            reject(400, "Bad Request");
+            return;
+        }
+
+        _tunnel          = (method == RequestLine::Method::Connect);
+        _clientKeepAlive = !_tunnel && !_worker.muxPool() && isPersistent(request);
+        _targetHost      = target.host;
+        _targetPort      = target.port;
+
+        // before any lookup, a blocked name never costs a DNS query
+        auto profile = -1;
+
+        if (_config.acl && (_config.acl->check(target.host, &profile) == Acl::Action::Deny)) {
+            qWarning() << QStringLiteral("Target denied by ACL:") << target.host;
+            reject(403, "Forbidden", Metrics::Termination::Denied);
+            return;
+        }
+
+        if (profile != _socketProfile) {
+            // the client side follows the target's profile too, back to the base one after it
+            _socketProfile = profile;
+            tuneSocket(*_downStream, _config.tuning(profile));
+        }
+
+        if (!_tunnel) {
+            auto mode   = BodyFramer::Mode::None;
+            auto length = qint64{0};
+
+            if (!requestBodyMode(request, mode, length)) {
+                reject(400, "Bad Request");
+                return;
+            }
+
+            _requestBody.reset(mode, length);
+            _pending = forwardHead(request, target, _config.upstreamPool && !_worker.muxPool());
+        }
+
+        if (_worker.muxPool()) {
+            // the parent resolves and connects, what goes through it is a plain byte stream
+            _tunnel = true;
+            openParentStream(target.host, target.port);
+            return;
+        }
+
+        if (!_tunnel && ResponseCache::instance()) {
+            _cacheKey = ResponseCache::key(target.authority, target.path);
+            consultCache();
+            return;
+        }
+
+        resolveUpStream();
+    } else {
+        reject(501, "Not Implemented");
+    }
+}
+
+void ProxyConnection::consultCache() {
+    const auto cache = ResponseCache::instance();
+    ResponseCache::EntryPtr entry;
+    const auto result = cache->lookup(_cacheKey, _request, entry, this, [this](const ResponseCache::EntryPtr & stored) {
+        if (_terminated) {
+            return;
+        }
+
+        // the fetch we waited for either stored something to look at or goes uncached for everyone
+        if (stored) {
+            consultCache();
+        } else {
+            _cacheKey.clear();
+            resolveUpStream();
+        }
+    });
+
+    switch (result) {
+        case ResponseCache::Result::Hit:
+            // served from the event loop, the rest of the read that carried this head is still being handled
+            QMetaObject::invokeMethod(this, [this, entry]() {
+                if (!_terminated) {
+                    serveCached(*entry);
+                }
+            }, Qt::QueuedConnection);
+            break;
+
+        case ResponseCache::Result::Wait:
+            break;
+
+        case ResponseCache::Result::Stale:
+            // ahead of the blank line that ends the forwarded head
+            _pending.insert(_pending.size() - 2, ResponseCache::conditions(*entry));
+            _cacheStale = entry;
+            Q_FALLTHROUGH();
+
+        case ResponseCache::Result::Miss:
+            _cacheFetching = true;
+            _requestTime   = QDateTime::currentMSecsSinceEpoch();
+            resolveUpStream();
+            break;
+
+        case ResponseCache::Result::Bypass:
+            _cacheKey.clear();
+            resolveUpStream();
+            break;
+    }
+}
+
+void ProxyConnection::serveCached(const ResponseCache::Entry& entry) {
+    const auto response = ResponseCache::render(entry, _clientKeepAlive);
+    _status             = static_cast<quint16>(entry.response.statusCode);
+    _bytesDown += static_cast<quint64>(response.size());
+    Metrics::add(Metrics::Counter::BytesDown, static_cast<quint64>(response.size()));
+    _downStream->write(response);
+    _downStream->flush();
+    trace(Tracer::Stage::Responded);
+    finishRequest();
+}
+
+void ProxyConnection::abandonCache() {
+    if (_cacheFetching) {
+        ResponseCache::instance()->abandon(_cacheKey);
+    }
+
+    _cacheFetching = false;
+    _cacheKey.clear();
+    _cacheStale.reset();
+    _cacheEntry.reset();
+}
+
+void ProxyConnection::resolveUpStream() {
+    QElapsedTimer clock;
+    clock.start();
+
+    const auto port     = _targetPort;
+    const auto resolved = [this, port, clock](const QList<QHostAddress>& addresses) {
+        Metrics::observe(Metrics::Histogram::DnsLatency, clock.nsecsElapsed() / 1000);
+        trace(Tracer::Stage::Resolved);
+        const auto permitted = _config.acl ? _config.acl->permitted(addresses) : addresses;
+
+        if (!permitted.isEmpty()) {
+            connectUpStream(permitted, port);
+        } else if (!addresses.isEmpty()) {
+            qWarning() << QStringLiteral("Target addresses denied by ACL:") << _targetHost;
+            reject(403, "Forbidden", Metrics::Termination::Denied);
+        } else {
+            qWarning() << QStringLiteral("HostLookup failed!");
+            reject(502, "Bad Gateway", Metrics::Termination::DnsFailed);
+        }
+    };
+
+    if (auto cache = DnsCache::instance()) {
+        cache->lookup(_targetHost, this, resolved);
+    } else {
+        QHostInfo::lookupHost(_targetHost, this, [resolved](const QHostInfo & info) {
+            resolved(info.addresses());
+        });
+    }
+}
+
+void ProxyConnection::connectUpStream(const QList<QHostAddress>& addresses, quint16 port) {
+    _upStreamPort = port;
+    const auto sorted = UpstreamConnector::sortAddresses(addresses);
+
+    if (!_tunnel && _config.upstreamPool) {
+        for (const auto& address : sorted) {
+            if (auto socket = _worker.upstreamPool().acquire(address, port)) {
+                _upStreamAddress = address;
+                tuneSocket(*socket, _config.tuning(_socketProfile));  // may have served another profile
+                attachUpStream(socket);
+                upStreamConnected();
+                return;
+            }
+        }
+    }
+
+    QElapsedTimer clock;
+    clock.start();
+
+    // the overall deadline is the connection's timer, the connector only paces its attempts
+    auto connector = new UpstreamConnector(sorted, port, _config.connectAttemptDelay, 0, _config.tuning(_socketProfile), this);
+    _connector     = connector;
+    QObject::connect(connector, &UpstreamConnector::connected, this,
+    [this, connector, clock](const QSharedPointer<QTcpSocket>& socket, const QHostAddress & address) {
+        Metrics::observe(Metrics::Histogram::ConnectLatency, clock.nsecsElapsed() / 1000);
+        connector->deleteLater();
+        _connector = nullptr;
+        _upStreamAddress = address;
+        attachUpStream(socket);
+        upStreamConnected();
+    });
+    QObject::connect(connector, &UpstreamConnector::failed, this, [this, connector](const QString & reason, bool timedOut) {
+        connector->deleteLater();
+        _connector = nullptr;
+        qWarning() << QStringLiteral("UpStream connect failed:") << reason;
+
+        if (timedOut) {
+            reject(504, "Gateway Timeout", Metrics::Termination::UpstreamTimeout);
+        } else {
+            reject(502, "Bad Gateway", Metrics::Termination::UpstreamFailed);
+        }
+    });
+    connector->start();
+}
+
+void ProxyConnection::openParentStream(const QString& host, quint16 port) {
+    _parentStream = _worker.muxPool()->open(host, port);
+
+    if (!_parentStream) {
+        qWarning() << QStringLiteral("No link to the parent proxy");
+        reject(502, "Bad Gateway", Metrics::Termination::UpstreamFailed);
+        return;
+    }
+
+    const auto stream = _parentStream.get();
+    QObject::connect(stream, &MuxStream::opened,       this, &ProxyConnection::upStreamConnected);
+    QObject::connect(stream, &MuxStream::bytesWritten, this, &ProxyConnection::upStreamBytesWritten);
+    QObject::connect(stream, &MuxStream::refused, this, [this](int statusCode) {
+        qWarning() << QStringLiteral("Parent proxy refused the target:") << statusCode;
+
+        switch (statusCode) {
+            case 403:
+                reject(403, "Forbidden", Metrics::Termination::Denied);
+                break;
+
+            case 504:
+                reject(504, "Gateway Timeout", Metrics::Termination::UpstreamTimeout);
+                break;
+
+            default:
+                reject(502, "Bad Gateway", Metrics::Termination::UpstreamFailed);
+                break;
+        }
+    });
+    QObject::connect(stream, &MuxStream::received, this, [this](const char* data, qint64 size) {
+        _lastActivity = _started.elapsed();
+        _bytesDown += static_cast<quint64>(size);
+        Metrics::add(Metrics::Counter::BytesDown, static_cast<quint64>(size));
+        _downStream->write(data, size);
+        flush(*_downStream);
+        _parentUnacked += size;
+        downStreamBytesWritten();
+    });
+    QObject::connect(stream, &MuxStream::closed, this, [this]() {
+        if (!_relaying) {
+            qWarning() << QStringLiteral("Parent proxy link lost");
+            reject(502, "Bad Gateway", Metrics::Termination::UpstreamFailed);
+            return;
+        }
+
+        _upStreamClosed = true;
+        finishUpStream();
+    });
+}
+
+void ProxyConnection::attachUpStream(const QSharedPointer<QTcpSocket>& socket) {
+    _upStream = socket;
+    _upStream->setReadBufferSize(_config.readBufferSize);
+    QObject::connect(_upStream.get(), &QTcpSocket::connected,     this, &ProxyConnection::upStreamConnected);
+    QObject::connect(_upStream.get(), &QTcpSocket::bytesWritten,  this, &ProxyConnection::upStreamBytesWritten);
+    QObject::connect(_upStream.get(), &QTcpSocket::disconnected,  this, &ProxyConnection::upStreamDisconnected);
+    QObject::connect(_upStream.get(), &QTcpSocket::readyRead,     this, &ProxyConnection::upStreamReadyRead);
+    QObject::connect(_upStream.get(), qOverload<QAbstractSocket::SocketError>(&QTcpSocket::error), this, [this](QAbstractSocket::SocketError) {
+        qWarning() << QStringLiteral("UpStream error: ") << _upStream->errorString();
+    });
+}
+
+void ProxyConnection::releaseUpStream(bool reusable) {
+    auto socket = _upStream;
+    QObject::disconnect(socket.get(), nullptr, this, nullptr);
+    _upStream.reset();
+    _upStreamReady = false;
+
+    if (reusable) {
+        _worker.upstreamPool().release(_upStreamAddress, _upStreamPort, socket);
+    } else {
+        socket->disconnectFromHost();
+    }
+}
+
+void ProxyConnection::upStreamConnected() {
+    trace(Tracer::Stage::Connected);
+    _upStreamReady = true;
+    _relaying      = true;
+    _lastActivity  = _started.elapsed();
+
+    if (_config.idleTimeout > 0) {
+        _worker.schedule(_timer, _config.idleTimeout);
+    } else {
+        _worker.timingWheel().stop(_timer);
+    }
+
+    if (!_pending.isEmpty()) {
+        sendUpStream(_pending.constData(), _pending.size());
+        _pending.clear();
+    }
+
+    if (RequestLine::methodOf(_request.method) == RequestLine::Method::Connect) {
+        const auto response = QStringLiteral("HTTP/%1.%2 200 Connection established\r\nProxy-agent: %3/%4\r\n\r\n")
+                              .arg(_request.versionMajor)
+                              .arg(_request.versionMinor)
+                              .arg(qApp->applicationName())
+                              .arg(qApp->applicationVersion());
+        _downStream->write(response.toLatin1());
+        _downStream->flush();
+        trace(Tracer::Stage::Responded);
+        _tunnelOpen = true;
+        _status     = 200;
+        Metrics::add(Metrics::Counter::TunnelsOpened);
+
+        // the kernel relay bypasses the bandwidth budgets
+        const auto& limits = _config.rateLimits;
+
+        if (_upStream && _config.splice && SpliceRelay::isSupported() && (limits.connectionBandwidth == 0) && (limits.globalBandwidth == 0)) {
+            startSplice();
+        }
+    }
+}
+
+void ProxyConnection::upStreamDisconnected() {
+    // relay what is still buffered, a paused relay finishes once the client drains it
+    _upStreamClosed = true;
+    upStreamReadyRead();
+
+    if (!_upStreamPaused && !_upStreamThrottled) {
+        finishUpStream();
+    }
+}
+
+void ProxyConnection::finishUpStream() {
+    if (_upStream && !_tunnel && _responseHeadParsed && (_responseBody.mode() != BodyFramer::Mode::UntilClose)) {
+        qWarning() << QStringLiteral("UpStream closed before the response was complete");
+    }
+
+    // let the client receive everything relayed so far; its disconnect terminates us
+    if (_downStream->state() == QAbstractSocket::ConnectedState) {
+        _downStream->disconnectFromHost();
+    } else {
+        terminate();
+    }
+}
+
+void ProxyConnection::relayRequest(const char* data, qint64 size) {
+    auto consumed = size;
+
+    if (!_tunnel) {
+        // only the current request's body goes upstream, the connection is closed after its response
+        consumed = _requestBody.consume(data, size);
+
+        if (_requestBody.failed()) {
+            reject(400, "Bad Request");
+            return;
+        }
+
+        if (consumed < size) {
+            // pipelined, handled once the current response is complete
+            _head.append(data + consumed, static_cast<int>(size - consumed));
+        }
+    }
+
+    if (consumed == 0) {
+        return;
+    }
+
+    _bytesUp += static_cast<quint64>(consumed);
+    Metrics::add(Metrics::Counter::BytesUp, static_cast<quint64>(consumed));
+
+    if (_upStreamReady) {
+        sendUpStream(data, consumed);
+    } else {
+        _pending.append(data, static_cast<int>(consumed));
+    }
+}
+
+void ProxyConnection::sendUpStream(const char* data, qint64 size) {
+    if (_parentStream) {
+        _parentStream->write(data, size);
+    } else {
+        _upStream->write(data, size);
+        flush(*_upStream);
+    }
+}
+
+void ProxyConnection::flush(QTcpSocket& socket) {
+    if (_config.batchWrites) {
+        _worker.flushLater(&socket);
+        return;
+    }
+
+    Metrics::add(Metrics::Counter::Writes);
+    socket.flush();
+}
+
+qint64 ProxyConnection::queuedUpStream() const {
+    if (!_upStreamReady) {
+        return _pending.size();
+    }
+
+    return _parentStream ? _parentStream->bytesToWrite() : _upStream->bytesToWrite();
+}
+
+void ProxyConnection::upStreamReadyRead() {
+    if (!_upStream) {
+        return;
+    }
+
+    _lastActivity = _started.elapsed();
+
+    if (_downStream->bytesToWrite() >= _config.highWatermark) {
+        _upStreamPaused = true;
+        return;
+    }
+
+    if (_upStreamThrottled) {
+        return;
+    }
+
+    SlabPool::Buffer buffer(qMin<qint64>(_upStream->bytesAvailable(), _config.readBufferSize));
+
+    // the response may hand the socket back to the pool half way through
+    while (_upStream && (_upStream->bytesAvailable() > 0)) {
+        const auto allowed = allowance(_downBudget, qMin(_upStream->bytesAvailable(), buffer.capacity()));
+
+        if (allowed == 0) {
+            throttle(_downBudget, true);
+            break;
+        }
+
+        const auto size = _upStream->read(buffer.data(), allowed);
+
+        if (size <= 0) {
+            break;
+        }
+
+        _bytesDown += static_cast<quint64>(size);
+        Metrics::add(Metrics::Counter::BytesDown, static_cast<quint64>(size));
+
+        if (_tunnel) {
+            _downStream->write(buffer.data(), size);
+            flush(*_downStream);
+        } else {
+            relayResponse(buffer.data(), size);
+        }
+    }
+}
+
+void ProxyConnection::downStreamBytesWritten() {
+    if (_parentStream && (_parentUnacked > 0) && (_downStream->bytesToWrite() <= _config.lowWatermark)) {
+        // the parent holds further data back until the client took what it sent
+        _parentStream->consumed(_parentUnacked);
+        _parentUnacked = 0;
+    }
+
+    if (_upStreamPaused && (_downStream->bytesToWrite() <= _config.lowWatermark)) {
+        _upStreamPaused = false;
+        upStreamReadyRead();
+
+        if (_upStreamClosed && !_upStreamPaused && !_upStreamThrottled) {
+            finishUpStream();
+        }
+    }
+}
+
+void ProxyConnection::upStreamBytesWritten() {
+    if (_downStreamPaused && (queuedUpStream() <= _config.lowWatermark)) {
+        _downStreamPaused = false;
+        downStreamReadyRead();
+    }
+}
+
+void ProxyConnection::relayResponse(const char* data, qint64 size) {
+    using namespace httpparser;
+
+    qint64 offset = 0;
+
+    while ((offset < size) && _upStream) {
+        if (_tunnel) {
+            _downStream->write(data + offset, size - offset);
+            flush(*_downStream);
+            return;
+        }
+
+        if (!_responseHeadParsed) {
+            const auto fed = _responseHead.size();
+            _responseHead.append(data + offset, static_cast<int>(size - offset));
+            const auto end = _responseHead.indexOf("\r\n\r\n", qMax(0, fed - 3));
+
+            if (end < 0) {
+                if (_responseHead.size() > _config.maxHeaderSize) {
+                    qWarning() << QStringLiteral("HttpResponse head exceeds") << _config.maxHeaderSize << QStringLiteral("bytes");
+                    fail(Metrics::Termination::UpstreamError);
+                }
+
+                return;
+            }
+
+            const auto headSize = end + 4;
+            offset += headSize - fed;
+
+            _response = Response();
+            HttpResponseParser parser;
+
+            if (parser.parse(_response, _responseHead.constData(), _responseHead.constData() + headSize) == HttpResponseParser::ParsingError) {
+                qWarning() << QStringLiteral("HttpResponse parse failed!") << _responseHead.constData();
+                Metrics::add(Metrics::Counter::ParseFailures);
+                fail(Metrics::Termination::UpstreamError);
+                return;
+            }
+
+            trace(Tracer::Stage::Responded);
+
+            if (_response.statusCode == 101) {
+                // protocol switch, from here on both sides talk whatever they agreed on
+                _status = 101;
+                _downStream->write(_responseHead.constData(), headSize);
+                _responseHead.clear();
+                _tunnel = true;
+                continue;
+            }
+
+            if ((_response.statusCode >= 100) && (_response.statusCode < 200)) {
+                // interim response, the final one follows
+                _downStream->write(_responseHead.constData(), headSize);
+                _responseHead.clear();
+                continue;
+            }
+
+            _responseHead.clear();
+
+            auto mode   = BodyFramer::Mode::None;
+            auto length = qint64{0};
+
+            if (!responseBodyMode(_response, _request.method, mode, length)) {
+                qWarning() << QStringLiteral("HttpResponse has an invalid Content-Length");
+                fail(Metrics::Termination::UpstreamError);
+                return;
+            }
+
+            _responseBody.reset(mode, length);
+            _status             = static_cast<quint16>(_response.statusCode);
+            _upStreamKeepAlive  = isPersistent(_response) && (mode != BodyFramer::Mode::UntilClose);
+            _clientKeepAlive    = _clientKeepAlive && (mode != BodyFramer::Mode::UntilClose);
+            _responseHeadParsed = true;
+
+            if (_cacheStale && (_response.statusCode == 304)) {
+                // the stored body is still current, the client gets it with the refreshed head
+                const auto entry    = ResponseCache::instance()->refresh(_cacheKey, _cacheStale, _response,
+                                      _requestTime, QDateTime::currentMSecsSinceEpoch());
+                const auto reusable = _config.upstreamPool && _upStreamKeepAlive && (offset == size) && (_upStream->bytesAvailable() == 0);
+                _cacheFetching      = false;
+                releaseUpStream(reusable);
+                serveCached(*entry);
+                return;
+            }
+
+            if (_cacheFetching) {
+                _cacheEntry = ResponseCache::instance()->prepare(_request, _response, _requestTime, QDateTime::currentMSecsSinceEpoch());
+
+                if (!_cacheEntry || (mode == BodyFramer::Mode::UntilClose)) {
+                    abandonCache();
+                }
+            }
+
+            _downStream->write(responseHead(_response, _clientKeepAlive));
+        } else {
+            const auto consumed = _responseBody.consume(data + offset, size - offset);
+
+            if (_responseBody.failed()) {
+                qWarning() << QStringLiteral("HttpResponse body framing failed!");
+                fail(Metrics::Termination::UpstreamError);
+                return;
+            }
+
+            if (_cacheEntry) {
+                if (ResponseCache::instance()->fits(_cacheEntry->body.size() + consumed)) {
+                    _cacheEntry->body.append(data + offset, static_cast<int>(consumed));
+                } else {
+                    abandonCache();
+                }
+            }
+
+            _downStream->write(data + offset, consumed);
+            offset += consumed;
+        }
+
+        if (_responseHeadParsed && _responseBody.complete()) {
+            if (_cacheEntry) {
+                ResponseCache::instance()->store(_cacheKey, _cacheEntry);
+                _cacheFetching = false;
+            }
+
+            // anything the origin sends past the response makes the socket unusable
+            const auto reusable = _config.upstreamPool && _upStreamKeepAlive && _requestBody.complete()
+                                  && (offset == size) && (_upStream->bytesAvailable() == 0);
+            releaseUpStream(reusable);
+            _downStream->flush();
+            finishRequest();
+            return;
+        }
+    }
+
+    flush(*_downStream);
+}
+
+void ProxyConnection::finishRequest() {
+    const auto lifecycle = Lifecycle::instance();
+
+    // an early response leaves the rest of the request body unframed on the wire
+    if (!_clientKeepAlive || !_requestBody.complete() || (lifecycle && lifecycle->draining())) {
+        _downStream->disconnectFromHost();
+        return;
+    }
+
+    writeAccessLog();
+    Tracer::finish(_trace, _id, _targetHost);
+    ++_served;
+
+    // everything below describes one request, the client connection and its budgets stay
+    _request            = httpparser::Request();
+    _parser             = httpparser::HttpRequestParser();
+    _response           = httpparser::Response();
+    _requestBody        = BodyFramer();
+    _responseBody       = BodyFramer();
+    _headParsed         = false;
+    _responseHeadParsed = false;
+    _clientKeepAlive    = false;
+    _upStreamKeepAlive  = false;
+    _upStreamClosed     = false;
+    _downStreamPaused   = false;
+    _upStreamPaused     = false;
+    _relaying           = false;
+    _termination        = Metrics::Termination::Closed;
+    _targetHost.clear();
+    _targetPort = 0;
+    _status     = 0;
+    _bytesUp    = 0;
+    _bytesDown  = 0;
+    _pending.clear();
+    _responseHead.clear();
+    abandonCache();
+    _started.start();
+    Tracer::begin(_trace);
+    _lastActivity = 0;
+
+    if (_config.headerReadTimeout > 0) {
+        _worker.schedule(_timer, _config.headerReadTimeout);
+    } else {
+        _worker.timingWheel().stop(_timer);
+    }
+
+    // a pipelined head may already be here, in full or in part
+    const auto next = _head;
+    _head.clear();
+
+    if (!next.isEmpty()) {
+        readHead(next);
+    }
+
+    if (!_terminated) {
+        downStreamReadyRead();
+    }
+}
+
+void ProxyConnection::reject(int statusCode, const char* reason, Metrics::Termination termination) {
+    _termination = termination;
+    _status      = static_cast<quint16>(statusCode);
+    const auto response = QStringLiteral("HTTP/1.1 %1 %2\r\nContent-Length: 0\r\nConnection: close\r\n\r\n")
+                          .arg(statusCode)
+                          .arg(QLatin1String(reason));
+    _downStream->write(response.toLatin1());
+    _downStream->flush();
+    terminate();
+}
+
+void ProxyConnection::fail(Metrics::Termination termination) {
+    _termination = termination;
+    terminate();
+}
+
+void ProxyConnection::writeAccessLog() {
+    auto log = AccessLog::instance();
+
+    if (!log || !log->sample()) {
+        return;
+    }
+
+    AccessLog::Record record;
+    record.timestamp = QDateTime::currentMSecsSinceEpoch();
+    record.duration  = _started.nsecsElapsed() / 1000;
+    record.bytesUp   = _bytesUp;
+    record.bytesDown = _bytesDown;
+    record.port      = _targetPort;
+    record.status    = _status;
+    record.result    = static_cast<quint8>(_termination);
+    record.setClient(_peerAddress, _peerPort);
+    record.setMethod(_request.method);
+    record.setHost(_targetHost);
+    log->push(record);
+}
+
+void ProxyConnection::timeout() {
+    if (!_headParsed && (_served > 0) && _head.isEmpty()) {
+        // an idle keep-alive connection, nothing to answer
+        fail(Metrics::Termination::Closed);
+        return;
+    }
+
+    if (!_headParsed) {
+        qWarning() << QStringLiteral("HttpRequest head not received within") << _config.headerReadTimeout << QStringLiteral("ms");
+        reject(408, "Request Timeout", Metrics::Termination::Timeout);
+        return;
+    }
+
+    if (!_relaying) {
+        if (_connector) {
+            QObject::disconnect(_connector, nullptr, this, nullptr);
+            _connector->deleteLater();
+            _connector = nullptr;
+        }
+
+        qWarning() << QStringLiteral("UpStream not connected within") << _config.connectTimeout << QStringLiteral("ms");
+        reject(504, "Gateway Timeout", Metrics::Termination::UpstreamTimeout);
+        return;
+    }
+
+    // activity only stamps _lastActivity, the timer is re-armed here for whatever is left
+    const auto spliced = _splice ? (_splice->bytesUp() + _splice->bytesDown()) : 0;
+
+    if (spliced != _splicedBytes) {
+        _splicedBytes = spliced;
+        _lastActivity = _started.elapsed();
+    }
+
+    const auto quiet = _started.elapsed() - _lastActivity;
+
+    if (quiet < _config.idleTimeout) {
+        _worker.schedule(_timer, _config.idleTimeout - quiet);
+        return;
+    }
+
+    fail(Metrics::Termination::Timeout);
+}
+
+qint64 ProxyConnection::allowance(TokenBucket& budget, qint64 wanted) {
+    const auto granted = budget.take(wanted);
+    const auto rate    = _config.rateLimits.globalBandwidth;
+
+    if ((granted == 0) || (rate == 0)) {
+        return granted;
+    }
+
+    const auto global = RateLimiter::takeGlobal(granted, rate);
+    budget.refund(granted - global);
+    return global;
+}
+
+void ProxyConnection::throttle(TokenBucket& budget, bool upStream) {
+    auto& throttled = upStream ? _upStreamThrottled : _downStreamThrottled;
+
+    if (throttled) {
+        return;
+    }
+
+    // nothing refills the buckets, the side just retries once enough budget should be there
+    const auto wanted = qMin<qint64>(kThrottleQuantum, _config.readBufferSize);
+    auto wait         = budget.delay(wanted);
+
+    if (_config.rateLimits.globalBandwidth > 0) {
+        wait = qMax(wait, RateLimiter::globalDelay(wanted));
+    }
+
+    throttled = true;
+    QTimer::singleShot(static_cast<int>(qMax<qint64>(1, wait)), Qt::PreciseTimer, this, [this, upStream]() {
+        (upStream ? _upStreamThrottled : _downStreamThrottled) = false;
+
+        if (_terminated) {
+            return;
+        }
+
+        if (upStream) {
+            upStreamReadyRead();
+
+            if (_upStreamClosed && !_upStreamPaused && !_upStreamThrottled) {
+                finishUpStream();
+            }
+        } else {
+            downStreamReadyRead();
+        }
+    });
+}
+
+void ProxyConnection::startSplice() {
+#ifdef Q_OS_LINUX
+    // whatever Qt has buffered on either side must leave through the copy path first
+    if (_downStream->bytesAvailable() > 0) {
+        const auto data = _downStream->readAll();
+        _bytesUp += static_cast<quint64>(data.size());
+        Metrics::add(Metrics::Counter::BytesUp, static_cast<quint64>(data.size()));
+        _upStream->write(data);
+        _upStream->flush();
+    }
+
+    if (_upStream->bytesAvailable() > 0) {
+        const auto data = _upStream->readAll();
+        _bytesDown += static_cast<quint64>(data.size());
+        Metrics::add(Metrics::Counter::BytesDown, static_cast<quint64>(data.size()));
+        _downStream->write(data);
+        _downStream->flush();
+    }
+
+    for (const auto& socket : {_downStream, _upStream}) {
+        if (socket->bytesToWrite() > 0) {
+            QObject::connect(socket.get(), &QTcpSocket::bytesWritten, this, [this, socket]() {
+                if (socket->bytesToWrite() == 0) {
+                    QObject::disconnect(socket.get(), &QTcpSocket::bytesWritten, this, nullptr);
+                    startSplice();
+                }
+            });
+            return;
+        }
+    }
+
+    // keep duplicates of the descriptors and let the QTcpSockets go
+    const auto downStream = ::dup(static_cast<int>(_downStream->socketDescriptor()));
+    const auto upStream   = ::dup(static_cast<int>(_upStream->socketDescriptor()));
+
+    if ((downStream < 0) || (upStream < 0)) {
+        qWarning() << QStringLiteral("dup() failed, keeping the copy relay");
+
+        if (downStream >= 0) {
+            ::close(downStream);
+        }
+
+        if (upStream >= 0) {
+            ::close(upStream);
+        }
+
+        return;
+    }
+
+    _downStream->blockSignals(true);
+    _upStream->blockSignals(true);
+    _downStream->abort();
+    _upStream->abort();
+
+    _splice = new SpliceRelay(downStream, upStream, this);
+    QObject::connect(_splice, &SpliceRelay::finished, this, [this]() {
+        _bytesUp   += _splice->bytesUp();
+        _bytesDown += _splice->bytesDown();
+        Metrics::add(Metrics::Counter::BytesUp, _splice->bytesUp());
+        Metrics::add(Metrics::Counter::BytesDown, _splice->bytesDown());
+        terminate();
+    });
+
+    if (!_splice->start()) {
+        terminate();
+    }
+
+#endif // Q_OS_LINUX
+}
+
+///
+/// Reads the socket options under \a prefix over \a base, \a fill writes the missing ones back.
+///
+static SocketTuning readTuning(Settings& settings, const QString& prefix, const SocketTuning& base, bool fill) {
+    const auto get = [&](const char* key, const QVariant& defaultValue) {
+        const auto name = prefix + QLatin1String(key);
+        return fill ? settings.read(name, defaultValue) : settings.value(name, defaultValue);
+    };
+
+    SocketTuning tuning;
+    tuning.noDelay           = get(kNoDelay, base.noDelay).toBool();
+    tuning.quickAck          = get(kQuickAck, base.quickAck).toBool();
+    tuning.fastOpen          = get(kFastOpen, base.fastOpen).toBool();
+    tuning.keepAlive         = get(kKeepAlive, base.keepAlive).toBool();
+    tuning.sendBuffer        = get(kSendBuffer, base.sendBuffer).toInt();
+    tuning.receiveBuffer     = get(kReceiveBuffer, base.receiveBuffer).toInt();
+    tuning.keepAliveIdle     = get(kKeepAliveIdle, base.keepAliveIdle).toInt();
+    tuning.keepAliveInterval = get(kKeepAliveInterval, base.keepAliveInterval).toInt();
+    tuning.keepAliveCount    = get(kKeepAliveCount, base.keepAliveCount).toInt();
+    return tuning;
+}
+
+const SocketTuning& ProxyConfig::tuning(int profile) const {
+    return ((profile >= 0) && (profile < socketProfiles.size())) ? socketProfiles.at(profile) : socketTuning;
+}
+
+ProxyConfig ProxyConfig::load(Settings& settings) {
+    ProxyConfig config;
+    config.address             = QHostAddress(settings.read(kAddress, config.address.toString()).toString());
+    config.port                = static_cast<quint16>(settings.read(kPort, config.port).toInt());
+    config.engine              = settings.read(kEngine, config.engine).toString().toLower();
+    config.workers             = settings.read(kWorkers, config.workers).toInt();
+    config.reusePort           = settings.read(kReusePort, config.reusePort).toBool();
+    config.splice              = settings.read(kSplice, config.splice).toBool();
+    config.maxHeaderSize       = settings.read(kMaxHeaderSize, config.maxHeaderSize).toInt();
+    config.upstreamPool        = settings.read(kUpstreamPool, config.upstreamPool).toBool();
+    config.dnsCache            = settings.read(kDnsCache, config.dnsCache).toBool();
+    config.responseCache       = settings.read(kCache, config.responseCache).toBool();
+    config.connectTimeout      = settings.read(kConnectTimeout, config.connectTimeout).toInt();
+    config.connectAttemptDelay = settings.read(kConnectAttemptDelay, config.connectAttemptDelay).toInt();
+    config.headerReadTimeout   = settings.read(kHeaderReadTimeout, config.headerReadTimeout).toInt();
+    config.idleTimeout         = settings.read(kIdleTimeout, config.idleTimeout).toInt();
+    config.readBufferSize      = settings.read(kReadBufferSize, config.readBufferSize).toInt();
+    config.highWatermark       = settings.read(kHighWatermark, config.highWatermark).toInt();
+    config.lowWatermark        = qMin(settings.read(kLowWatermark, config.lowWatermark).toInt(), config.highWatermark);
+    config.batchWrites         = settings.read(kBatchWrites, config.batchWrites).toBool();
+    config.metricsAddress      = QHostAddress(settings.read(kMetricsAddress, config.metricsAddress.toString()).toString());
+    config.metricsPort         = static_cast<quint16>(settings.read(kMetricsPort, config.metricsPort).toInt());
+
+    auto& limits          = config.upstreamPoolLimits;
+    limits.maxIdlePerHost = qMax(0, settings.read(kUpstreamPoolMaxIdlePerHost, limits.maxIdlePerHost).toInt());
+    limits.maxIdle        = qMax(0, settings.read(kUpstreamPoolMaxIdle, limits.maxIdle).toInt());
+    limits.idleTimeout    = settings.read(kUpstreamPoolIdleTimeout, limits.idleTimeout).toInt();
+
+    auto& dns       = config.dnsCacheLimits;
+    dns.ttl         = settings.read(kDnsCacheTtl, dns.ttl).toInt();
+    dns.negativeTtl = settings.read(kDnsCacheNegativeTtl, dns.negativeTtl).toInt();
+    dns.maxEntries  = settings.read(kDnsCacheMaxEntries, dns.maxEntries).toInt();
+
+    auto& cache         = config.responseCacheLimits;
+    cache.memorySize    = settings.read(kCacheMemorySize, cache.memorySize).toLongLong();
+    cache.maxObjectSize = settings.read(kCacheMaxObjectSize, cache.maxObjectSize).toLongLong();
+    cache.diskPath      = settings.read(kCacheDiskPath, cache.diskPath).toString();
+    cache.diskSize      = settings.read(kCacheDiskSize, cache.diskSize).toLongLong();
+
+    auto& log      = config.accessLogOptions;
+    log.path       = settings.read(kAccessLogPath, log.path).toString();
+    log.format     = (settings.read(kAccessLogFormat, QStringLiteral("json")).toString().toLower() == QLatin1String("binary"))
+                     ? AccessLog::Format::Binary : AccessLog::Format::Json;
+    log.sampleRate = settings.read(kAccessLogSampleRate, log.sampleRate).toInt();
+    log.capacity   = settings.read(kAccessLogBufferSize, log.capacity).toInt();
+
+    auto& tracing      = config.tracingOptions;
+    tracing.enabled    = settings.read(kTracing, tracing.enabled).toBool();
+    tracing.path       = settings.read(kTracingPath, tracing.path).toString();
+    tracing.sampleRate = settings.read(kTracingSampleRate, tracing.sampleRate).toInt();
+
+    auto& lifecycle          = config.lifecycleOptions;
+    lifecycle.handoffPath    = settings.read(kHandoffPath, lifecycle.handoffPath).toString();
+    lifecycle.handoffTimeout = settings.read(kHandoffTimeout, lifecycle.handoffTimeout).toInt();
+    lifecycle.drainTimeout   = settings.read(kDrainTimeout, lifecycle.drainTimeout).toInt();
+
+    auto& uring      = config.uringOptions;
+    uring.entries    = settings.read(kUringEntries, uring.entries).toInt();
+    uring.buffers    = settings.read(kUringBuffers, uring.buffers).toInt();
+    uring.sqPoll     = settings.read(kUringSqPoll, uring.sqPoll).toBool();
+    uring.sqPollIdle = settings.read(kUringSqPollIdle, uring.sqPollIdle).toInt();
+
+    auto& rates                   = config.rateLimits;
+    rates.connectionRate          = settings.read(kConnectionRate, rates.connectionRate).toInt();
+    rates.connectionBurst         = settings.read(kConnectionBurst, rates.connectionBurst).toInt();
+    rates.maxConnectionsPerClient = settings.read(kMaxConnectionsPerClient, rates.maxConnectionsPerClient).toInt();
+    rates.connectionBandwidth     = settings.read(kConnectionBandwidth, rates.connectionBandwidth).toLongLong();
+    rates.globalBandwidth         = settings.read(kGlobalBandwidth, rates.globalBandwidth).toLongLong();
+    rates.maxConnections          = settings.read(kMaxConnections, rates.maxConnections).toInt();
+    rates.maxLoopLag              = settings.read(kMaxLoopLag, rates.maxLoopLag).toInt();
+    rates.pauseAccept             = (settings.read(kOverloadAction, QStringLiteral("reject")).toString().toLower() == QLatin1String("pause"));
+
+    const auto aclPath    = settings.read(kAclPath, QString()).toString();
+    const auto aclDefault = (settings.read(kAclDefault, QStringLiteral("allow")).toString().toLower() == QLatin1String("deny"))
+                            ? Acl::Action::Deny : Acl::Action::Allow;
+
+    if (!aclPath.isEmpty()) {
+        config.acl = Acl::load(aclPath, aclDefault);
+
+        if (!config.acl) {
+            qWarning() << QStringLiteral("Denying every target until the ACL can be read");
+            config.acl = QSharedPointer<const Acl>::create(Acl::Action::Deny);
+        }
+    } else if (aclDefault == Acl::Action::Deny) {
+        config.acl = QSharedPointer<const Acl>::create(Acl::Action::Deny);
+    }
+
+    auto& mux         = config.muxOptions;
+    mux.parentHost    = settings.read(kParentHost, mux.parentHost).toString();
+    mux.parentPort    = static_cast<quint16>(settings.read(kParentPort, mux.parentPort).toUInt());
+    mux.links         = settings.read(kParentLinks, mux.links).toInt();
+    mux.listenAddress = QHostAddress(settings.read(kMuxAddress, mux.listenAddress.toString()).toString());
+    mux.listenPort    = static_cast<quint16>(settings.read(kMuxPort, mux.listenPort).toUInt());
+    mux.secret        = settings.read(kMuxSecret, QString()).toString().toUtf8();
+
+    if (mux.parentHost.isEmpty()) {
+        mux.parentPort = 0;
+    }
+
+    const auto keys     = settings.allKeys();
+    config.socketTuning = readTuning(settings, QLatin1String(kSocket), {}, true);
+
+    for (const auto& name : (config.acl ? config.acl->profiles() : QStringList())) {
+        // profiles only override what they name, nothing is written back for them
+        const auto prefix = QLatin1String(kSocket) + name + QLatin1Char('/');
+
+        if (std::none_of(keys.cbegin(), keys.cend(), [&prefix](const QString& key) { return key.startsWith(prefix); })) {
+            qWarning() << QStringLiteral("ACL refers to undefined socket profile") << name;
+        }
+
+        config.socketProfiles.append(readTuning(settings, prefix, config.socketTuning, false));
+    }
+
+#ifndef Q_OS_LINUX
+
+    if (config.reusePort) {
+        qWarning() << QStringLiteral("SO_REUSEPORT is not supported on this platform, using a single listener");
+        config.reusePort = false;
+    }
+
+#endif // Q_OS_LINUX
+    settings.sync();  // writes back the defaults filled in above
+    return config;
+}
+
+Settings::Settings(const QString& file, bool seed) : QSettings(file, QSettings::IniFormat), _seed{seed} {}
+
+QVariant Settings::read(const QString& key, const QVariant& defaultValue) {
+    QVariant result = defaultValue;
+
+    if (contains(key)) {
+        result = value(key);
+    } else if (_seed) {
+        setValue(key, defaultValue);
+    }
+
+    return result;
+}
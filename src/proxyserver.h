@@ -0,0 +1,353 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <QtNetwork>
+#include <httpparser/request.h>
+#include <httpparser/httprequestparser.h>
+#include <httpparser/httpresponseparser.h>
+#include <atomic>
+#include "accesslog.h"
+#include "acl.h"
+#include "configstore.h"
+#include "dnscache.h"
+#include "httputils.h"
+#include "iouring.h"
+#include "lifecycle.h"
+#include "metrics.h"
+#include "muxlink.h"
+#include "ratelimit.h"
+#include "responsecache.h"
+#include "slabpool.h"
+#include "slottable.h"
+#include "socketutils.h"
+#include "splicerelay.h"
+#include "timingwheel.h"
+#include "tracing.h"
+#include "upstreamconnector.h"
+#include "upstreampool.h"
+
+///
+/// \brief The Settings class
+/// read() writes the defaults of missing keys back to the file, unless \a seed is false.
+///
+class Settings final : protected QSettings {
+  public:
+    explicit Settings(const QString& file, bool seed = true);
+    QVariant read(const QString& key, const QVariant& defaultValue);
+
+    using QSettings::allKeys;
+    using QSettings::status;
+    using QSettings::sync;
+    using QSettings::value;
+
+  private:
+    const bool _seed;
+};
+
+///
+/// \brief The ProxyConfig struct
+/// Tunables read from Settings, published as immutable ConfigStore snapshots.
+/// Connections keep the snapshot current when they were accepted.
+///
+struct ProxyConfig {
+    QHostAddress address    = QHostAddress(QHostAddress::Any);
+    quint16 port            = 8888;
+    QString engine          = QStringLiteral("qt");  // qt: QTcpSocket per side, native: EpollEngine, uring: EpollEngine on io_uring
+    int workers             = 0;  // 0: one worker per core
+    bool reusePort          = false;
+    bool splice             = true;
+    int maxHeaderSize       = 64 * 1024;
+    bool upstreamPool       = true;
+    bool dnsCache           = true;
+    bool responseCache      = false;
+    int connectTimeout      = 10000;  // ms from a complete head to a connected upstream, 0 leaves it to the OS
+    int headerReadTimeout   = 30000;  // ms to receive the request head
+    int idleTimeout         = 300000;  // ms without traffic in either direction
+    int connectAttemptDelay = 250;  // ms between racing attempts (RFC 8305)
+    int readBufferSize      = 64 * 1024;
+    int highWatermark       = 1024 * 1024;  // stop reading once the other side queues this much
+    int lowWatermark        = 256 * 1024;   // and resume when it drains below this
+    bool batchWrites        = false;  // one write per destination per event loop iteration
+
+    QHostAddress metricsAddress = QHostAddress(QHostAddress::LocalHost);
+    quint16 metricsPort         = 0;  // 0: no metrics endpoint
+
+    UpstreamPool::Limits upstreamPoolLimits;
+    DnsCache::Limits dnsCacheLimits;
+    ResponseCache::Limits responseCacheLimits;
+    AccessLog::Options accessLogOptions;
+    Tracer::Options tracingOptions;
+    Lifecycle::Options lifecycleOptions;
+    IoUring::Options uringOptions;  // rings of the uring engine, one per loop
+    RateLimits rateLimits;
+    QSharedPointer<const Acl> acl;  // null: every target is allowed
+    MuxLink::Options muxOptions;    // parent chaining, read once at startup
+    SocketTuning socketTuning;      // client, upstream and listening sockets
+    QVector<SocketTuning> socketProfiles;  // indexed like acl->profiles()
+
+    ///
+    /// The tuning for upstreams of an ACL rule with \a profile, the base tuning for -1.
+    ///
+    const SocketTuning& tuning(int profile) const;
+
+    static ProxyConfig load(Settings& settings);
+};
+
+class ProxyWorker;
+
+///
+/// \brief The ProxyConnection class
+///
+class ProxyConnection final : public QObject, public SlabAllocated {
+    Q_OBJECT
+
+  public:
+    ProxyConnection(const QSharedPointer<QTcpSocket>& downStream, quint64 id, ProxyWorker& worker, const QHostAddress& client);
+    ~ProxyConnection() override;
+
+  private Q_SLOTS:
+    void terminate();
+    void downStreamReadyRead();
+    void upStreamReadyRead();
+    void upStreamConnected();
+    void upStreamDisconnected();
+    void downStreamBytesWritten();
+    void upStreamBytesWritten();
+
+  private:
+    void readHead(const QByteArray& data);
+    void handleRequest(RequestLine::Method method, const HttpTarget& target);
+    void finishRequest();
+    void consultCache();
+    void serveCached(const ResponseCache::Entry& entry);
+    void abandonCache();
+    void resolveUpStream();
+    void connectUpStream(const QList<QHostAddress>& addresses, quint16 port);
+    void attachUpStream(const QSharedPointer<QTcpSocket>& socket);
+    void releaseUpStream(bool reusable);
+    void finishUpStream();
+    void relayRequest(const char* data, qint64 size);
+    void relayResponse(const char* data, qint64 size);
+    void reject(int statusCode, const char* reason, Metrics::Termination termination = Metrics::Termination::Rejected);
+    void fail(Metrics::Termination termination);
+    void writeAccessLog();
+    void startSplice();
+    void timeout();
+    qint64 allowance(TokenBucket& budget, qint64 wanted);
+    void throttle(TokenBucket& budget, bool upStream);
+    void openParentStream(const QString& host, quint16 port);
+    void sendUpStream(const char* data, qint64 size);
+    void flush(QTcpSocket& socket);
+    qint64 queuedUpStream() const;
+
+    void trace(Tracer::Stage stage) {
+#ifdef PROXY_TRACING
+
+        if (Q_UNLIKELY(_trace.active)) {
+            _trace.mark(stage);
+        }
+
+#else // ifdef PROXY_TRACING
+        Q_UNUSED(stage)
+#endif // PROXY_TRACING
+    }
+
+    quint64 _id = 0;
+    ProxyWorker& _worker;
+    const ConfigStore::Snapshot _snapshot;
+    const ProxyConfig& _config;
+    httpparser::Request _request;
+    httpparser::HttpRequestParser _parser;
+    httpparser::Response _response;
+    QByteArray _head;  // the head being read, or the next pipelined request
+    QByteArray _responseHead;
+    QByteArray _pending;  // forwarded once upstream is connected
+    BodyFramer _requestBody;
+    BodyFramer _responseBody;
+    bool _headParsed         = false;
+    bool _responseHeadParsed = false;
+    bool _tunnel             = false;  // raw relay, no HTTP framing
+    bool _clientKeepAlive    = false;  // another request may follow the response
+    bool _upStreamReady      = false;
+    bool _upStreamKeepAlive  = false;
+    bool _upStreamClosed     = false;
+    bool _downStreamPaused   = false;  // not reading until upstream drains
+    bool _upStreamPaused     = false;  // not reading until downstream drains
+    bool _tunnelOpen         = false;
+    bool _relaying           = false;  // upstream connected, the idle timeout applies
+    bool _terminated         = false;
+    Metrics::Termination _termination = Metrics::Termination::Closed;
+    QElapsedTimer _started;
+    Tracer::Trace _trace;  // of the current request, inactive unless tracing
+    QString _targetHost;
+    quint16 _targetPort = 0;
+    quint16 _status     = 0;  // last status line the client got
+    quint64 _bytesUp    = 0;
+    quint64 _bytesDown  = 0;
+    quint32 _served     = 0;  // requests completed on this connection
+    TokenBucket _upBudget;    // client to upstream
+    TokenBucket _downBudget;  // upstream to client
+    bool _downStreamThrottled = false;  // out of budget, not reading the client
+    bool _upStreamThrottled   = false;  // out of budget, not reading the upstream
+    QHostAddress _client;  // admitted by RateLimiter, null when not tracked
+    QHostAddress _peerAddress;  // for the access log, the socket forgets it once spliced
+    quint16 _peerPort = 0;
+    TimingWheel::Timer _timer;  // header read, then connect, then idle
+    qint64 _lastActivity  = 0;  // ms since _started
+    quint64 _splicedBytes = 0;
+    UpstreamConnector* _connector = nullptr;
+    QSharedPointer<QTcpSocket> _downStream;
+    QSharedPointer<QTcpSocket> _upStream;  // null until a socket is picked for the target
+    QHostAddress _upStreamAddress;
+    quint16 _upStreamPort = 0;
+    int _socketProfile    = -1;  // of the ACL rule that let the target through
+    SpliceRelay* _splice = nullptr;
+    QSharedPointer<MuxStream> _parentStream;  // replaces _upStream when chained to a parent
+    qint64 _parentUnacked = 0;  // delivered by the parent, not yet flushed to the client
+    QByteArray _cacheKey;  // set while the request goes through the ResponseCache
+    ResponseCache::EntryPtr _cacheStale;  // the entry this request revalidates
+    QSharedPointer<ResponseCache::Entry> _cacheEntry;  // the response being collected
+    bool _cacheFetching = false;  // this request completes the cache's fetch
+    qint64 _requestTime = 0;  // ms since epoch the fetch started, for the entry's age
+
+  Q_SIGNALS:
+    void terminated(quint64 id, QPrivateSignal);
+};
+
+///
+/// \brief The ProxyWorker class
+/// Owns the connections handed to it and runs them on its own event loop.
+///
+class ProxyWorker final : public QObject {
+    Q_OBJECT
+
+  public:
+    explicit ProxyWorker(const ProxyConfig& config, QObject* parent = nullptr);
+    ~ProxyWorker() override;
+
+    ///
+    /// Adopts \a handle, a non-null \a client was admitted by RateLimiter and is released with the connection.
+    ///
+    void addConnection(qintptr handle, const QHostAddress& client = {});
+    int  activeConnections() const;
+
+    ///
+    /// How many ms this worker's event loop runs late, jumps to each new peak and decays
+    /// from there. Only probed while Limits/MaxLoopLag is set, 0 otherwise.
+    ///
+    int loopLag() const;
+
+    ConfigStore::Snapshot config() const;
+    UpstreamPool&         upstreamPool();
+    TimingWheel&          timingWheel();
+    MuxPool*              muxPool();  // null unless a parent proxy is configured
+
+    ///
+    /// Adopts \a handle as the parent side of a MuxLink, each stream opened on it becomes a MuxTunnel.
+    ///
+    void addMuxLink(qintptr handle);
+
+    ///
+    /// Arms \a timer on this worker's wheel, the wheel only ticks while timers are armed.
+    ///
+    void schedule(TimingWheel::Timer& timer, qint64 msecs);
+
+    ///
+    /// Flushes \a socket once the events of this loop iteration are handled, so the
+    /// writes of a readyRead burst leave together instead of a syscall per chunk.
+    ///
+    void flushLater(QTcpSocket* socket);
+
+  protected:
+    Q_SLOT void onConnectionTerminate(quint64 id);
+
+  private:
+    void flushBatch();
+    void probeLag();
+    void updateLagProbe();
+
+    const ConfigStore::Snapshot _config;  // used when nothing publishes snapshots
+    UpstreamPool _upstreamPool;
+    TimingWheel _timingWheel;
+    QTimer* _ticker = nullptr;
+    QTimer* _lagProbe = nullptr;
+    QElapsedTimer _lagClock;  // since the probe was last armed
+    MuxPool* _muxPool = nullptr;
+    QVector<QPointer<QTcpSocket>> _flushes;  // written to in this iteration, see flushLater()
+    SlotTable<QSharedPointer<ProxyConnection>> _connections;  // ids stay unique while the OS recycles handles
+    std::atomic<int> _active{0};
+    std::atomic<int> _lag{0};
+};
+
+///
+/// \brief The WorkerPool class
+/// Starts one ProxyWorker per thread and joins them on destruction.
+///
+class WorkerPool final : public QObject {
+    Q_OBJECT
+
+  public:
+    explicit WorkerPool(const ProxyConfig& config, QObject* parent = nullptr);
+    ~WorkerPool() override;
+
+    const QVector<ProxyWorker*>& workers() const;
+
+  private:
+    QVector<QThread*> _threads;
+    QVector<ProxyWorker*> _workers;
+};
+
+///
+/// \brief The ProxyServer class
+///
+class ProxyServer final : public QTcpServer {
+    Q_OBJECT
+
+  public:
+    explicit ProxyServer(const QVector<ProxyWorker*>& workers, QObject* parent = nullptr);
+    ~ProxyServer() override;
+
+    bool    listenReusePort(const QHostAddress& address, quint16 port);
+    quint64 acceptedConnections() const;
+
+    ///
+    /// Moves the listener to \a address:\a port, accepted connections are not affected.
+    /// Stays on the current address when the new one cannot be bound.
+    ///
+    bool rebind(const QHostAddress& address, quint16 port, bool reusePort);
+
+    static QVector<quint64> acceptCounters();
+
+  protected:
+    void incomingConnection(qintptr handle) override;
+
+  private:
+    ProxyWorker* nextWorker();
+    bool overloaded(const ProxyWorker& worker, const RateLimits& limits) const;
+    void pause();
+    void checkResume();
+
+    QVector<ProxyWorker*> _workers;
+    int _next = 0;
+    QTimer* _resume = nullptr;  // polls for the end of an overload while accepting is paused
+    std::atomic<quint64> _accepted{0};
+
+    static QMutex _registryLock;
+    static QVector<ProxyServer*> _registry;
+};
@@ -0,0 +1,177 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "ratelimit.h"
+
+static constexpr qint64 kSecond    = 1000000000;  // ns
+static constexpr auto kSweepPeriod = 1024;  // admissions between sweeps of idle clients
+
+TokenBucket::TokenBucket(qint64 rate, qint64 burst) : _rate{qMax<qint64>(0, rate)} {
+    if (_rate > 0) {
+        _burstNs = qMax<qint64>(1, burst > 0 ? burst : _rate) * kSecond / _rate;
+    }
+
+    _zero.store(now() - _burstNs, std::memory_order_relaxed);  // starts full
+}
+
+TokenBucket::TokenBucket(const TokenBucket& other) : _rate{other._rate}, _burstNs{other._burstNs} {
+    _zero.store(other._zero.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+TokenBucket& TokenBucket::operator=(const TokenBucket& other) {
+    _rate    = other._rate;
+    _burstNs = other._burstNs;
+    _zero.store(other._zero.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return *this;
+}
+
+bool TokenBucket::unlimited() const {
+    return _rate == 0;
+}
+
+qint64 TokenBucket::rate() const {
+    return _rate;
+}
+
+qint64 TokenBucket::take(qint64 wanted) {
+    if (unlimited()) {
+        return wanted;
+    }
+
+    const auto current = now();
+    auto zero          = _zero.load(std::memory_order_relaxed);
+
+    for (;;) {
+        const auto base    = qMax(zero, current - _burstNs);  // never more than a burst
+        const auto granted = qMin(wanted, available(base, current));
+
+        if (granted <= 0) {
+            return 0;
+        }
+
+        // round the cost up so granting never outpaces the rate
+        const auto next = base + (granted * kSecond + _rate - 1) / _rate;
+
+        if (_zero.compare_exchange_weak(zero, next, std::memory_order_relaxed)) {
+            return granted;
+        }
+    }
+}
+
+void TokenBucket::refund(qint64 tokens) {
+    if (!unlimited() && (tokens > 0)) {
+        _zero.fetch_sub(tokens * kSecond / _rate, std::memory_order_relaxed);
+    }
+}
+
+qint64 TokenBucket::delay(qint64 tokens) const {
+    if (unlimited()) {
+        return 0;
+    }
+
+    const auto current = now();
+    const auto base    = qMax(_zero.load(std::memory_order_relaxed), current - _burstNs);
+    const auto missing = tokens - available(base, current);
+
+    if (missing <= 0) {
+        return 0;
+    }
+
+    return qMax<qint64>(1, (missing * kSecond / _rate + 999999) / 1000000);
+}
+
+bool TokenBucket::full() const {
+    return unlimited() || (_zero.load(std::memory_order_relaxed) <= now() - _burstNs);
+}
+
+qint64 TokenBucket::now() {
+    static const auto clock = []() {
+        QElapsedTimer timer;
+        timer.start();
+        return timer;
+    }();
+
+    return clock.nsecsElapsed();
+}
+
+qint64 TokenBucket::available(qint64 zero, qint64 now) const {
+    return (now - zero) * _rate / kSecond;
+}
+
+QMutex RateLimiter::_lock;
+QHash<QHostAddress, RateLimiter::Client> RateLimiter::_clients;
+quint32 RateLimiter::_admissions = 0;
+TokenBucket RateLimiter::_global;
+QMutex RateLimiter::_globalLock;
+
+bool RateLimiter::admit(const QHostAddress& client, const RateLimits& limits) {
+    QMutexLocker locker(&_lock);
+
+    if (++_admissions % kSweepPeriod == 0) {
+        sweep();
+    }
+
+    auto it = _clients.find(client);
+
+    if (it == _clients.end()) {
+        it = _clients.insert(client, {TokenBucket(limits.connectionRate, limits.connectionBurst), 0});
+    } else if (it->bucket.rate() != limits.connectionRate) {
+        it->bucket = TokenBucket(limits.connectionRate, limits.connectionBurst);  // reloaded
+    }
+
+    if (((limits.maxConnectionsPerClient > 0) && (it->active >= limits.maxConnectionsPerClient))
+        || (it->bucket.take(1) == 0)) {
+        return false;
+    }
+
+    ++it->active;
+    return true;
+}
+
+void RateLimiter::release(const QHostAddress& client) {
+    QMutexLocker locker(&_lock);
+    const auto it = _clients.find(client);
+
+    if (it != _clients.end()) {
+        it->active = qMax(0, it->active - 1);
+    }
+}
+
+qint64 RateLimiter::takeGlobal(qint64 wanted, qint64 rate) {
+    if (_global.rate() != rate) {
+        QMutexLocker locker(&_globalLock);
+
+        if (_global.rate() != rate) {
+            _global = TokenBucket(rate);
+        }
+    }
+
+    return _global.take(wanted);
+}
+
+qint64 RateLimiter::globalDelay(qint64 bytes) {
+    return _global.delay(bytes);
+}
+
+bool RateLimiter::limitsClients(const RateLimits& limits) {
+    return (limits.connectionRate > 0) || (limits.maxConnectionsPerClient > 0);
+}
+
+void RateLimiter::sweep() {
+    for (auto it = _clients.begin(); it != _clients.end();) {
+        it = ((it->active == 0) && it->bucket.full()) ? _clients.erase(it) : std::next(it);
+    }
+}
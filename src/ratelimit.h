@@ -0,0 +1,116 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <QtNetwork>
+#include <atomic>
+
+///
+/// \brief The TokenBucket class
+/// Refilled lazily from the clock on every take() (GCRA), so an idle bucket
+/// costs nothing and no timer is involved. The state is a single atomic
+/// timestamp, which makes one bucket safe to share between threads.
+///
+class TokenBucket final {
+  public:
+    explicit TokenBucket(qint64 rate = 0, qint64 burst = 0);  // tokens per second, 0: unlimited
+    TokenBucket(const TokenBucket& other);
+    TokenBucket& operator=(const TokenBucket& other);
+
+    bool   unlimited() const;
+    qint64 rate() const;
+
+    ///
+    /// Takes up to \a wanted tokens and returns how many were granted.
+    ///
+    qint64 take(qint64 wanted);
+
+    ///
+    /// Gives back \a tokens taken but not used.
+    ///
+    void refund(qint64 tokens);
+
+    ///
+    /// Milliseconds until \a tokens are available, 0 when they already are.
+    ///
+    qint64 delay(qint64 tokens) const;
+
+    bool full() const;
+
+    static qint64 now();  // ns, monotonic
+
+  private:
+    qint64 available(qint64 zero, qint64 now) const;
+
+    qint64 _rate    = 0;
+    qint64 _burstNs = 0;  // time to refill an empty bucket
+    std::atomic<qint64> _zero{0};  // when the bucket was (or would have been) empty
+};
+
+///
+/// \brief The RateLimits struct
+/// 0 disables a limit.
+///
+struct RateLimits {
+    int connectionRate          = 0;  // new connections per second and client address
+    int connectionBurst         = 0;  // 0: one second worth of connectionRate
+    int maxConnectionsPerClient = 0;
+    qint64 connectionBandwidth  = 0;  // bytes per second and direction for each connection
+    qint64 globalBandwidth      = 0;  // bytes per second over all relayed traffic
+    int maxConnections          = 0;  // client connections over all workers before new ones are shed
+    int maxLoopLag              = 0;  // ms a worker's event loop may run late before it sheds
+    bool pauseAccept            = false;  // shed by leaving connections in the backlog instead of a 503
+};
+
+///
+/// \brief The RateLimiter class
+/// Process wide limits: per client admission at accept time and the global
+/// bandwidth budget. Client entries are dropped lazily once they are idle and
+/// their bucket has refilled.
+///
+class RateLimiter final {
+  public:
+    ///
+    /// Counts a new connection from \a client, false when \a limits reject it.
+    /// Every admitted connection must be released().
+    ///
+    static bool admit(const QHostAddress& client, const RateLimits& limits);
+    static void release(const QHostAddress& client);
+
+    ///
+    /// Takes up to \a wanted bytes from the global budget at \a rate bytes per second.
+    ///
+    static qint64 takeGlobal(qint64 wanted, qint64 rate);
+    static qint64 globalDelay(qint64 bytes);
+
+    static bool limitsClients(const RateLimits& limits);
+
+  private:
+    struct Client {
+        TokenBucket bucket;
+        int active = 0;
+    };
+
+    static void sweep();
+
+    static QMutex _lock;
+    static QHash<QHostAddress, Client> _clients;
+    static quint32 _admissions;
+    static TokenBucket _global;
+    static QMutex _globalLock;  // only taken when the global rate changes
+};
@@ -0,0 +1,555 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "responsecache.h"
+#include "httputils.h"
+
+static constexpr quint32 kDiskMagic       = 0x50584331;  // "PXC1"
+static constexpr auto kHeuristicLifetime  = qint64{24 * 3600 * 1000};  // cap of the Last-Modified heuristic, ms
+static constexpr auto kHeadCost           = 512;  // rough bytes per stored header
+
+ResponseCache* ResponseCache::_instance = nullptr;
+
+///
+/// \brief The DiskWrite class
+/// Serializes one entry on the cache's writer thread.
+///
+class DiskWrite final : public QRunnable {
+  public:
+    explicit DiskWrite(std::function<void()> job) : _job{std::move(job)} {}
+
+    void run() override {
+        _job();
+    }
+
+  private:
+    const std::function<void()> _job;
+};
+
+template<typename Headers>
+static QHash<QByteArray, QByteArray> cacheControl(const Headers& headers) {
+    QHash<QByteArray, QByteArray> directives;
+
+    for (const auto& header : headers) {
+        // Pragma: no-cache is the HTTP/1.0 spelling of the request directive
+        if (!headerNameEquals(header.name, "Cache-Control") && !headerNameEquals(header.name, "Pragma")) {
+            continue;
+        }
+
+        for (const auto& directive : QByteArray::fromStdString(header.value).split(',')) {
+            const auto equals = directive.indexOf('=');
+            const auto name   = directive.left(equals).trimmed().toLower();
+            auto value        = (equals < 0) ? QByteArray() : directive.mid(equals + 1).trimmed();
+
+            if (value.startsWith('"') && value.endsWith('"') && (value.size() >= 2)) {
+                value = value.mid(1, value.size() - 2);
+            }
+
+            if (!name.isEmpty()) {
+                directives.insert(name, value);
+            }
+        }
+    }
+
+    return directives;
+}
+
+static qint64 httpDate(const QByteArray& value) {
+    // IMF-fixdate only, the obsolete RFC 850 and asctime forms count as invalid
+    auto date = QLocale::c().toDateTime(QString::fromLatin1(value.trimmed()), QStringLiteral("ddd, dd MMM yyyy HH:mm:ss 'GMT'"));
+
+    if (!date.isValid()) {
+        return -1;
+    }
+
+    date.setTimeSpec(Qt::UTC);
+    return date.toMSecsSinceEpoch();
+}
+
+static qint64 deltaSeconds(const QByteArray& value) {
+    auto ok            = false;
+    const auto seconds = value.toLongLong(&ok);
+    return (ok && (seconds > 0)) ? seconds * 1000 : 0;
+}
+
+static bool hasValidator(const httpparser::Response& response) {
+    return !headerValue(response.headers, "ETag").isNull() || !headerValue(response.headers, "Last-Modified").isNull();
+}
+
+static bool cacheableRequest(const httpparser::Request& request) {
+    if (!headerNameEquals(request.method, "GET")) {
+        return false;
+    }
+
+    // conditional and partial requests are the client's own business, so is anything with a body
+    for (const auto name : {"Authorization", "Range", "If-Match", "If-None-Match", "If-Modified-Since",
+                            "If-Unmodified-Since", "If-Range", "Content-Length", "Transfer-Encoding"
+                           }) {
+        if (!headerValue(request.headers, name).isNull()) {
+            return false;
+        }
+    }
+
+    return !cacheControl(request.headers).contains("no-store");
+}
+
+static bool cacheableStatus(int statusCode) {
+    // RFC 9110 15.1 heuristically cacheable codes
+    switch (statusCode) {
+        case 200:
+        case 203:
+        case 204:
+        case 300:
+        case 301:
+        case 308:
+        case 404:
+        case 410:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+///
+/// Computes the freshness lifetime and corrected initial age (RFC 9111 4.2) of
+/// \a entry from its headers. Returns false when it is neither fresh nor revalidatable.
+///
+static bool freshness(ResponseCache::Entry& entry, qint64 requestTime, qint64 responseTime) {
+    const auto& headers    = entry.response.headers;
+    const auto directives  = cacheControl(headers);
+    const auto date        = httpDate(headerValue(headers, "Date"));
+    const auto base        = (date >= 0) ? date : responseTime;
+    const auto expires     = headerValue(headers, "Expires");
+    const auto modified    = httpDate(headerValue(headers, "Last-Modified"));
+    qint64 lifetime        = 0;
+
+    if (directives.contains("s-maxage")) {
+        lifetime = deltaSeconds(directives.value("s-maxage"));
+    } else if (directives.contains("max-age")) {
+        lifetime = deltaSeconds(directives.value("max-age"));
+    } else if (!expires.isNull()) {
+        // an invalid Expires means already expired
+        const auto at = httpDate(expires);
+        lifetime      = (at < 0) ? 0 : qMax<qint64>(0, at - base);
+    } else if (modified >= 0) {
+        lifetime = qMin(kHeuristicLifetime, qMax<qint64>(0, base - modified) / 10);
+    }
+
+    if (directives.contains("no-cache")) {
+        lifetime = 0;
+    }
+
+    auto ageValue = headerValue(headers, "Age").trimmed().toLongLong() * 1000;
+    ageValue      = qMax<qint64>(0, ageValue);
+
+    const auto apparentAge = (date >= 0) ? qMax<qint64>(0, responseTime - date) : 0;
+    entry.initialAge       = qMax(apparentAge, ageValue + qMax<qint64>(0, responseTime - requestTime));
+    entry.lifetime         = lifetime;
+    entry.responseTime     = responseTime;
+
+    // Age is regenerated whenever the entry is served
+    auto& stored = entry.response.headers;
+    stored.erase(std::remove_if(stored.begin(), stored.end(), [](const auto & header) {
+        return headerNameEquals(header.name, "Age");
+    }), stored.end());
+
+    return (lifetime > 0) || hasValidator(entry.response);
+}
+
+qint64 ResponseCache::Entry::age(qint64 now) const {
+    return initialAge + qMax<qint64>(0, now - responseTime);
+}
+
+bool ResponseCache::Entry::fresh(qint64 now) const {
+    return lifetime > age(now);
+}
+
+qint64 ResponseCache::Entry::cost() const {
+    const auto bytes = body.size() + kHeadCost * static_cast<qint64>(response.headers.size() + 1);
+    return bytes / 1024 + 1;
+}
+
+ResponseCache::DiskEntry::~DiskEntry() {
+    if (!keep) {
+        QFile::remove(path);
+    }
+}
+
+ResponseCache::ResponseCache(const Limits& limits, QObject* parent) : QObject(parent), _limits{limits} {
+    _memory.setMaxCost(static_cast<int>(qBound<qint64>(1, _limits.memorySize / 1024, std::numeric_limits<int>::max())));
+    _disk.setMaxCost(static_cast<int>(qBound<qint64>(1, _limits.diskSize / 1024, std::numeric_limits<int>::max())));
+    _writer.setMaxThreadCount(1);
+
+    if (!_limits.diskPath.isEmpty()) {
+        scanDisk();
+    }
+
+    _instance = this;
+}
+
+ResponseCache::~ResponseCache() {
+    if (_instance == this) {
+        _instance = nullptr;
+    }
+
+    _writer.waitForDone();
+
+    // what is still indexed stays on disk for the next start
+    for (const auto& key : _disk.keys()) {
+        _disk.object(key)->keep = true;
+    }
+}
+
+ResponseCache* ResponseCache::instance() {
+    return _instance;
+}
+
+QByteArray ResponseCache::key(const QByteArray& authority, const QByteArray& path) {
+    return authority.toLower() + path;
+}
+
+ResponseCache::Result ResponseCache::lookup(const QByteArray& key, const httpparser::Request& request, EntryPtr& entry, QObject* context, Callback callback) {
+    if (!cacheableRequest(request)) {
+        return Result::Bypass;
+    }
+
+    const auto directives = cacheControl(request.headers);
+    const auto revalidate = directives.contains("no-cache") || (directives.contains("max-age") && (deltaSeconds(directives.value("max-age")) == 0));
+    const auto now        = QDateTime::currentMSecsSinceEpoch();
+
+    QMutexLocker locker(&_lock);
+    EntryPtr found;
+
+    if (auto cached = _memory.object(key)) {
+        found = *cached;
+    } else if (auto stored = _disk.object(key)) {
+        const auto path = stored->path;
+        locker.unlock();
+        QFile file(path);
+        EntryPtr loaded;
+        QByteArray storedKey;
+
+        if (file.open(QIODevice::ReadOnly)) {
+            // mapped, the kernel pages the file in instead of copying it through read()
+            const auto size = file.size();
+            const auto data = file.map(0, size);
+            const auto raw  = data ? QByteArray::fromRawData(reinterpret_cast<const char*>(data), static_cast<int>(size)) : file.readAll();
+            QDataStream in(raw);
+            quint32 magic = 0;
+            auto read     = QSharedPointer<Entry>::create();
+            quint32 count = 0;
+            QByteArray status;
+            in >> magic >> storedKey >> read->responseTime >> read->initialAge >> read->lifetime
+               >> read->response.versionMajor >> read->response.versionMinor >> read->response.statusCode >> status >> count;
+            read->response.status = status.toStdString();
+
+            for (quint32 i = 0; (i < count) && (in.status() == QDataStream::Ok); ++i) {
+                QByteArray name, value;
+                in >> name >> value;
+                read->response.headers.push_back({name.toStdString(), value.toStdString()});
+            }
+
+            in >> read->vary >> read->body;
+
+            if ((in.status() == QDataStream::Ok) && (magic == kDiskMagic) && (storedKey == key)) {
+                loaded = read;
+            }
+
+            if (data) {
+                file.unmap(data);
+            }
+        }
+
+        locker.relock();
+
+        if (loaded) {
+            found = loaded;
+            _memory.insert(key, new EntryPtr(found), static_cast<int>(found->cost()));
+        } else {
+            qWarning() << QStringLiteral("Dropping unreadable cache file") << path;
+            const auto current = _disk.object(key);
+
+            if (current && (current->path == path)) {
+                _disk.remove(key);
+            }
+        }
+    }
+
+    if (found) {
+        for (const auto& header : found->vary) {
+            if (headerValue(request.headers, header.first.constData()) != header.second) {
+                found.reset();
+                break;
+            }
+        }
+    }
+
+    if (found && !revalidate && found->fresh(now)) {
+        locker.unlock();
+        _hits.fetch_add(1, std::memory_order_relaxed);
+        entry = found;
+        return Result::Hit;
+    }
+
+    auto it = _inflight.find(key);
+
+    if (it != _inflight.end()) {
+        it->append({dispatcher(), context, std::move(callback)});
+        locker.unlock();
+        _coalesced.fetch_add(1, std::memory_order_relaxed);
+        return Result::Wait;
+    }
+
+    _inflight.insert(key, {});
+    locker.unlock();
+    _misses.fetch_add(1, std::memory_order_relaxed);
+
+    if (found && hasValidator(found->response)) {
+        entry = found;
+        return Result::Stale;
+    }
+
+    return Result::Miss;
+}
+
+QSharedPointer<ResponseCache::Entry> ResponseCache::prepare(const httpparser::Request& request, const httpparser::Response& response,
+        qint64 requestTime, qint64 responseTime) const {
+    if (!cacheableRequest(request) || !cacheableStatus(response.statusCode)) {
+        return {};
+    }
+
+    const auto directives = cacheControl(response.headers);
+
+    // a shared cache never keeps private answers, cookies included
+    if (directives.contains("no-store") || directives.contains("private") || !headerValue(response.headers, "Set-Cookie").isNull()) {
+        return {};
+    }
+
+    auto entry = QSharedPointer<Entry>::create();
+
+    for (const auto& name : headerValue(response.headers, "Vary").split(',')) {
+        const auto header = name.trimmed().toLower();
+
+        if (header == "*") {
+            return {};
+        }
+
+        if (!header.isEmpty()) {
+            entry->vary.append({header, headerValue(request.headers, header.constData())});
+        }
+    }
+
+    entry->response = response;
+    entry->response.content.clear();
+    return freshness(*entry, requestTime, responseTime) ? entry : QSharedPointer<Entry>();
+}
+
+bool ResponseCache::fits(qint64 size) const {
+    return size <= _limits.maxObjectSize;
+}
+
+void ResponseCache::store(const QByteArray& key, const EntryPtr& entry) {
+    insert(key, entry);
+    complete(key, entry);
+}
+
+ResponseCache::EntryPtr ResponseCache::refresh(const QByteArray& key, const EntryPtr& stale, const httpparser::Response& notModified,
+        qint64 requestTime, qint64 responseTime) {
+    // RFC 9111 4.3.4: the 304 headers replace the stored ones, the framing stays the stored body's
+    auto entry = QSharedPointer<Entry>::create(*stale);
+    auto& headers = entry->response.headers;
+
+    for (const auto& header : notModified.headers) {
+        if (headerNameEquals(header.name, "Content-Length") || headerNameEquals(header.name, "Transfer-Encoding")) {
+            continue;
+        }
+
+        auto replaced = false;
+
+        for (auto& stored : headers) {
+            if (headerNameEquals(stored.name, header.name.c_str())) {
+                stored.value = header.value;
+                replaced     = true;
+            }
+        }
+
+        if (!replaced) {
+            headers.push_back(header);
+        }
+    }
+
+    _revalidated.fetch_add(1, std::memory_order_relaxed);
+
+    if (!freshness(*entry, requestTime, responseTime) || cacheControl(headers).contains("no-store")) {
+        abandon(key);
+        return entry;
+    }
+
+    store(key, entry);
+    return entry;
+}
+
+void ResponseCache::abandon(const QByteArray& key) {
+    complete(key, {});
+}
+
+QByteArray ResponseCache::conditions(const Entry& entry) {
+    const auto etag     = headerValue(entry.response.headers, "ETag");
+    const auto modified = headerValue(entry.response.headers, "Last-Modified");
+    QByteArray lines;
+
+    if (!etag.isNull()) {
+        lines.append("If-None-Match: ").append(etag).append("\r\n");
+    }
+
+    if (!modified.isNull()) {
+        lines.append("If-Modified-Since: ").append(modified).append("\r\n");
+    }
+
+    return lines;
+}
+
+QByteArray ResponseCache::render(const Entry& entry, bool keepAlive) {
+    auto response = entry.response;
+    response.headers.push_back({"Age", std::to_string(entry.age(QDateTime::currentMSecsSinceEpoch()) / 1000)});
+    return responseHead(response, keepAlive) + entry.body;
+}
+
+quint64 ResponseCache::hits() const {
+    return _hits.load(std::memory_order_relaxed);
+}
+
+quint64 ResponseCache::misses() const {
+    return _misses.load(std::memory_order_relaxed);
+}
+
+quint64 ResponseCache::revalidated() const {
+    return _revalidated.load(std::memory_order_relaxed);
+}
+
+quint64 ResponseCache::coalesced() const {
+    return _coalesced.load(std::memory_order_relaxed);
+}
+
+void ResponseCache::insert(const QByteArray& key, const EntryPtr& entry) {
+    {
+        QMutexLocker locker(&_lock);
+        _memory.insert(key, new EntryPtr(entry), static_cast<int>(entry->cost()));
+    }
+
+    if (!_limits.diskPath.isEmpty()) {
+        _writer.start(new DiskWrite([this, key, entry]() {
+            writeDisk(key, entry);
+        }));
+    }
+}
+
+void ResponseCache::complete(const QByteArray& key, const EntryPtr& entry) {
+    QMutexLocker locker(&_lock);
+    const auto waiters = _inflight.take(key);
+    locker.unlock();
+
+    for (const auto& waiter : waiters) {
+        // always queued, the waiter may be the fetcher's own thread deep in its relay
+        QMetaObject::invokeMethod(waiter.dispatcher, [waiter, entry]() {
+            if (waiter.context) {
+                waiter.callback(entry);
+            }
+        }, Qt::QueuedConnection);
+    }
+}
+
+void ResponseCache::scanDisk() {
+    QDir dir(_limits.diskPath);
+
+    if (!dir.mkpath(QStringLiteral("."))) {
+        qWarning() << QStringLiteral("Cannot create the cache directory") << _limits.diskPath;
+        return;
+    }
+
+    // oldest first, so the LRU order and the newest copy of a key survive
+    const auto files = dir.entryInfoList(QDir::Files, QDir::Time | QDir::Reversed);
+
+    for (const auto& info : files) {
+        if (info.suffix() == QLatin1String("tmp")) {
+            QFile::remove(info.filePath());
+            continue;
+        }
+
+        QFile file(info.filePath());
+        quint32 magic = 0;
+        QByteArray key;
+
+        if (file.open(QIODevice::ReadOnly)) {
+            QDataStream in(&file);
+            in >> magic >> key;
+        }
+
+        if ((magic != kDiskMagic) || key.isEmpty()) {
+            file.remove();
+            continue;
+        }
+
+        _disk.insert(key, new DiskEntry{info.filePath()}, static_cast<int>(info.size() / 1024 + 1));
+    }
+}
+
+void ResponseCache::writeDisk(const QByteArray& key, const EntryPtr& entry) {
+    const auto name = QStringLiteral("%1.%2-%3").arg(QString::fromLatin1(QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex()))
+                      .arg(entry->responseTime).arg(_serial.fetch_add(1, std::memory_order_relaxed));
+    const auto path = QDir(_limits.diskPath).filePath(name);
+    QFile file(path + QStringLiteral(".tmp"));
+
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << QStringLiteral("Cannot write cache file") << file.fileName() << file.errorString();
+        return;
+    }
+
+    QDataStream out(&file);
+    const auto& response = entry->response;
+    out << kDiskMagic << key << entry->responseTime << entry->initialAge << entry->lifetime
+        << response.versionMajor << response.versionMinor << response.statusCode
+        << QByteArray::fromStdString(response.status) << static_cast<quint32>(response.headers.size());
+
+    for (const auto& header : response.headers) {
+        out << QByteArray::fromStdString(header.name) << QByteArray::fromStdString(header.value);
+    }
+
+    out << entry->vary << entry->body;
+    const auto size = file.size();
+
+    // renamed only once complete, a crash leaves a .tmp the next scan removes
+    if ((out.status() != QDataStream::Ok) || !file.flush() || !file.rename(path)) {
+        qWarning() << QStringLiteral("Cannot write cache file") << path << file.errorString();
+        file.remove();
+        return;
+    }
+
+    QMutexLocker locker(&_lock);
+    _disk.insert(key, new DiskEntry{path}, static_cast<int>(size / 1024 + 1));
+}
+
+QObject* ResponseCache::dispatcher() {
+    // waiters are woken through a per-thread object that outlives the connections waiting
+    static QThreadStorage<QObject*> dispatchers;
+
+    if (!dispatchers.hasLocalData()) {
+        dispatchers.setLocalData(new QObject);
+    }
+
+    return dispatchers.localData();
+}
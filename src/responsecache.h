@@ -0,0 +1,173 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <httpparser/request.h>
+#include <httpparser/response.h>
+#include <atomic>
+#include <functional>
+
+///
+/// \brief The ResponseCache class
+/// Process wide shared cache for plain HTTP GET responses (RFC 9111). Fresh
+/// entries are answered without touching the origin, stale ones with a
+/// validator are revalidated with a conditional request, and concurrent
+/// misses for one key wait for the first fetch instead of each going out.
+///
+/// Entries live in a size bounded LRU memory tier. With a disk path set every
+/// stored entry is also written there in the background and memory misses
+/// fall back to it, the files are mapped rather than read and survive restarts.
+/// Bodies are kept as framed on the wire, chunked encoding included.
+///
+/// lookup() and the fetch completions may be called from any thread, waiters
+/// are woken on their own thread.
+///
+class ResponseCache final : public QObject {
+    Q_OBJECT
+
+  public:
+    struct Limits {
+        qint64 memorySize    = 64 * 1024 * 1024;
+        qint64 maxObjectSize = 8 * 1024 * 1024;  // larger responses are relayed, not stored
+        QString diskPath;                        // empty: memory only
+        qint64 diskSize      = 1024 * 1024 * 1024;
+    };
+
+    struct Entry {
+        httpparser::Response response;                // head only
+        QByteArray body;                              // as framed on the wire
+        QVector<QPair<QByteArray, QByteArray>> vary;  // request header values the response was selected by
+        qint64 responseTime = 0;  // ms since epoch
+        qint64 initialAge   = 0;  // ms, RFC 9111 4.2.3 corrected_initial_age
+        qint64 lifetime     = 0;  // ms of freshness from the origin's point of view
+
+        qint64 age(qint64 now) const;
+        bool   fresh(qint64 now) const;
+        qint64 cost() const;  // KiB
+    };
+
+    using EntryPtr = QSharedPointer<const Entry>;
+
+    enum class Result {
+        Hit,    // entry is fresh, answer with it
+        Stale,  // entry needs revalidation, the caller fetches for everyone
+        Miss,   // nothing usable, the caller fetches for everyone
+        Wait,   // another fetch is running, the callback delivers its outcome
+        Bypass  // the request must not be answered from the cache
+    };
+
+    ///
+    /// Delivers a coalesced fetch: the stored entry, or null when nothing could
+    /// be stored and the waiter has to go to the origin itself.
+    ///
+    using Callback = std::function<void(const EntryPtr& entry)>;
+
+    explicit ResponseCache(const Limits& limits, QObject* parent = nullptr);
+    ~ResponseCache() override;
+
+    static ResponseCache* instance();
+
+    ///
+    /// Returns the cache key of a GET for \a authority and \a path.
+    ///
+    static QByteArray key(const QByteArray& authority, const QByteArray& path);
+
+    ///
+    /// Looks \a request up under \a key. Hit and Stale set \a entry. Stale and
+    /// Miss make the caller the fetcher, which must end with store(), refresh()
+    /// or abandon(). Wait invokes \a callback unless \a context is destroyed first.
+    ///
+    Result lookup(const QByteArray& key, const httpparser::Request& request, EntryPtr& entry, QObject* context, Callback callback);
+
+    ///
+    /// Builds the entry for \a response to \a request, null when it may not be
+    /// stored. \a requestTime and \a responseTime are ms since epoch.
+    ///
+    QSharedPointer<Entry> prepare(const httpparser::Request& request, const httpparser::Response& response, qint64 requestTime, qint64 responseTime) const;
+
+    ///
+    /// Whether a body of \a size bytes still fits an entry.
+    ///
+    bool fits(qint64 size) const;
+
+    ///
+    /// Completes a fetch with \a entry (prepared, the body filled in) and wakes the waiters.
+    ///
+    void store(const QByteArray& key, const EntryPtr& entry);
+
+    ///
+    /// Completes a revalidating fetch answered 304: merges \a notModified into
+    /// \a stale, stores and returns the result.
+    ///
+    EntryPtr refresh(const QByteArray& key, const EntryPtr& stale, const httpparser::Response& notModified, qint64 requestTime, qint64 responseTime);
+
+    ///
+    /// Completes a fetch that produced nothing to store, the waiters go to the origin.
+    ///
+    void abandon(const QByteArray& key);
+
+    ///
+    /// Returns the If-None-Match / If-Modified-Since header lines that revalidate \a entry.
+    ///
+    static QByteArray conditions(const Entry& entry);
+
+    ///
+    /// Renders \a entry for the client: head with the current Age, then the body.
+    ///
+    static QByteArray render(const Entry& entry, bool keepAlive);
+
+    quint64 hits() const;
+    quint64 misses() const;
+    quint64 revalidated() const;
+    quint64 coalesced() const;
+
+  private:
+    struct DiskEntry {
+        QString path;
+        bool keep = false;  // set on shutdown, evicted files are removed
+
+        ~DiskEntry();
+    };
+
+    struct Waiter {
+        QObject* dispatcher = nullptr;
+        QPointer<QObject> context;
+        Callback callback;
+    };
+
+    void insert(const QByteArray& key, const EntryPtr& entry);
+    void complete(const QByteArray& key, const EntryPtr& entry);
+    void scanDisk();
+    void writeDisk(const QByteArray& key, const EntryPtr& entry);
+
+    static QObject* dispatcher();
+
+    const Limits _limits;
+    QMutex _lock;
+    QCache<QByteArray, EntryPtr> _memory;
+    QCache<QByteArray, DiskEntry> _disk;
+    QHash<QByteArray, QVector<Waiter>> _inflight;
+    QThreadPool _writer;
+    std::atomic<quint64> _serial{0};
+    std::atomic<quint64> _hits{0};
+    std::atomic<quint64> _misses{0};
+    std::atomic<quint64> _revalidated{0};
+    std::atomic<quint64> _coalesced{0};
+
+    static ResponseCache* _instance;
+};
@@ -0,0 +1,203 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "slabpool.h"
+#include <atomic>
+
+static constexpr size_t kClasses[]  = {64, 128, 256, 512, 1024, 2048, 16 * 1024, 64 * 1024};
+static constexpr auto kClassCount   = static_cast<int>(sizeof(kClasses) / sizeof(kClasses[0]));
+static constexpr auto kSmallBuffer  = 6;  // 16 KiB
+static constexpr auto kLargeBuffer  = 7;  // 64 KiB
+static constexpr size_t kListBudget = 512 * 1024;  // bytes a single free list may hold on to
+
+static int classOf(size_t size) {
+    for (auto i = 0; i < kClassCount; ++i) {
+        if (size <= kClasses[i]) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int capacityOf(int index) {
+    return static_cast<int>(qMax<size_t>(8, kListBudget / kClasses[index]));
+}
+
+// written by the owning thread only, read by stats(): no read-modify-write needed
+static void bump(std::atomic<quint64>& counter, qint64 delta = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+///
+/// \brief The ThreadSlabs struct
+/// The calling thread's free lists, registered for stats() while the thread lives.
+///
+struct ThreadSlabs {
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct List {
+        FreeBlock* head = nullptr;
+        int count       = 0;
+        qint64 inUse    = 0;
+        std::atomic<quint64> hits{0};
+        std::atomic<quint64> misses{0};
+        std::atomic<quint64> highWater{0};
+        std::atomic<quint64> cached{0};
+    };
+
+    ThreadSlabs();
+    ~ThreadSlabs();
+
+    List lists[kClassCount];
+};
+
+///
+/// \brief The SlabRegistry struct
+/// Live per-thread pools plus the totals of those whose threads already exited.
+///
+struct SlabRegistry {
+    QMutex lock;
+    QVector<ThreadSlabs*> threads;
+    SlabPool::Stats retired[kClassCount];
+
+    static SlabRegistry& instance() {
+        static SlabRegistry registry;
+        return registry;
+    }
+};
+
+static thread_local bool tornDown = false;  // trivially destructible, safe to test during thread exit
+
+ThreadSlabs::ThreadSlabs() {
+    auto& registry = SlabRegistry::instance();
+    QMutexLocker locker(&registry.lock);
+    registry.threads.append(this);
+}
+
+ThreadSlabs::~ThreadSlabs() {
+    tornDown = true;
+
+    auto& registry = SlabRegistry::instance();
+    QMutexLocker locker(&registry.lock);
+    registry.threads.removeOne(this);
+
+    for (auto i = 0; i < kClassCount; ++i) {
+        auto& list    = lists[i];
+        auto& retired = registry.retired[i];
+        retired.hits      += list.hits.load(std::memory_order_relaxed);
+        retired.misses    += list.misses.load(std::memory_order_relaxed);
+        retired.highWater += list.highWater.load(std::memory_order_relaxed);
+
+        while (list.head) {
+            const auto block = list.head;
+            list.head = block->next;
+            ::operator delete(block);
+        }
+    }
+}
+
+static ThreadSlabs& threadSlabs() {
+    static thread_local ThreadSlabs slabs;
+    return slabs;
+}
+
+void* SlabPool::allocate(size_t size) {
+    const auto index = classOf(size);
+
+    if ((index < 0) || tornDown) {
+        return ::operator new(size);
+    }
+
+    auto& list = threadSlabs().lists[index];
+    void* block = nullptr;
+
+    if (list.head) {
+        block     = list.head;
+        list.head = list.head->next;
+        --list.count;
+        bump(list.hits);
+        bump(list.cached, -1);
+    } else {
+        block = ::operator new(kClasses[index]);
+        bump(list.misses);
+    }
+
+    if (++list.inUse > static_cast<qint64>(list.highWater.load(std::memory_order_relaxed))) {
+        list.highWater.store(static_cast<quint64>(list.inUse), std::memory_order_relaxed);
+    }
+
+    return block;
+}
+
+void SlabPool::release(void* block, size_t size) {
+    if (!block) {
+        return;
+    }
+
+    const auto index = classOf(size);
+
+    if ((index < 0) || tornDown) {
+        ::operator delete(block);
+        return;
+    }
+
+    auto& list = threadSlabs().lists[index];
+    --list.inUse;
+
+    if (list.count >= capacityOf(index)) {
+        ::operator delete(block);
+        return;
+    }
+
+    auto freeBlock  = static_cast<ThreadSlabs::FreeBlock*>(block);
+    freeBlock->next = list.head;
+    list.head       = freeBlock;
+    ++list.count;
+    bump(list.cached);
+}
+
+QVector<SlabPool::Stats> SlabPool::stats() {
+    QVector<Stats> stats(kClassCount);
+    auto& registry = SlabRegistry::instance();
+    QMutexLocker locker(&registry.lock);
+
+    for (auto i = 0; i < kClassCount; ++i) {
+        auto& entry = stats[i];
+        entry       = registry.retired[i];
+        entry.size  = kClasses[i];
+
+        for (auto slabs : qAsConst(registry.threads)) {
+            const auto& list = slabs->lists[i];
+            entry.hits      += list.hits.load(std::memory_order_relaxed);
+            entry.misses    += list.misses.load(std::memory_order_relaxed);
+            entry.highWater += list.highWater.load(std::memory_order_relaxed);
+            entry.cached    += list.cached.load(std::memory_order_relaxed);
+        }
+    }
+
+    return stats;
+}
+
+SlabPool::Buffer::Buffer(qint64 size) :
+    _capacity{static_cast<qint64>(kClasses[(size <= static_cast<qint64>(kClasses[kSmallBuffer])) ? kSmallBuffer : kLargeBuffer])},
+    _data{static_cast<char*>(SlabPool::allocate(static_cast<size_t>(_capacity)))} {}
+
+SlabPool::Buffer::~Buffer() {
+    SlabPool::release(_data, static_cast<size_t>(_capacity));
+}
@@ -0,0 +1,96 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <QtNetwork>
+
+///
+/// \brief The SlabPool class
+/// Per-thread free lists of fixed-size blocks: small classes for connection
+/// objects and 16/64 KiB classes for relay buffers. Every thread owns its lists,
+/// so allocate() and release() never lock; a block released on another thread
+/// just joins that thread's list. Sizes above the largest class and anything
+/// past a list's cap go to the global allocator.
+///
+class SlabPool final {
+  public:
+    struct Stats {
+        quint64 size      = 0;
+        quint64 hits      = 0;  // served from a free list
+        quint64 misses    = 0;  // fell through to the global allocator
+        quint64 highWater = 0;  // peak blocks in use, per-thread peaks summed
+        quint64 cached    = 0;  // blocks parked in free lists right now
+    };
+
+    static void* allocate(size_t size);
+    static void release(void* block, size_t size);
+
+    ///
+    /// Returns one entry per size class, aggregated over all threads.
+    ///
+    static QVector<Stats> stats();
+
+    ///
+    /// \brief The Buffer class
+    /// Scoped relay buffer from the 16 or 64 KiB class, whichever fits \a size.
+    ///
+    class Buffer final {
+      public:
+        explicit Buffer(qint64 size);
+        ~Buffer();
+
+        char* data() const {
+            return _data;
+        }
+
+        qint64 capacity() const {
+            return _capacity;
+        }
+
+      private:
+        Q_DISABLE_COPY(Buffer)
+
+        const qint64 _capacity;
+        char* const _data;
+    };
+};
+
+///
+/// \brief The SlabAllocated class
+/// Base for classes whose instances come from SlabPool. Release relies on the
+/// sized delete, so the hierarchy needs a virtual destructor (any QObject has one).
+///
+class SlabAllocated {
+  public:
+    static void* operator new(size_t size) {
+        return SlabPool::allocate(size);
+    }
+
+    static void operator delete(void* block, size_t size) {
+        SlabPool::release(block, size);
+    }
+};
+
+///
+/// \brief The PooledTcpSocket class
+/// QTcpSocket whose object storage is recycled through SlabPool.
+///
+class PooledTcpSocket final : public QTcpSocket, public SlabAllocated {
+  public:
+    using QTcpSocket::QTcpSocket;
+};
@@ -0,0 +1,106 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+
+///
+/// \brief The SlotTable class
+/// Flat array of slots with a free list. Ids pack the slot index with the slot's
+/// generation, which is bumped on every remove, so an id outliving its entry never
+/// matches whatever reuses the slot. Insert, lookup and remove are O(1) and entries
+/// live inline, nothing is allocated per entry once the array has grown.
+///
+template <typename T>
+class SlotTable final {
+  public:
+    using Id = quint64;
+
+    static constexpr Id kInvalid = 0;
+
+    static quint32 indexOf(Id id) {
+        return static_cast<quint32>(id);
+    }
+
+    static quint32 generationOf(Id id) {
+        return static_cast<quint32>(id >> 32);
+    }
+
+    Id insert(T value) {
+        quint32 index = 0;
+
+        if (!_free.isEmpty()) {
+            index = _free.takeLast();
+        } else {
+            index = static_cast<quint32>(_slots.size());
+            _slots.append({});
+        }
+
+        auto& slot = _slots[index];
+        slot.value = std::move(value);
+        slot.used  = true;
+        ++_size;
+        return (Id{slot.generation} << 32) | index;
+    }
+
+    T* find(Id id) {
+        const auto index = indexOf(id);
+
+        if (index >= static_cast<quint32>(_slots.size())) {
+            return nullptr;
+        }
+
+        auto& slot = _slots[index];
+        return (slot.used && (slot.generation == generationOf(id))) ? &slot.value : nullptr;
+    }
+
+    ///
+    /// Removes the entry for \a id and returns its value, a default one if the id is stale.
+    ///
+    T take(Id id) {
+        if (!find(id)) {
+            return T{};
+        }
+
+        const auto index = indexOf(id);
+        auto& slot       = _slots[index];
+        auto value       = std::move(slot.value);
+        slot.value       = T{};
+        slot.used        = false;
+
+        // generation 0 never appears so that kInvalid stays invalid
+        slot.generation = qMax<quint32>(1, slot.generation + 1);
+        _free.append(index);
+        --_size;
+        return value;
+    }
+
+    int size() const {
+        return _size;
+    }
+
+  private:
+    struct Slot {
+        T value{};
+        quint32 generation = 1;
+        bool used          = false;
+    };
+
+    QVector<Slot> _slots;
+    QVector<quint32> _free;
+    int _size = 0;
+};
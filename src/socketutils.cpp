@@ -0,0 +1,367 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "socketutils.h"
+
+#ifdef Q_OS_LINUX
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <sys/un.h>
+# include <unistd.h>
+
+static constexpr auto kMaxDescriptors = 64;
+static constexpr auto kFastOpenQueue  = 256;  // pending TFO requests a listener keeps
+
+static socklen_t toSockAddr(const QHostAddress& address, quint16 port, sockaddr_storage& storage) {
+    storage = {};
+
+    if (address.protocol() == QAbstractSocket::IPv4Protocol) {
+        auto sin             = reinterpret_cast<sockaddr_in*>(&storage);
+        sin->sin_family      = AF_INET;
+        sin->sin_port        = htons(port);
+        sin->sin_addr.s_addr = htonl(address.toIPv4Address());
+        return sizeof(sockaddr_in);
+    }
+
+    // IPv6 and QHostAddress::Any (dual-stack)
+    auto sin6         = reinterpret_cast<sockaddr_in6*>(&storage);
+    const auto ip6    = address.toIPv6Address();
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port   = htons(port);
+    memcpy(&sin6->sin6_addr, ip6.c, sizeof(ip6.c));
+    return sizeof(sockaddr_in6);
+}
+
+#endif // Q_OS_LINUX
+
+bool SocketTuning::beforeConnect() const {
+    // buffer sizes set after the handshake no longer affect window scaling
+    return fastOpen || (sendBuffer > 0) || (receiveBuffer > 0);
+}
+
+void tuneSocket(qintptr fd, const SocketTuning& tuning, bool connecting) {
+#ifdef Q_OS_LINUX
+    const auto socket = static_cast<int>(fd);
+    const int on      = 1;
+    const int noDelay   = tuning.noDelay ? 1 : 0;
+    const int keepAlive = tuning.keepAlive ? 1 : 0;
+    ::setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    ::setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(keepAlive));
+
+    if (tuning.quickAck) {
+        ::setsockopt(socket, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    }
+
+    if (tuning.sendBuffer > 0) {
+        ::setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &tuning.sendBuffer, sizeof(tuning.sendBuffer));
+    }
+
+    if (tuning.receiveBuffer > 0) {
+        ::setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &tuning.receiveBuffer, sizeof(tuning.receiveBuffer));
+    }
+
+    if (tuning.keepAlive && (tuning.keepAliveIdle > 0)) {
+        ::setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &tuning.keepAliveIdle, sizeof(tuning.keepAliveIdle));
+    }
+
+    if (tuning.keepAlive && (tuning.keepAliveInterval > 0)) {
+        ::setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &tuning.keepAliveInterval, sizeof(tuning.keepAliveInterval));
+    }
+
+    if (tuning.keepAlive && (tuning.keepAliveCount > 0)) {
+        ::setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &tuning.keepAliveCount, sizeof(tuning.keepAliveCount));
+    }
+
+# ifdef TCP_FASTOPEN_CONNECT
+
+    if (connecting && tuning.fastOpen) {
+        // connect() returns right away and the SYN leaves with the first write
+        ::setsockopt(socket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+    }
+
+# else // ifdef TCP_FASTOPEN_CONNECT
+    Q_UNUSED(connecting)
+# endif // TCP_FASTOPEN_CONNECT
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(fd)
+    Q_UNUSED(tuning)
+    Q_UNUSED(connecting)
+#endif // Q_OS_LINUX
+}
+
+void tuneSocket(QAbstractSocket& socket, const SocketTuning& tuning, bool connecting) {
+#ifdef Q_OS_LINUX
+    tuneSocket(socket.socketDescriptor(), tuning, connecting);
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(connecting)
+
+    // the portable subset, probe timing and the Linux extensions stay at the OS defaults
+    socket.setSocketOption(QAbstractSocket::LowDelayOption, tuning.noDelay ? 1 : 0);
+
+    if (tuning.sendBuffer > 0) {
+        socket.setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, tuning.sendBuffer);
+    }
+
+    if (tuning.receiveBuffer > 0) {
+        socket.setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption, tuning.receiveBuffer);
+    }
+
+    socket.setSocketOption(QAbstractSocket::KeepAliveOption, tuning.keepAlive ? 1 : 0);
+#endif // Q_OS_LINUX
+}
+
+void tuneListener(qintptr fd, const SocketTuning& tuning) {
+#ifdef Q_OS_LINUX
+    const auto queue = kFastOpenQueue;
+
+    if (tuning.fastOpen && (::setsockopt(static_cast<int>(fd), IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue)) < 0)) {
+        qWarning() << QStringLiteral("TCP_FASTOPEN failed:") << qt_error_string(errno);
+    }
+
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(fd)
+    Q_UNUSED(tuning)
+#endif // Q_OS_LINUX
+}
+
+qintptr openListenSocket(const QHostAddress& address, quint16 port, bool reusePort) {
+#ifdef Q_OS_LINUX
+    sockaddr_storage storage;
+    const auto length = toSockAddr(address, port, storage);
+    const auto fd     = ::socket(storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+
+    if (fd < 0) {
+        qWarning() << QStringLiteral("socket() failed:") << qt_error_string(errno);
+        return -1;
+    }
+
+    int on  = 1;
+    int off = 0;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (reusePort && (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)) {
+        qWarning() << QStringLiteral("SO_REUSEPORT failed:") << qt_error_string(errno);
+        ::close(fd);
+        return -1;
+    }
+
+    if (address == QHostAddress::Any) {
+        ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    }
+
+    if ((::bind(fd, reinterpret_cast<sockaddr*>(&storage), length) < 0) || (::listen(fd, SOMAXCONN) < 0)) {
+        qWarning() << QStringLiteral("bind/listen failed:") << qt_error_string(errno);
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(address)
+    Q_UNUSED(port)
+    Q_UNUSED(reusePort)
+    return -1;
+#endif // Q_OS_LINUX
+}
+
+qintptr openConnectSocket(const QHostAddress& address, quint16 port, bool& inProgress, const SocketTuning& tuning) {
+#ifdef Q_OS_LINUX
+    sockaddr_storage storage;
+    const auto length = toSockAddr(address, port, storage);
+    const auto fd     = ::socket(storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    tuneSocket(fd, tuning, true);
+
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&storage), length) == 0) {
+        inProgress = false;
+        return fd;
+    }
+
+    if (errno == EINPROGRESS) {
+        inProgress = true;
+        return fd;
+    }
+
+    ::close(fd);
+    return -1;
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(address)
+    Q_UNUSED(port)
+    Q_UNUSED(tuning)
+    inProgress = false;
+    return -1;
+#endif // Q_OS_LINUX
+}
+
+int socketError(qintptr fd) {
+#ifdef Q_OS_LINUX
+    int error      = 0;
+    socklen_t size = sizeof(error);
+
+    if (::getsockopt(static_cast<int>(fd), SOL_SOCKET, SO_ERROR, &error, &size) < 0) {
+        return errno;
+    }
+
+    return error;
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(fd)
+    return -1;
+#endif // Q_OS_LINUX
+}
+
+QHostAddress peerAddress(qintptr fd) {
+#ifdef Q_OS_LINUX
+    sockaddr_storage storage{};
+    socklen_t length = sizeof(storage);
+
+    if (::getpeername(static_cast<int>(fd), reinterpret_cast<sockaddr*>(&storage), &length) < 0) {
+        return {};
+    }
+
+    QHostAddress address(reinterpret_cast<const sockaddr*>(&storage));
+    auto mapped    = false;
+    const auto ip4 = address.toIPv4Address(&mapped);
+    return mapped ? QHostAddress(ip4) : address;
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(fd)
+    return {};
+#endif // Q_OS_LINUX
+}
+
+void closeSocket(qintptr fd) {
+#ifdef Q_OS_LINUX
+
+    if (fd >= 0) {
+        ::close(static_cast<int>(fd));
+    }
+
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(fd)
+#endif // Q_OS_LINUX
+}
+
+void refuseSocket(qintptr fd, const QByteArray& response) {
+#ifdef Q_OS_LINUX
+
+    if (fd >= 0) {
+        Q_UNUSED(::send(static_cast<int>(fd), response.constData(), static_cast<size_t>(response.size()), MSG_NOSIGNAL | MSG_DONTWAIT))
+        ::close(static_cast<int>(fd));
+    }
+
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(fd)
+    Q_UNUSED(response)
+#endif // Q_OS_LINUX
+}
+
+bool sendDescriptors(qintptr socket, const QVector<qintptr>& fds) {
+#ifdef Q_OS_LINUX
+    const auto count = qMin(fds.size(), kMaxDescriptors);
+    char control[CMSG_SPACE(sizeof(int) * kMaxDescriptors)] = {};
+    char byte = static_cast<char>(count);
+    iovec io{&byte, 1};
+
+    msghdr message{};
+    message.msg_iov        = &io;
+    message.msg_iovlen     = 1;
+    message.msg_control    = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    auto header        = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type  = SCM_RIGHTS;
+    header->cmsg_len   = CMSG_LEN(sizeof(int) * count);
+
+    auto data = reinterpret_cast<int*>(CMSG_DATA(header));
+
+    for (auto i = 0; i < count; ++i) {
+        data[i] = static_cast<int>(fds.at(i));
+    }
+
+    return ::sendmsg(static_cast<int>(socket), &message, MSG_NOSIGNAL) == 1;
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(socket)
+    Q_UNUSED(fds)
+    return false;
+#endif // Q_OS_LINUX
+}
+
+QVector<qintptr> receiveDescriptors(const QString& path, int timeout) {
+    QVector<qintptr> fds;
+#ifdef Q_OS_LINUX
+    const auto name = QFile::encodeName(path);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+
+    if (name.size() >= static_cast<int>(sizeof(address.sun_path))) {
+        qWarning() << QStringLiteral("Handoff path too long:") << path;
+        return fds;
+    }
+
+    memcpy(address.sun_path, name.constData(), static_cast<size_t>(name.size()));
+    const auto fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        return fds;
+    }
+
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        ::close(fd);  // no running instance to take over from
+        return fds;
+    }
+
+    timeval wait{timeout / 1000, (timeout % 1000) * 1000};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+
+    char control[CMSG_SPACE(sizeof(int) * kMaxDescriptors)] = {};
+    char byte = 0;
+    iovec io{&byte, 1};
+
+    msghdr message{};
+    message.msg_iov        = &io;
+    message.msg_iovlen     = 1;
+    message.msg_control    = control;
+    message.msg_controllen = sizeof(control);
+
+    if (::recvmsg(fd, &message, MSG_CMSG_CLOEXEC) == 1) {
+        for (auto header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+            if ((header->cmsg_level != SOL_SOCKET) || (header->cmsg_type != SCM_RIGHTS)) {
+                continue;
+            }
+
+            const auto data  = reinterpret_cast<const int*>(CMSG_DATA(header));
+            const auto count = static_cast<int>((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+
+            for (auto i = 0; i < count; ++i) {
+                fds.append(data[i]);
+            }
+        }
+    } else {
+        qWarning() << QStringLiteral("Handoff from the running instance failed:") << qt_error_string(errno);
+    }
+
+    ::close(fd);
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(path)
+    Q_UNUSED(timeout)
+#endif // Q_OS_LINUX
+    return fds;
+}
@@ -0,0 +1,103 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <QtNetwork>
+
+// Thin helpers over the BSD socket API for the paths that cannot go through
+// QTcpServer/QTcpSocket. POSIX only, they fail with -1 everywhere else.
+
+///
+/// \brief The SocketTuning struct
+/// TCP options for client and upstream sockets, zero leaves the OS default.
+///
+struct SocketTuning {
+    bool noDelay          = true;   // TCP_NODELAY
+    bool quickAck         = false;  // TCP_QUICKACK, Linux only
+    bool fastOpen         = false;  // TCP_FASTOPEN on listeners, TCP_FASTOPEN_CONNECT upstream, Linux only
+    bool keepAlive        = true;   // SO_KEEPALIVE
+    int sendBuffer        = 0;      // SO_SNDBUF bytes
+    int receiveBuffer     = 0;      // SO_RCVBUF bytes
+    int keepAliveIdle     = 0;      // s before the first probe
+    int keepAliveInterval = 0;      // s between probes
+    int keepAliveCount    = 0;      // unanswered probes before the peer counts as dead
+
+    ///
+    /// Whether an upstream socket needs these options before it connects.
+    ///
+    bool beforeConnect() const;
+};
+
+///
+/// Applies \a tuning to the socket \a fd, \a connecting when it has not connected yet
+/// (that is when Fast Open can still be requested).
+///
+void tuneSocket(qintptr fd, const SocketTuning& tuning, bool connecting = false);
+
+///
+/// Applies \a tuning to \a socket, through the descriptor where Qt has no option for it.
+///
+void tuneSocket(QAbstractSocket& socket, const SocketTuning& tuning, bool connecting = false);
+
+///
+/// Enables TCP Fast Open on the listening socket \a fd when \a tuning asks for it.
+///
+void tuneListener(qintptr fd, const SocketTuning& tuning);
+
+///
+/// Creates a non-blocking listening socket bound to \a address:\a port,
+/// optionally with SO_REUSEPORT. QHostAddress::Any binds dual-stack.
+///
+qintptr openListenSocket(const QHostAddress& address, quint16 port, bool reusePort);
+
+///
+/// Starts a non-blocking connect to \a address:\a port with \a tuning and returns the socket.
+/// \a inProgress tells whether completion has to be awaited for writability.
+///
+qintptr openConnectSocket(const QHostAddress& address, quint16 port, bool& inProgress, const SocketTuning& tuning = {});
+
+///
+/// Returns the pending error of \a fd (SO_ERROR), 0 when the connect succeeded.
+///
+int socketError(qintptr fd);
+
+///
+/// The remote address of the connected socket \a fd, IPv4-mapped addresses as IPv4.
+///
+QHostAddress peerAddress(qintptr fd);
+
+///
+/// Closes \a fd.
+///
+void closeSocket(qintptr fd);
+
+///
+/// Writes \a response to the accepted \a fd as far as it goes without blocking, then closes it.
+///
+void refuseSocket(qintptr fd, const QByteArray& response);
+
+///
+/// Passes \a fds over the connected Unix domain socket \a socket (SCM_RIGHTS).
+///
+bool sendDescriptors(qintptr socket, const QVector<qintptr>& fds);
+
+///
+/// Connects to the Unix domain socket at \a path and waits up to \a timeout ms
+/// for descriptors sent with sendDescriptors(). Empty when nobody is listening.
+///
+QVector<qintptr> receiveDescriptors(const QString& path, int timeout);
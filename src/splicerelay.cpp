@@ -0,0 +1,188 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "splicerelay.h"
+
+#ifdef Q_OS_LINUX
+# include <fcntl.h>
+# include <sys/socket.h>
+# include <unistd.h>
+#endif // Q_OS_LINUX
+
+static constexpr qint64 kSpliceChunk = 64 * 1024;
+
+SpliceRelay::SpliceRelay(qintptr downStream, qintptr upStream, QObject* parent) : QObject(parent),
+    _downStream{downStream}, _upStream{upStream} {
+    _directions[0].from = static_cast<int>(downStream);
+    _directions[0].to   = static_cast<int>(upStream);
+    _directions[1].from = static_cast<int>(upStream);
+    _directions[1].to   = static_cast<int>(downStream);
+}
+
+SpliceRelay::~SpliceRelay() {
+#ifdef Q_OS_LINUX
+
+    for (auto& direction : _directions) {
+        delete direction.readNotifier;
+        delete direction.writeNotifier;
+
+        for (auto fd : direction.pipe) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    }
+
+    if (_downStream >= 0) {
+        ::close(static_cast<int>(_downStream));
+    }
+
+    if (_upStream >= 0) {
+        ::close(static_cast<int>(_upStream));
+    }
+
+#endif // Q_OS_LINUX
+}
+
+bool SpliceRelay::isSupported() {
+#ifdef Q_OS_LINUX
+    return true;
+#else // ifdef Q_OS_LINUX
+    return false;
+#endif // Q_OS_LINUX
+}
+
+bool SpliceRelay::start() {
+#ifdef Q_OS_LINUX
+
+    for (auto& direction : _directions) {
+        if (::pipe2(direction.pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            qWarning() << QStringLiteral("pipe2() failed:") << qt_error_string(errno);
+            return false;
+        }
+
+        ::fcntl(direction.pipe[1], F_SETPIPE_SZ, static_cast<int>(kSpliceChunk));
+        ::fcntl(direction.from, F_SETFL, ::fcntl(direction.from, F_GETFL) | O_NONBLOCK);
+
+        auto current = &direction;
+        direction.readNotifier  = new QSocketNotifier(direction.from, QSocketNotifier::Read);
+        direction.writeNotifier = new QSocketNotifier(direction.to, QSocketNotifier::Write);
+        direction.writeNotifier->setEnabled(false);
+        QObject::connect(direction.readNotifier,  &QSocketNotifier::activated, this, [this, current]() {
+            pump(*current);
+        });
+        QObject::connect(direction.writeNotifier, &QSocketNotifier::activated, this, [this, current]() {
+            pump(*current);
+        });
+    }
+
+    // the peer may have sent data between the handoff and now
+    pump(_directions[0]);
+    pump(_directions[1]);
+    return true;
+#else // ifdef Q_OS_LINUX
+    return false;
+#endif // Q_OS_LINUX
+}
+
+quint64 SpliceRelay::bytesUp() const {
+    return _directions[0].total;
+}
+
+quint64 SpliceRelay::bytesDown() const {
+    return _directions[1].total;
+}
+
+void SpliceRelay::pump(Direction& direction) {
+#ifdef Q_OS_LINUX
+
+    while (!_finished && !direction.done) {
+        if (!direction.eof && (direction.queued < kSpliceChunk)) {
+            const auto received = ::splice(direction.from, nullptr, direction.pipe[1], nullptr,
+                                           static_cast<size_t>(kSpliceChunk - direction.queued),
+                                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (received > 0) {
+                direction.queued += received;
+            } else if (received == 0) {
+                direction.eof = true;
+            } else if ((errno != EAGAIN) && (errno != EINTR)) {
+                finish();
+                return;
+            }
+        }
+
+        if (direction.queued > 0) {
+            const auto sent = ::splice(direction.pipe[0], nullptr, direction.to, nullptr,
+                                       static_cast<size_t>(direction.queued),
+                                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (sent > 0) {
+                direction.queued -= sent;
+                direction.total  += static_cast<quint64>(sent);
+            } else if ((sent < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+                finish();
+                return;
+            } else {
+                // the receiver is full: stop reading until it drains
+                direction.readNotifier->setEnabled(false);
+                direction.writeNotifier->setEnabled(true);
+                return;
+            }
+        } else if (direction.eof) {
+            // half-close: forward the FIN and keep serving the other direction
+            ::shutdown(direction.to, SHUT_WR);
+            direction.done = true;
+            direction.readNotifier->setEnabled(false);
+            direction.writeNotifier->setEnabled(false);
+
+            if (_directions[0].done && _directions[1].done) {
+                finish();
+            }
+
+            return;
+        } else {
+            // nothing buffered and nothing to read
+            direction.writeNotifier->setEnabled(false);
+            direction.readNotifier->setEnabled(true);
+            return;
+        }
+    }
+
+#else // ifdef Q_OS_LINUX
+    Q_UNUSED(direction)
+#endif // Q_OS_LINUX
+}
+
+void SpliceRelay::finish() {
+    if (_finished) {
+        return;
+    }
+
+    _finished = true;
+
+    for (auto& direction : _directions) {
+        if (direction.readNotifier) {
+            direction.readNotifier->setEnabled(false);
+        }
+
+        if (direction.writeNotifier) {
+            direction.writeNotifier->setEnabled(false);
+        }
+    }
+
+    Q_EMIT finished();
+}
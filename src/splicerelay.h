@@ -0,0 +1,63 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+
+///
+/// \brief The SpliceRelay class
+/// Moves bytes between two connected sockets through a kernel pipe with splice(2),
+/// without copying them into user space. Takes ownership of both descriptors.
+/// Only functional on Linux, isSupported() reports false elsewhere.
+///
+class SpliceRelay final : public QObject {
+    Q_OBJECT
+
+  public:
+    SpliceRelay(qintptr downStream, qintptr upStream, QObject* parent = nullptr);
+    ~SpliceRelay() override;
+
+    static bool isSupported();
+
+    bool    start();
+    quint64 bytesUp() const;
+    quint64 bytesDown() const;
+
+  Q_SIGNALS:
+    void finished();
+
+  private:
+    struct Direction {
+        int from     = -1;
+        int to       = -1;
+        int pipe[2]  = {-1, -1};
+        qint64 queued = 0;  // bytes sitting in the pipe
+        quint64 total = 0;
+        bool eof      = false;
+        bool done     = false;
+        QSocketNotifier* readNotifier  = nullptr;
+        QSocketNotifier* writeNotifier = nullptr;
+    };
+
+    void pump(Direction& direction);
+    void finish();
+
+    qintptr _downStream = -1;
+    qintptr _upStream   = -1;
+    Direction _directions[2];
+    bool _finished = false;
+};
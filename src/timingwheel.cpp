@@ -0,0 +1,160 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "timingwheel.h"
+
+TimingWheel::Timer::Timer(std::function<void()> callback) : _callback{std::move(callback)} {
+}
+
+TimingWheel::Timer::~Timer() {
+    if (_wheel) {
+        _wheel->stop(*this);
+    }
+}
+
+TimingWheel::TimingWheel(int resolution) : _resolution{qMax(1, resolution)} {
+    _clock.start();
+}
+
+TimingWheel::~TimingWheel() {
+    // detach whatever is still armed so late Timer destructors do not reach back
+    for (auto& level : _slots) {
+        for (auto& slot : level) {
+            while (slot) {
+                unlink(*slot);
+            }
+        }
+    }
+}
+
+void TimingWheel::start(Timer& timer, qint64 msecs) {
+    stop(timer);
+
+    if (_size == 0) {
+        // nobody drove the wheel while it was empty, catch up so the timer is not already due
+        _tick = qMax(_tick, static_cast<quint64>(_clock.elapsed() / _resolution));
+    }
+
+    const auto ticks = qMax<qint64>(1, (msecs + _resolution - 1) / _resolution);
+    timer._expires   = _tick + static_cast<quint64>(ticks);
+    link(timer);
+}
+
+void TimingWheel::stop(Timer& timer) {
+    if (timer._wheel == this) {
+        unlink(timer);
+    }
+}
+
+void TimingWheel::advance() {
+    const auto target = static_cast<quint64>(_clock.elapsed() / _resolution);
+
+    if (_size == 0) {
+        // nothing armed, no need to walk the idle ticks one by one
+        _tick = qMax(_tick, target);
+        return;
+    }
+
+    while (_tick < target) {
+        ++_tick;
+
+        // pull the next stretch of each upper level down once the level below wraps
+        for (auto level = 1; level < kLevels; ++level) {
+            if ((_tick & ((quint64{1} << (kBits * level)) - 1)) != 0) {
+                break;
+            }
+
+            cascade(level);
+        }
+
+        auto& slot = _slots[0][_tick & (kSlots - 1)];
+
+        // a callback may re-arm itself, but never into the slot being drained
+        while (auto timer = slot) {
+            unlink(*timer);
+            timer->_callback();
+        }
+    }
+}
+
+int TimingWheel::resolution() const {
+    return _resolution;
+}
+
+int TimingWheel::size() const {
+    return _size;
+}
+
+void TimingWheel::link(Timer& timer) {
+    // an overdue timer goes to the current tick, advance() drains that slot right after cascading
+    timer._expires   = qMax(timer._expires, _tick);
+    const auto delta = timer._expires - _tick;
+    auto level       = 0;
+
+    while ((level < kLevels - 1) && (delta >= (quint64{1} << (kBits * (level + 1))))) {
+        ++level;
+    }
+
+    if (level == kLevels - 1) {
+        // beyond the wheel's span (~19 days at 100 ms): clamp to the farthest tick it can hold
+        const auto span = (quint64{1} << (kBits * kLevels)) - 1;
+        timer._expires  = qMin(timer._expires, _tick + span);
+    }
+
+    auto& slot    = _slots[level][(timer._expires >> (kBits * level)) & (kSlots - 1)];
+    timer._wheel = this;
+    timer._slot  = &slot;
+    timer._prev  = nullptr;
+    timer._next  = slot;
+
+    if (slot) {
+        slot->_prev = &timer;
+    }
+
+    slot = &timer;
+    ++_size;
+}
+
+void TimingWheel::unlink(Timer& timer) {
+    if (timer._prev) {
+        timer._prev->_next = timer._next;
+    } else {
+        *timer._slot = timer._next;
+    }
+
+    if (timer._next) {
+        timer._next->_prev = timer._prev;
+    }
+
+    timer._wheel = nullptr;
+    timer._slot  = nullptr;
+    timer._prev  = nullptr;
+    timer._next  = nullptr;
+    --_size;
+}
+
+void TimingWheel::cascade(int level) {
+    auto& slot = _slots[level][(_tick >> (kBits * level)) & (kSlots - 1)];
+    auto timer = slot;
+    slot       = nullptr;
+
+    while (timer) {
+        const auto next = timer->_next;
+        --_size;
+        link(*timer);
+        timer = next;
+    }
+}
@@ -0,0 +1,88 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <functional>
+
+///
+/// \brief The TimingWheel class
+/// Hierarchical timing wheel (four levels of 64 slots) for coarse per-connection
+/// timeouts. Timers are intrusive list nodes, so starting, restarting and stopping
+/// one is O(1) and allocation free, and a tick only touches the slot that is due
+/// plus an occasional cascade from the level above. Not thread safe: each worker
+/// thread owns one wheel and drives it with advance().
+///
+class TimingWheel final {
+  public:
+    ///
+    /// \brief The Timer class
+    /// One-shot timer owned by its user, stopped automatically on destruction.
+    ///
+    class Timer final {
+      public:
+        explicit Timer(std::function<void()> callback);
+        ~Timer();
+
+        bool isActive() const {
+            return _wheel != nullptr;
+        }
+
+      private:
+        Q_DISABLE_COPY(Timer)
+        friend class TimingWheel;
+
+        TimingWheel* _wheel = nullptr;
+        Timer** _slot       = nullptr;  // head of the list this timer is linked in
+        Timer* _prev        = nullptr;
+        Timer* _next        = nullptr;
+        quint64 _expires    = 0;  // in ticks
+        const std::function<void()> _callback;
+    };
+
+    explicit TimingWheel(int resolution);
+    ~TimingWheel();
+
+    ///
+    /// (Re)arms \a timer to fire after \a msecs, rounded up to whole ticks.
+    ///
+    void start(Timer& timer, qint64 msecs);
+    void stop(Timer& timer);
+
+    ///
+    /// Fires every timer that is due by now.
+    ///
+    void advance();
+
+    int resolution() const;
+    int size() const;
+
+  private:
+    static constexpr int kBits   = 6;
+    static constexpr int kSlots  = 1 << kBits;
+    static constexpr int kLevels = 4;
+
+    void link(Timer& timer);
+    void unlink(Timer& timer);
+    void cascade(int level);
+
+    const int _resolution;
+    QElapsedTimer _clock;
+    quint64 _tick = 0;
+    int _size     = 0;
+    Timer* _slots[kLevels][kSlots] = {};
+};
@@ -0,0 +1,185 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "tracing.h"
+#include "metrics.h"
+
+static constexpr auto kIdleSleep  = 100;  // ms between writes
+static constexpr auto kMaxPending = 4 * 1024 * 1024;  // bytes buffered before traces are dropped
+static constexpr auto kStages     = static_cast<int>(Tracer::Stage::Count);
+
+// what the gap ending at each stage is called, Started has none
+static constexpr const char* kSpanNames[] = {nullptr, "head", "resolve", "connect", "respond", "finish"};
+
+static_assert(sizeof(kSpanNames) / sizeof(kSpanNames[0]) == kStages, "a span name per stage");
+
+Tracer* Tracer::_instance = nullptr;
+
+///
+/// \brief The TracerWriter class
+/// Appends exported traces to the trace file until the tracer is destroyed.
+///
+class TracerWriter final : public QThread {
+  public:
+    explicit TracerWriter(Tracer& tracer) : _tracer{tracer} {
+        setObjectName(QStringLiteral("Tracer"));
+    }
+
+    void stop() {
+        _stopping.store(true);
+    }
+
+  protected:
+    void run() override {
+        QFile file(_tracer._options.path);
+
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+            qWarning() << QStringLiteral("Failed to open the trace file:") << file.errorString();
+        }
+
+        // the JSON array format, viewers accept it without the closing bracket
+        if (file.isOpen() && (file.size() == 0)) {
+            file.write("[\n");
+        }
+
+        for (;;) {
+            const auto stopping = _stopping.load();
+            QByteArray batch;
+            {
+                QMutexLocker locker(&_tracer._lock);
+                batch.swap(_tracer._pending);
+            }
+
+            if (!batch.isEmpty()) {
+                file.write(batch);
+                file.flush();
+            }
+
+            if (stopping) {
+                break;
+            }
+
+            QThread::msleep(kIdleSleep);
+        }
+    }
+
+  private:
+    Tracer& _tracer;
+    std::atomic<bool> _stopping{false};
+};
+
+static const QElapsedTimer& traceClock() {
+    static const auto timer = []() {
+        QElapsedTimer started;
+        started.start();
+        return started;
+    }();
+    return timer;
+}
+
+Tracer::Tracer(const Options& options) : _options{options} {
+    traceClock();
+
+    if (!_options.path.isEmpty()) {
+        _writer = new TracerWriter(*this);
+        _writer->start(QThread::LowPriority);
+    }
+
+    _instance = this;
+}
+
+Tracer::~Tracer() {
+    if (_instance == this) {
+        _instance = nullptr;
+    }
+
+    if (_writer) {
+        _writer->stop();
+        _writer->wait();
+        delete _writer;
+    }
+}
+
+Tracer* Tracer::instance() {
+    return _instance;
+}
+
+qint64 Tracer::now() {
+    // never 0, that marks a skipped stage
+    return traceClock().nsecsElapsed() / 1000 + 1;
+}
+
+void Tracer::begin(Trace& trace) {
+    trace = Trace{};
+    trace.active = (_instance != nullptr);
+
+    if (trace.active) {
+        trace.mark(Stage::Started);
+    }
+}
+
+void Tracer::finish(Trace& trace, quint64 id, const QString& host) {
+    const auto tracer = _instance;
+
+    if (!trace.active || !tracer) {
+        trace = Trace{};
+        return;
+    }
+
+    trace.mark(Stage::Finished);
+    static thread_local quint32 counter = 0;
+    const auto rate    = static_cast<quint32>(qMax(1, tracer->_options.sampleRate));
+    const auto sampled = tracer->_writer && ((counter++ % rate) == 0);
+    QByteArray events;
+    auto previous = 0;
+
+    // each gap belongs to the stage that ends it, skipped stages fold into the next one
+    for (auto stage = 1; stage < kStages; ++stage) {
+        if (trace.stamps[stage] == 0) {
+            continue;
+        }
+
+        const auto begin    = trace.stamps[previous];
+        const auto duration = trace.stamps[stage] - begin;
+        Metrics::observe(static_cast<Metrics::Histogram>(static_cast<int>(Metrics::Histogram::StageHead) + stage - 1), duration);
+        previous = stage;
+
+        if (sampled) {
+            events += QByteArrayLiteral("{\"name\":\"") + kSpanNames[stage]
+                      + "\",\"cat\":\"proxy\",\"ph\":\"X\",\"ts\":" + QByteArray::number(begin)
+                      + ",\"dur\":" + QByteArray::number(duration)
+                      + ",\"pid\":" + QByteArray::number(QCoreApplication::applicationPid())
+                      + ",\"tid\":" + QByteArray::number(id)
+                      + ",\"args\":{\"host\":\"" + host.toLatin1().replace('\\', "\\\\").replace('"', "\\\"") + "\"}},\n";
+        }
+    }
+
+    if (sampled && !events.isEmpty()) {
+        QMutexLocker locker(&tracer->_lock);
+
+        // a stalled disk costs traces, never memory
+        if (tracer->_pending.size() < kMaxPending) {
+            tracer->_pending += events;
+            tracer->_exported.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    trace = Trace{};
+}
+
+quint64 Tracer::exported() const {
+    return _exported.load(std::memory_order_relaxed);
+}
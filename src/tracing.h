@@ -0,0 +1,92 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <atomic>
+
+class TracerWriter;
+
+///
+/// \brief The Tracer class
+/// Optional per-request lifecycle tracing. A connection stamps the monotonic
+/// clock at each stage it passes; finish() folds the gaps between stages into
+/// per-stage histograms and exports one trace in sampleRate as Chrome trace
+/// events (chrome://tracing, Perfetto) through a background writer. While no
+/// tracer exists a connection pays one predictable branch per stage, building
+/// without PROXY_TRACING leaves not even that.
+///
+class Tracer final {
+  public:
+    enum class Stage : quint8 {
+        Started,    // accepted, or the previous request on the connection finished
+        HeadRead,   // request head complete
+        Resolved,   // upstream addresses known
+        Connected,  // upstream connected or taken from the pool
+        Responded,  // response head, 200 Connection established or a cached response went out
+        Finished,
+        Count
+    };
+
+    struct Options {
+        bool enabled   = false;
+        QString path;          // Chrome trace JSON, empty: histograms only
+        int sampleRate = 100;  // export one trace in N
+    };
+
+    ///
+    /// \brief The Trace struct
+    /// Stage stamps of one request in us of the tracer clock, 0 for stages it skipped.
+    ///
+    struct Trace {
+        qint64 stamps[static_cast<int>(Stage::Count)] = {};
+        bool active = false;
+
+        void mark(Stage stage) {
+            stamps[static_cast<int>(stage)] = Tracer::now();
+        }
+    };
+
+    explicit Tracer(const Options& options);
+    ~Tracer();
+
+    static Tracer* instance();
+    static qint64 now();
+
+    ///
+    /// Starts \a trace now, or leaves it inactive when there is no tracer.
+    ///
+    static void begin(Trace& trace);
+
+    ///
+    /// Records the completed \a trace of a request to \a host on connection \a id and clears it.
+    ///
+    static void finish(Trace& trace, quint64 id, const QString& host);
+
+    quint64 exported() const;
+
+  private:
+    friend class TracerWriter;
+
+    const Options _options;
+    QMutex _lock;
+    QByteArray _pending;  // events not written yet
+    std::atomic<quint64> _exported{0};
+    TracerWriter* _writer = nullptr;
+
+    static Tracer* _instance;
+};
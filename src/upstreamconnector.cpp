@@ -0,0 +1,173 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "upstreamconnector.h"
+#include "slabpool.h"
+
+UpstreamConnector::UpstreamConnector(const QList<QHostAddress>& addresses, quint16 port,
+                                     int attemptDelay, int timeout, const SocketTuning& tuning, QObject* parent) : QObject(parent),
+    _port{port}, _tuning{tuning}, _addresses{sortAddresses(addresses)} {
+    _attemptTimer = new QTimer(this);
+    _attemptTimer->setSingleShot(true);
+    _attemptTimer->setInterval(qMax(10, attemptDelay));
+    QObject::connect(_attemptTimer, &QTimer::timeout, this, &UpstreamConnector::startNextAttempt);
+
+    _timeoutTimer = new QTimer(this);
+    _timeoutTimer->setSingleShot(true);
+    _timeoutTimer->setInterval(timeout);
+    QObject::connect(_timeoutTimer, &QTimer::timeout, this, [this]() {
+        _lastError = QStringLiteral("Connect timed out");
+        _timedOut  = true;
+        finish();
+    });
+}
+
+UpstreamConnector::~UpstreamConnector() {
+    for (const auto& socket : qAsConst(_attempts)) {
+        socket->blockSignals(true);
+        socket->abort();
+    }
+}
+
+void UpstreamConnector::start() {
+    if (_timeoutTimer->interval() > 0) {
+        _timeoutTimer->start();
+    }
+
+    startNextAttempt();
+}
+
+QList<QHostAddress> UpstreamConnector::sortAddresses(const QList<QHostAddress>& addresses) {
+    // RFC 8305 section 4: alternate families, preferring IPv6 first
+    QList<QHostAddress> ipv6;
+    QList<QHostAddress> ipv4;
+
+    for (const auto& address : addresses) {
+        auto& family = (address.protocol() == QAbstractSocket::IPv6Protocol) ? ipv6 : ipv4;
+
+        if (!family.contains(address)) {
+            family.append(address);
+        }
+    }
+
+    QList<QHostAddress> sorted;
+    sorted.reserve(ipv6.size() + ipv4.size());
+
+    for (auto i = 0; i < qMax(ipv6.size(), ipv4.size()); ++i) {
+        if (i < ipv6.size()) {
+            sorted.append(ipv6.at(i));
+        }
+
+        if (i < ipv4.size()) {
+            sorted.append(ipv4.at(i));
+        }
+    }
+
+    return sorted;
+}
+
+void UpstreamConnector::startNextAttempt() {
+    if (_done) {
+        return;
+    }
+
+    if (_next >= _addresses.size()) {
+        // nothing left to start, wait for the attempts in flight
+        if (_attempts.isEmpty()) {
+            finish();
+        }
+
+        return;
+    }
+
+    const auto address = _addresses.at(_next++);
+    auto socket        = QSharedPointer<QTcpSocket>(new PooledTcpSocket, &QObject::deleteLater);
+    const auto raw     = socket.get();
+    _attempts.append(socket);
+
+    if (_tuning.beforeConnect()) {
+        // binding creates the descriptor, connectToHost() then reuses it
+        const auto any = (address.protocol() == QAbstractSocket::IPv6Protocol) ? QHostAddress::AnyIPv6 : QHostAddress::AnyIPv4;
+
+        if (raw->bind(QHostAddress(any), 0)) {
+            tuneSocket(*raw, _tuning, true);
+        }
+    }
+
+    QObject::connect(raw, &QTcpSocket::connected, this, [this, raw, address]() {
+        if (_done) {
+            return;
+        }
+
+        tuneSocket(*raw, _tuning);
+
+        for (auto i = 0; i < _attempts.size(); ++i) {
+            if (_attempts.at(i).get() == raw) {
+                const auto winner = _attempts.takeAt(i);
+                QObject::disconnect(raw, nullptr, this, nullptr);
+                _done = true;
+                _attemptTimer->stop();
+                _timeoutTimer->stop();
+                Q_EMIT connected(winner, address);
+                return;
+            }
+        }
+    });
+    QObject::connect(raw, qOverload<QAbstractSocket::SocketError>(&QTcpSocket::error), this, [this, raw](QAbstractSocket::SocketError) {
+        attemptFailed(raw);
+    });
+
+    raw->connectToHost(address, _port);
+    _attemptTimer->start();
+}
+
+void UpstreamConnector::attemptFailed(QTcpSocket* socket) {
+    _lastError = socket->errorString();
+
+    for (auto i = 0; i < _attempts.size(); ++i) {
+        if (_attempts.at(i).get() == socket) {
+            QObject::disconnect(socket, nullptr, this, nullptr);
+            _attempts.removeAt(i);
+            break;
+        }
+    }
+
+    if (_done) {
+        return;
+    }
+
+    // a failure does not have to wait for the attempt delay
+    _attemptTimer->stop();
+    startNextAttempt();
+}
+
+void UpstreamConnector::finish() {
+    if (_done) {
+        return;
+    }
+
+    _done = true;
+    _attemptTimer->stop();
+    _timeoutTimer->stop();
+
+    for (const auto& socket : qAsConst(_attempts)) {
+        QObject::disconnect(socket.get(), nullptr, this, nullptr);
+        socket->abort();
+    }
+
+    _attempts.clear();
+    Q_EMIT failed(_lastError.isEmpty() ? QStringLiteral("No address to connect to") : _lastError, _timedOut);
+}
@@ -0,0 +1,62 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <QtNetwork>
+#include "socketutils.h"
+
+///
+/// \brief The UpstreamConnector class
+/// Races TCP connects across the addresses of one host, RFC 8305 style:
+/// families are interleaved starting with IPv6, a new attempt starts every
+/// attempt delay or as soon as the previous one fails, and the first socket to
+/// connect wins while the others are aborted. Every attempt gets the socket
+/// tuning, the options that matter for the handshake before it connects.
+///
+class UpstreamConnector final : public QObject {
+    Q_OBJECT
+
+  public:
+    UpstreamConnector(const QList<QHostAddress>& addresses, quint16 port,
+                      int attemptDelay, int timeout, const SocketTuning& tuning = {}, QObject* parent = nullptr);
+    ~UpstreamConnector() override;
+
+    void start();
+
+    static QList<QHostAddress> sortAddresses(const QList<QHostAddress>& addresses);
+
+  Q_SIGNALS:
+    void connected(const QSharedPointer<QTcpSocket>& socket, const QHostAddress& address);
+    void failed(const QString& reason, bool timedOut);
+
+  private:
+    void startNextAttempt();
+    void attemptFailed(QTcpSocket* socket);
+    void finish();
+
+    const quint16 _port = 0;
+    const SocketTuning _tuning;
+    QList<QHostAddress> _addresses;
+    QVector<QSharedPointer<QTcpSocket>> _attempts;
+    QTimer* _attemptTimer = nullptr;
+    QTimer* _timeoutTimer = nullptr;
+    QString _lastError;
+    int _next      = 0;
+    bool _done     = false;
+    bool _timedOut = false;
+};
@@ -0,0 +1,175 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#include "upstreampool.h"
+
+UpstreamPool::UpstreamPool(const Limits& limits, QObject* parent) : QObject(parent), _limits{limits} {
+    _clock.start();
+    _sweepTimer = new QTimer(this);
+    _sweepTimer->setInterval(qMax(1000, _limits.idleTimeout / 4));
+    QObject::connect(_sweepTimer, &QTimer::timeout, this, &UpstreamPool::sweep);
+}
+
+UpstreamPool::~UpstreamPool() {
+    for (const auto& sockets : qAsConst(_idle)) {
+        for (const auto& idle : sockets) {
+            discard(idle.socket);
+        }
+    }
+}
+
+void UpstreamPool::setLimits(const Limits& limits) {
+    _limits = limits;
+    _sweepTimer->setInterval(qMax(1000, _limits.idleTimeout / 4));
+    sweep();
+}
+
+QSharedPointer<QTcpSocket> UpstreamPool::acquire(const QHostAddress& address, quint16 port) {
+    auto it = _idle.find(qMakePair(address, port));
+
+    while ((it != _idle.end()) && !it->isEmpty()) {
+        // the most recently used socket is the least likely to have been closed by the origin
+        const auto idle = it->takeLast();
+        --_count;
+        QObject::disconnect(idle.socket.get(), nullptr, this, nullptr);
+
+        if ((idle.socket->state() == QAbstractSocket::ConnectedState)
+                && (idle.socket->bytesAvailable() == 0)
+                && (_clock.elapsed() - idle.since < _limits.idleTimeout)) {
+            if (it->isEmpty()) {
+                _idle.erase(it);
+            }
+
+            _hits.fetch_add(1, std::memory_order_relaxed);
+            return idle.socket;
+        }
+
+        discard(idle.socket);
+    }
+
+    if ((it != _idle.end()) && it->isEmpty()) {
+        _idle.erase(it);
+    }
+
+    _misses.fetch_add(1, std::memory_order_relaxed);
+    return {};
+}
+
+void UpstreamPool::release(const QHostAddress& address, quint16 port, const QSharedPointer<QTcpSocket>& socket) {
+    // a limit of 0 keeps nothing, the per-host list below must never be created empty
+    if ((socket->state() != QAbstractSocket::ConnectedState) || (_limits.maxIdlePerHost <= 0) || (_limits.maxIdle <= 0)) {
+        discard(socket);
+        return;
+    }
+
+    const auto key = qMakePair(address, port);
+    auto& sockets  = _idle[key];
+
+    if (!sockets.isEmpty() && (sockets.size() >= _limits.maxIdlePerHost)) {
+        // keep the freshest ones for this host
+        const auto oldest = sockets.takeFirst();
+        --_count;
+        QObject::disconnect(oldest.socket.get(), nullptr, this, nullptr);
+        discard(oldest.socket);
+    }
+
+    if (_count >= _limits.maxIdle) {
+        discard(socket);
+
+        if (sockets.isEmpty()) {
+            _idle.remove(key);
+        }
+
+        return;
+    }
+
+    // an idle socket must stay silent, anything it reports means it is gone
+    const auto raw = socket.get();
+    QObject::connect(raw, &QTcpSocket::readyRead,    this, [this, key, raw]() {
+        evict(key, raw);
+    });
+    QObject::connect(raw, &QTcpSocket::disconnected, this, [this, key, raw]() {
+        evict(key, raw);
+    });
+    QObject::connect(raw, qOverload<QAbstractSocket::SocketError>(&QTcpSocket::error), this, [this, key, raw](QAbstractSocket::SocketError) {
+        evict(key, raw);
+    });
+
+    sockets.append({socket, _clock.elapsed()});
+    ++_count;
+
+    if (!_sweepTimer->isActive()) {
+        _sweepTimer->start();
+    }
+}
+
+int UpstreamPool::idleCount() const {
+    return _count;
+}
+
+quint64 UpstreamPool::hits() const {
+    return _hits.load(std::memory_order_relaxed);
+}
+
+quint64 UpstreamPool::misses() const {
+    return _misses.load(std::memory_order_relaxed);
+}
+
+void UpstreamPool::evict(const Key& key, QTcpSocket* socket) {
+    auto it = _idle.find(key);
+
+    if (it == _idle.end()) {
+        return;
+    }
+
+    for (auto i = 0; i < it->size(); ++i) {
+        if (it->at(i).socket.get() == socket) {
+            const auto idle = it->takeAt(i);
+            --_count;
+            QObject::disconnect(socket, nullptr, this, nullptr);
+            discard(idle.socket);
+            break;
+        }
+    }
+
+    if (it->isEmpty()) {
+        _idle.erase(it);
+    }
+}
+
+void UpstreamPool::discard(const QSharedPointer<QTcpSocket>& socket) {
+    socket->blockSignals(true);
+    socket->abort();
+}
+
+void UpstreamPool::sweep() {
+    const auto now = _clock.elapsed();
+
+    for (auto it = _idle.begin(); it != _idle.end();) {
+        while (!it->isEmpty() && (now - it->first().since >= _limits.idleTimeout)) {
+            const auto idle = it->takeFirst();
+            --_count;
+            QObject::disconnect(idle.socket.get(), nullptr, this, nullptr);
+            discard(idle.socket);
+        }
+
+        it = it->isEmpty() ? _idle.erase(it) : std::next(it);
+    }
+
+    if (_count == 0) {
+        _sweepTimer->stop();
+    }
+}
@@ -0,0 +1,73 @@
+/*
+ * This is a HTTP/HTTPS forward proxy server implementation
+ * capable for running inside shared libraries (.dll/.so)
+ * Copyright (C) 2022 Iman Ahmadvand
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+*/
+
+#pragma once
+
+#include <QtCore>
+#include <QtNetwork>
+#include <atomic>
+
+///
+/// \brief The UpstreamPool class
+/// Keeps idle keep-alive upstream sockets keyed by (resolved address, port) so
+/// later plain HTTP requests can skip the TCP connect. Not thread-safe: every
+/// worker owns its own pool since sockets are bound to the thread they live on.
+///
+class UpstreamPool final : public QObject {
+    Q_OBJECT
+
+  public:
+    struct Limits {
+        int maxIdlePerHost = 8;
+        int maxIdle        = 256;
+        int idleTimeout    = 30000;  // ms
+    };
+
+    explicit UpstreamPool(const Limits& limits, QObject* parent = nullptr);
+    ~UpstreamPool() override;
+
+    QSharedPointer<QTcpSocket> acquire(const QHostAddress& address, quint16 port);
+    void release(const QHostAddress& address, quint16 port, const QSharedPointer<QTcpSocket>& socket);
+
+    ///
+    /// Applies \a limits from now on, idle sockets past the new timeout go on the next sweep.
+    ///
+    void setLimits(const Limits& limits);
+
+    int     idleCount() const;
+    quint64 hits() const;
+    quint64 misses() const;
+
+  private:
+    using Key = QPair<QHostAddress, quint16>;
+
+    struct Idle {
+        QSharedPointer<QTcpSocket> socket;
+        qint64 since = 0;
+    };
+
+    void evict(const Key& key, QTcpSocket* socket);
+    void discard(const QSharedPointer<QTcpSocket>& socket);
+    void sweep();
+
+    Limits _limits;
+    QHash<Key, QList<Idle>> _idle;  // oldest first
+    QTimer* _sweepTimer = nullptr;
+    QElapsedTimer _clock;
+    int _count = 0;
+    std::atomic<quint64> _hits{0};
+    std::atomic<quint64> _misses{0};
+};